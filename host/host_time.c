@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stdbool.h>
+
+#include "pico/stdlib.h"
+
+#include "host_time.h"
+
+static bool fake_time;
+static uint32_t fake_time_us;
+
+// The host platform's hardware_timer defines "timer_us_32" instead of
+// time_us_32, so provide the real one here.
+uint32_t time_us_32(void)
+{
+	if (fake_time) {
+		return fake_time_us;
+	}
+
+	return (uint32_t)time_us_64();
+}
+
+void host_time_set_us(uint32_t us)
+{
+	fake_time = true;
+	fake_time_us = us;
+}
+
+void host_time_release(void)
+{
+	fake_time = false;
+}
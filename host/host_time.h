@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef HOST_TIME_H
+#define HOST_TIME_H
+
+#include <stdint.h>
+
+// Stop time_us_32() at us, for checks which need to control time
+void host_time_set_us(uint32_t us);
+
+// Back to the real clock
+void host_time_release(void);
+
+#endif // HOST_TIME_H
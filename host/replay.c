@@ -0,0 +1,1539 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+// Replays a recorded stream of HID reports through the same decode and
+// button handling code as the firmware, and reports how fast it went.
+//
+// Reports are read as lines of hex bytes, as printed by printf_hexdump() -
+// uncomment it in hid_host_handle_interrupt_report() to record a stream.
+// Lines which aren't just hex bytes are skipped, so a raw serial log works.
+// The HID descriptor, if given, is the same format.
+//
+// ButtonHandler() prints to stdout as usual, the results go to stderr, so
+// for benchmarking run something like:
+//   picow_ds4_replay -n 1000 reports.txt > /dev/null
+//
+// With -c, the recording is also played as that many controllers at once,
+// each starting at a different point in it, to check the shared queue keeps
+// up and nothing gets mixed up between them.
+//
+// With -w, that many reports are fed in from a second thread at 800 Hz, in
+// real time, and the main loop's time from decode to handling each one is
+// measured: once waking on the semaphore, and once polling every 20 ms.
+
+#include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+#include "btstack_hid_parser.h"
+#include "btstack_util.h"
+
+#include "bt_hid.h"
+#include "bt_hid_report.h"
+#include "buttons.h"
+#include "combo.h"
+#include "hid_decoder.h"
+#include "hid_profile.h"
+#include "host_time.h"
+#include "stick.h"
+
+#define MAX_REPORTS    16384
+#define MAX_REPORT_LEN (HID_DECODER_MAX_REPORT_LEN + 1)
+#define MAX_LINE       1024
+
+struct recording {
+	unsigned int n;
+	uint16_t len[MAX_REPORTS];
+	uint8_t data[MAX_REPORTS][MAX_REPORT_LEN];
+};
+
+static struct recording recording;
+static uint8_t descriptor[512];
+static uint16_t descriptor_len;
+
+// Parse a line of hex bytes. Returns the number of bytes, or -1 if the line
+// is anything else.
+static int parse_hex_line(char *line, uint8_t *dst, int max)
+{
+	int n = 0;
+
+	for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+		char *end;
+
+		if ((strlen(tok) != 2) || (n == max)) {
+			return -1;
+		}
+
+		dst[n++] = strtoul(tok, &end, 16);
+		if (*end != '\0') {
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+static int load_reports(const char *path)
+{
+	char line[MAX_LINE];
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) && (recording.n < MAX_REPORTS)) {
+		int len = parse_hex_line(line, recording.data[recording.n], MAX_REPORT_LEN);
+		if (len >= 2) {
+			recording.len[recording.n++] = len;
+		}
+	}
+
+	fclose(fp);
+	return recording.n;
+}
+
+static int load_descriptor(const char *path)
+{
+	char line[MAX_LINE];
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		int len = parse_hex_line(line, &descriptor[descriptor_len], sizeof(descriptor) - descriptor_len);
+		if (len > 0) {
+			descriptor_len += len;
+		}
+	}
+
+	fclose(fp);
+	return descriptor_len;
+}
+
+// The same as the loop in main(), minus the waiting
+static void run_pipeline(struct buttonStatus *status, struct combo_status *combos)
+{
+	for (unsigned int i = 0; i < recording.n; i++) {
+		hid_host_handle_interrupt_report(0, recording.data[i], recording.len[i]);
+
+		const struct bt_hid_report *report;
+		while ((report = bt_hid_peek_report())) {
+			uint16_t changed = ButtonHandler(report->state, &report->sticks, &status[report->idx]);
+			combo_update(&combos[report->idx], changed, status[report->idx].held, report->time_us);
+			bt_hid_release_report();
+		}
+	}
+}
+
+// The recording as n simulated controllers. Each round, every controller
+// delivers burst reports (as if they'd queued up in the radio while we were
+// busy), then the app drains the queue. Returns the number of problems.
+static unsigned int run_controllers(unsigned int n, unsigned int burst, unsigned int loops,
+                                    uint16_t vendor_id, uint16_t product_id)
+{
+	struct buttonStatus status[BT_HID_MAX_CONTROLLERS] = { 0 };
+	struct combo_status combos[BT_HID_MAX_CONTROLLERS] = { 0 };
+	uint32_t received[BT_HID_MAX_CONTROLLERS] = { 0 };
+	unsigned int pos[BT_HID_MAX_CONTROLLERS];
+	unsigned int problems = 0;
+	struct bt_hid_ring_stats before, after;
+
+	// All the same kind of controller, set up the same way as the first
+	for (unsigned int c = 0; c < n; c++) {
+		pos[c] = c * recording.n / n;
+		bt_hid_report_reset(c);
+		if (vendor_id || product_id) {
+			bt_hid_report_set_device_id(c, vendor_id, product_id);
+		}
+		if (descriptor_len) {
+			bt_hid_report_set_descriptor(c, descriptor, descriptor_len);
+		}
+	}
+	bt_hid_get_ring_stats(&before);
+
+	uint64_t sent = 0;
+	uint64_t start = time_us_64();
+	for (unsigned int l = 0; l < loops; l++) {
+		for (unsigned int i = 0; i < recording.n; i += burst) {
+			for (unsigned int c = 0; c < n; c++) {
+				for (unsigned int b = 0; b < burst; b++) {
+					unsigned int r = pos[c];
+					pos[c] = (r + 1) % recording.n;
+					hid_host_handle_interrupt_report(c, recording.data[r], recording.len[r]);
+					sent++;
+				}
+			}
+
+			const struct bt_hid_report *report;
+			while ((report = bt_hid_peek_report())) {
+				received[report->idx]++;
+				uint16_t changed = ButtonHandler(report->state, &report->sticks, &status[report->idx]);
+				combo_update(&combos[report->idx], changed, status[report->idx].held, report->time_us);
+				bt_hid_release_report();
+			}
+		}
+	}
+	uint64_t elapsed_us = time_us_64() - start;
+	bt_hid_get_ring_stats(&after);
+
+	if (!elapsed_us) {
+		elapsed_us = 1;
+	}
+
+	fprintf(stderr, "%u controllers, bursts of %u: %10" PRIu64 " reports/s (%.1fx %u at 800 Hz), high water %" PRIu32 "\n",
+	        n, burst, sent * 1000000 / elapsed_us, (double)sent * 1000000 / elapsed_us / (n * 800), n,
+	        after.high_water);
+
+	// Every controller's latest should be its own last report
+	for (unsigned int c = 0; c < n; c++) {
+		const struct hid_profile *profile = bt_hid_report_get_profile(c);
+		unsigned int last = (pos[c] + recording.n - 1) % recording.n;
+		struct bt_hid_state latest, expected;
+
+		bt_hid_get_latest(c, &latest);
+		if (profile->decode(bt_hid_report_get_decoder(c), &recording.data[last][1], recording.len[last] - 1, &expected) &&
+		    memcmp(&latest, &expected, sizeof(latest))) {
+			fprintf(stderr, "  controller %u: latest state doesn't match its last report\n", c);
+			problems++;
+		}
+		fprintf(stderr, "  controller %u: %" PRIu32 " reports\n", c, received[c]);
+	}
+
+	uint32_t dropped = after.dropped - before.dropped;
+	if (dropped) {
+		fprintf(stderr, "  %" PRIu32 " reports dropped\n", dropped);
+		problems++;
+	}
+
+	return problems;
+}
+
+// Take the next queued report, and check it's the expected type from
+// controller 0
+static unsigned int expect_report(enum bt_hid_report_type type, const char *step)
+{
+	const struct bt_hid_report *report = bt_hid_peek_report();
+	if (!report) {
+		fprintf(stderr, "  %s: nothing queued\n", step);
+		return 1;
+	}
+
+	unsigned int problems = (report->type != type) || (report->idx != 0);
+	if (problems) {
+		fprintf(stderr, "  %s: got type %d from controller %d\n", step, report->type, report->idx);
+	}
+	bt_hid_release_report();
+
+	if (bt_hid_peek_report()) {
+		fprintf(stderr, "  %s: more queued than expected\n", step);
+		while (bt_hid_peek_report()) {
+			bt_hid_release_report();
+		}
+		problems++;
+	}
+
+	return problems;
+}
+
+static unsigned int expect_latest(const struct bt_hid_state *expected, const char *step)
+{
+	struct bt_hid_state latest;
+
+	bt_hid_get_latest(0, &latest);
+	if (memcmp(&latest, expected, sizeof(latest))) {
+		fprintf(stderr, "  %s: wrong latest state\n", step);
+		return 1;
+	}
+
+	return 0;
+}
+
+static unsigned int expect_stale(uint32_t expected, const char *step)
+{
+	uint32_t stale = bt_hid_report_check_stale();
+	if (stale != expected) {
+		fprintf(stderr, "  %s: stale mask 0x%" PRIx32 ", expected 0x%" PRIx32 "\n", step, stale, expected);
+		return 1;
+	}
+
+	return 0;
+}
+
+// A Switch Pro only sends report 0x3f when its input changes, so holding a
+// button for longer than the timeout mustn't look like a stale controller.
+// Uses the last slot, so controller 0 keeps its profile.
+static unsigned int check_stale_on_change(void)
+{
+	const unsigned int idx = BT_HID_MAX_CONTROLLERS - 1;
+	const uint32_t timeout_us = BT_HID_STALE_TIMEOUT_MS * 1000;
+	// Header, report ID, B held, hat centred, sticks centred
+	const uint8_t packet[] = {
+		0xa1, 0x3f, 0x01, 0x00, 0x08,
+		0x00, 0x80, 0x00, 0x80, 0x00, 0x80, 0x00, 0x80,
+	};
+	struct bt_hid_state held, latest;
+	unsigned int problems = 0;
+
+	if (!timeout_us) {
+		return 0;
+	}
+
+	const struct hid_profile *profile = bt_hid_report_set_device_id(idx, 0x057e, 0x2009);
+	if (!profile || !profile->reports_on_change) {
+		fprintf(stderr, "  no report-on-change profile for the Switch Pro\n");
+		bt_hid_report_reset(idx);
+		return 1;
+	}
+
+	uint32_t t = 1000000;
+	host_time_set_us(t);
+	hid_host_handle_interrupt_report(idx, packet, sizeof(packet));
+	while (bt_hid_peek_report()) {
+		bt_hid_release_report();
+	}
+	bt_hid_get_latest(idx, &held);
+	if (!(held.buttons & (1 << 5))) {
+		fprintf(stderr, "  Switch Pro report didn't decode\n");
+		problems++;
+	}
+
+	// Still held, many timeouts later
+	host_time_set_us(t += 10 * timeout_us);
+	// Controller 0 is still armed from check_stale(), and can go stale here
+	if (bt_hid_report_check_stale() & (1u << idx)) {
+		fprintf(stderr, "  Switch Pro went stale while holding a button\n");
+		problems++;
+	}
+	const struct bt_hid_report *report;
+	while ((report = bt_hid_peek_report())) {
+		if (report->idx == idx) {
+			fprintf(stderr, "  Switch Pro queued a report while holding a button\n");
+			problems++;
+		}
+		bt_hid_release_report();
+	}
+	bt_hid_get_latest(idx, &latest);
+	if (memcmp(&latest, &held, sizeof(latest))) {
+		fprintf(stderr, "  Switch Pro let go of a held button\n");
+		problems++;
+	}
+
+	host_time_release();
+	bt_hid_report_reset(idx);
+
+	return problems;
+}
+
+// Walk controller 0 through the stale input watchdog, with a fake clock:
+// fresh, stale, recovered, stale again, and switched off, then a controller
+// which only reports on change. Returns the number of problems.
+static unsigned int check_stale(void)
+{
+	const struct hid_profile *profile = bt_hid_report_get_profile(0);
+	const struct hid_decoder *decoder = bt_hid_report_get_decoder(0);
+	const uint32_t timeout_us = BT_HID_STALE_TIMEOUT_MS * 1000;
+	struct bt_hid_state decoded;
+	unsigned int problems = 0;
+	unsigned int r;
+
+	if (!timeout_us) {
+		fprintf(stderr, "Stale input watchdog is off\n");
+		return 0;
+	}
+
+	for (r = 0; r < recording.n; r++) {
+		if (profile->decode(decoder, &recording.data[r][1], recording.len[r] - 1, &decoded)) {
+			break;
+		}
+	}
+	if (r == recording.n) {
+		fprintf(stderr, "No decodable reports to check the watchdog with\n");
+		return 1;
+	}
+
+	uint32_t t = 1000000;
+	host_time_set_us(t);
+
+	// Nothing's been received yet, so there's nothing to go stale
+	host_time_set_us(t += 10 * timeout_us);
+	problems += expect_stale(0, "before any reports");
+
+	hid_host_handle_interrupt_report(0, recording.data[r], recording.len[r]);
+	problems += expect_report(BT_HID_REPORT_INPUT, "first report");
+	problems += expect_latest(&decoded, "first report");
+
+	host_time_set_us(t += timeout_us - 1);
+	problems += expect_stale(0, "just before the timeout");
+	problems += expect_latest(&decoded, "just before the timeout");
+
+	host_time_set_us(t += 1);
+	problems += expect_stale(1, "timeout");
+	problems += expect_report(BT_HID_REPORT_STALE, "timeout");
+	problems += expect_latest(&default_state, "timeout");
+
+	// Only one event per timeout
+	host_time_set_us(t += 10 * timeout_us);
+	problems += expect_stale(0, "still stale");
+	problems += expect_latest(&default_state, "still stale");
+
+	hid_host_handle_interrupt_report(0, recording.data[r], recording.len[r]);
+	problems += expect_report(BT_HID_REPORT_INPUT, "recovered");
+	problems += expect_latest(&decoded, "recovered");
+	problems += expect_stale(0, "recovered");
+
+	host_time_set_us(t += timeout_us);
+	problems += expect_stale(1, "stale again");
+	problems += expect_report(BT_HID_REPORT_STALE, "stale again");
+
+	bt_hid_set_stale_timeout_ms(0);
+	hid_host_handle_interrupt_report(0, recording.data[r], recording.len[r]);
+	problems += expect_report(BT_HID_REPORT_INPUT, "watchdog off");
+	host_time_set_us(t += 10 * timeout_us);
+	problems += expect_stale(0, "watchdog off");
+	problems += expect_latest(&decoded, "watchdog off");
+
+	bt_hid_set_stale_timeout_ms(BT_HID_STALE_TIMEOUT_MS);
+	host_time_release();
+
+	problems += check_stale_on_change();
+
+	fprintf(stderr, "Stale input watchdog: %s\n", problems ? "FAILED" : "ok");
+	return problems;
+}
+
+// The seqlock around each controller's latest state, with a real second
+// thread: one writes as fast as it can, the other reads, and no read may
+// return a mix of two writes. Every byte of the written report is the same
+// value, k, so the state for each k is known and a read has to match one of
+// them exactly, and both sticks always come out the same.
+#define TORN_WRITES 2000000
+
+struct torn_reader {
+	unsigned int idx;
+	const struct bt_hid_state *expected;
+	const int16_t *k_of_lx;
+	atomic_bool stop;
+	uint64_t reads;
+	uint64_t torn;
+};
+
+static void *torn_read_thread(void *arg)
+{
+	struct torn_reader *r = arg;
+
+	while (!atomic_load(&r->stop)) {
+		struct bt_hid_state state;
+		struct bt_hid_sticks sticks;
+
+		bt_hid_get_latest(r->idx, &state);
+		int k = r->k_of_lx[state.lx];
+		if ((k < 0) || memcmp(&state, &r->expected[k], sizeof(state))) {
+			r->torn++;
+		}
+
+		// Read separately from the state, so only consistent within itself.
+		// Both sticks were written from the same k.
+		bt_hid_get_latest_sticks(r->idx, &sticks);
+		if ((sticks.lx != sticks.rx) || (sticks.ly != sticks.ry)) {
+			r->torn++;
+		}
+
+		r->reads += 2;
+	}
+
+	return NULL;
+}
+
+static unsigned int check_torn_reads(void)
+{
+	const unsigned int idx = BT_HID_MAX_CONTROLLERS - 1;
+	static struct bt_hid_state expected[256];
+	static int16_t k_of_lx[256];
+	uint8_t reports[256][11];
+	struct torn_reader reader = {
+		.idx = idx,
+		.expected = expected,
+		.k_of_lx = k_of_lx,
+	};
+	pthread_t thread;
+
+	bt_hid_report_reset(idx);
+	const struct hid_profile *profile = bt_hid_report_get_profile(idx);
+	const struct hid_decoder *decoder = bt_hid_report_get_decoder(idx);
+
+	// Each k has to give a different lx, or the reader can't tell which
+	// write it saw
+	memset(k_of_lx, 0xff, sizeof(k_of_lx));
+	for (unsigned int k = 0; k < 256; k++) {
+		reports[k][0] = 0xa1;
+		reports[k][1] = 0x01;
+		memset(&reports[k][2], k, sizeof(reports[k]) - 2);
+
+		if (!profile->decode(decoder, &reports[k][1], sizeof(reports[k]) - 1, &expected[k]) ||
+		    (k_of_lx[expected[k].lx] >= 0)) {
+			fprintf(stderr, "Torn reads: can't check, the reports don't decode to distinct states\n");
+			return 1;
+		}
+		k_of_lx[expected[k].lx] = k;
+	}
+
+	// So the reader never sees the default state
+	hid_host_handle_interrupt_report(idx, reports[0], sizeof(reports[0]));
+	bt_hid_release_report();
+
+	atomic_init(&reader.stop, false);
+	uint32_t retries = bt_hid_get_latest_retries();
+	if (pthread_create(&thread, NULL, torn_read_thread, &reader)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	for (unsigned int i = 1; i <= TORN_WRITES; i++) {
+		hid_host_handle_interrupt_report(idx, reports[i & 0xff], sizeof(reports[0]));
+		// Keep the queue empty, nothing else is reading it
+		while (bt_hid_peek_report()) {
+			bt_hid_release_report();
+		}
+	}
+
+	atomic_store(&reader.stop, true);
+	pthread_join(thread, NULL);
+	retries = bt_hid_get_latest_retries() - retries;
+	bt_hid_report_reset(idx);
+
+	fprintf(stderr, "Torn reads: %s, %" PRIu64 " of %" PRIu64 " reads torn, %" PRIu32 " retries during %u writes\n",
+	        reader.torn ? "FAILED" : "ok", reader.torn, reader.reads, retries, TORN_WRITES);
+	return reader.torn ? 1 : 0;
+}
+
+// What stick_condition() does, in floating point, to check it against
+static void stick_condition_float(uint8_t raw_x, uint8_t raw_y, float *x, float *y)
+{
+	float cx = fmaxf((float)raw_x - 0x80, -127);
+	float cy = -fmaxf((float)raw_y - 0x80, -127);
+	float r = sqrtf(cx * cx + cy * cy);
+	float t, out;
+
+	if (r <= STICK_DEADZONE) {
+		*x = *y = 0;
+		return;
+	}
+
+	t = r >= STICK_OUTER ? 1.0f : (r - STICK_DEADZONE) / (STICK_OUTER - STICK_DEADZONE);
+	t += (STICK_EXPO / 32767.0f) * (t * t * t - t);
+	out = STICK_ANTI_DEADZONE / 32767.0f + t * (1.0f - STICK_ANTI_DEADZONE / 32767.0f);
+
+	*x = cx * out / r;
+	*y = cy * out / r;
+}
+
+// Every possible stick position, fixed point against float. The table is
+// indexed by the integer radius, so expect up to one radius step of error
+// where the curve is steepest (the outer edge, with expo).
+static unsigned int check_sticks(unsigned int loops)
+{
+	int max_err = 0, max_raw_x = 0, max_raw_y = 0;
+	int tolerance = (1 + 2 * STICK_EXPO / 32767.0) * (32767 - STICK_ANTI_DEADZONE) /
+	                (STICK_OUTER - STICK_DEADZONE) + 2;
+	bool in_deadzone_moved = false;
+	int16_t x, y;
+	float fx, fy;
+	// So the loops don't get optimised out
+	volatile int32_t sink;
+	volatile float fsink;
+
+	for (int raw_y = 0; raw_y < 256; raw_y++) {
+		for (int raw_x = 0; raw_x < 256; raw_x++) {
+			stick_condition(raw_x, raw_y, &x, &y);
+			stick_condition_float(raw_x, raw_y, &fx, &fy);
+
+			int err = abs(x - (int)lrintf(fx * 32767));
+			int err_y = abs(y - (int)lrintf(fy * 32767));
+			if (err_y > err) {
+				err = err_y;
+			}
+			if (err > max_err) {
+				max_err = err;
+				max_raw_x = raw_x;
+				max_raw_y = raw_y;
+			}
+			if ((fx == 0) && (fy == 0) && (x || y)) {
+				in_deadzone_moved = true;
+			}
+		}
+	}
+
+	int32_t sum = 0;
+	uint64_t start = time_us_64();
+	for (unsigned int l = 0; l < loops; l++) {
+		for (int raw = 0; raw < 65536; raw++) {
+			stick_condition(raw & 0xff, raw >> 8, &x, &y);
+			sum += x + y;
+		}
+	}
+	uint64_t fixed_us = time_us_64() - start;
+	sink = sum;
+
+	float fsum = 0;
+	start = time_us_64();
+	for (unsigned int l = 0; l < loops; l++) {
+		for (int raw = 0; raw < 65536; raw++) {
+			stick_condition_float(raw & 0xff, raw >> 8, &fx, &fy);
+			fsum += fx + fy;
+		}
+	}
+	uint64_t float_us = time_us_64() - start;
+	fsink = fsum;
+	(void)sink;
+	(void)fsink;
+
+	unsigned int problems = (max_err > tolerance) || in_deadzone_moved;
+	fprintf(stderr, "Sticks: %s, max error %d/32767 at (%d, %d), %.1f ns per stick, %.1f ns in float\n",
+	        problems ? "FAILED" : "ok", max_err, max_raw_x, max_raw_y,
+	        (double)fixed_us * 1000 / loops / 65536, (double)float_us * 1000 / loops / 65536);
+	return problems;
+}
+
+// CRC-32 the slow way, to check the one in the DS4 output report
+static uint32_t crc32_bitwise(uint32_t crc, const uint8_t *data, unsigned int len)
+{
+	for (unsigned int i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (int b = 0; b < 8; b++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+
+	return crc;
+}
+
+static unsigned int check_output(void)
+{
+	const struct bt_hid_output output = {
+		.rumble_weak = 0x40, .rumble_strong = 0xc0,
+		.red = 0x11, .green = 0x22, .blue = 0x33,
+		.flash_on = 50, .flash_off = 25,
+	};
+	uint8_t report[HID_PROFILE_MAX_OUTPUT_LEN];
+	unsigned int problems = 0;
+
+	uint16_t len = hid_profile_default.encode_output(&output, report);
+	if ((len != 78) || (report[0] != 0x11) || (report[6] != 0x40) || (report[7] != 0xc0) ||
+	    (report[8] != 0x11) || (report[9] != 0x22) || (report[10] != 0x33) ||
+	    (report[11] != 50) || (report[12] != 25)) {
+		problems++;
+	}
+
+	const uint8_t header = 0xa2;
+	uint32_t crc = ~crc32_bitwise(crc32_bitwise(0xffffffff, &header, 1), report, len - 4);
+	if (crc != little_endian_read_32(report, len - 4)) {
+		problems++;
+	}
+
+	uint64_t start = time_us_64();
+	for (unsigned int i = 0; i < 10000; i++) {
+		hid_profile_default.encode_output(&output, report);
+	}
+	uint64_t elapsed_us = time_us_64() - start;
+
+	fprintf(stderr, "DS4 output report: %s, %.1f us to build\n", problems ? "FAILED" : "ok",
+	        (double)elapsed_us / 10000);
+	return problems;
+}
+
+// A DS4 calibration report (0x05), made up but with the sort of numbers a
+// real one has: small biases, and readings about 16 per deg/s and 8192 per g
+static const int16_t calibration_values[17] = {
+	-4, 7, 2,                   // gyro bias
+	8721, 8812, 8690,           // gyro +
+	-8765, -8702, -8745,        // gyro -
+	540, 540,                   // reference speed
+	8140, -8250, 8320, -8060, 8190, -8210, // accel +/-
+};
+
+static void build_calibration_report(uint8_t *report)
+{
+	const uint8_t header = 0xa3;
+
+	memset(report, 0, 41);
+	report[0] = 0x05;
+	for (int i = 0; i < 17; i++) {
+		little_endian_store_16(report, 1 + i * 2, (uint16_t)calibration_values[i]);
+	}
+	little_endian_store_32(report, 37, ~crc32_bitwise(crc32_bitwise(0xffffffff, &header, 1), report, 37));
+}
+
+// What the calibration should do to each axis, in double
+static int32_t calibrate_reference(int axis, int16_t raw)
+{
+	const int16_t *v = calibration_values;
+	double bias, scale;
+
+	if (axis < 3) {
+		bias = v[axis];
+		scale = (double)(v[9] + v[10]) * BT_HID_GYRO_PER_DEG_S / (v[3 + axis] - v[6 + axis]);
+	} else {
+		int32_t plus = v[11 + (axis - 3) * 2], minus = v[12 + (axis - 3) * 2];
+		int32_t range_2g = plus - minus;
+		bias = plus - range_2g / 2;
+		scale = 2.0 * BT_HID_ACCEL_PER_G / range_2g;
+	}
+
+	double out = floor((raw - bias) * scale);
+	return out > INT16_MAX ? INT16_MAX : (out < INT16_MIN ? INT16_MIN : out);
+}
+
+// Parse a calibration report, check every raw value of every axis comes out
+// as it should, and see what it costs on top of decoding a full report
+static unsigned int check_calibration(void)
+{
+	uint8_t report[41];
+	struct hid_imu_calibration cal;
+	unsigned int problems = 0;
+	int max_err = 0;
+
+	build_calibration_report(report);
+	if (!hid_profile_default.parse_calibration(report, sizeof(report), &cal)) {
+		fprintf(stderr, "IMU calibration: FAILED to parse\n");
+		return 1;
+	}
+
+	for (int axis = 0; axis < 6; axis++) {
+		for (int32_t raw = INT16_MIN; raw <= INT16_MAX; raw++) {
+			struct bt_hid_ext_state ext = { 0 };
+			ext.gyro[axis % 3] = raw;
+			ext.accel[axis % 3] = raw;
+			hid_profile_apply_calibration(&cal, &ext);
+
+			int32_t got = axis < 3 ? ext.gyro[axis] : ext.accel[axis - 3];
+			int err = abs(got - calibrate_reference(axis, raw));
+			if (err > max_err) {
+				max_err = err;
+			}
+		}
+	}
+	if ((max_err > 1) || hid_profile_parse_calibration_none(report, sizeof(report), &cal)) {
+		problems++;
+	}
+
+	// A bad CRC mustn't be taken as calibration
+	report[5] ^= 1;
+	if (hid_profile_default.parse_calibration(report, sizeof(report), &cal)) {
+		problems++;
+	}
+	build_calibration_report(report);
+	hid_profile_default.parse_calibration(report, sizeof(report), &cal);
+
+	// A full report with some motion in it
+	uint8_t full[78] = { 0x11 };
+	for (int i = 0; i < 6; i++) {
+		little_endian_store_16(full, 15 + i * 2, (uint16_t)(1234 * (i + 1) - 4000));
+	}
+
+	struct bt_hid_ext_state ext;
+	// So the loops don't get optimised out
+	volatile int32_t sum = 0;
+	uint64_t start = time_us_64();
+	for (unsigned int i = 0; i < 1000000; i++) {
+		full[15] = i;
+		hid_profile_default.decode_ext(full, sizeof(full), &ext);
+		sum += ext.gyro[0];
+	}
+	uint64_t raw_us = time_us_64() - start;
+
+	start = time_us_64();
+	for (unsigned int i = 0; i < 1000000; i++) {
+		full[15] = i;
+		hid_profile_default.decode_ext(full, sizeof(full), &ext);
+		hid_profile_apply_calibration(&cal, &ext);
+		sum += ext.gyro[0];
+	}
+	uint64_t calibrated_us = time_us_64() - start;
+
+	fprintf(stderr, "IMU calibration: %s, max error %d, decode %.1f ns raw, %.1f ns calibrated\n",
+	        problems ? "FAILED" : "ok", max_err, (double)raw_us / 1000, (double)calibrated_us / 1000);
+	return problems;
+}
+
+// The original one-button-at-a-time debouncer, from buttons.c before
+// buttonsDebounce() replaced it, as it was. It's kept out of line, as it was
+// when it was in another file, so bench_buttons() still times the old code.
+#define BUTTON_PRESSED 1
+#define BUTTON_RELEASED -1
+#define BUTTON_HELD 0
+#define DEBOUNCE_TIME -5 //number of decrementations before the button is considered released. only works for odd numbers.
+
+static __attribute__((noinline)) int buttonDebouncer(bool isPressed, int *buttonStatus) {
+	//printf("Button status: %d\n", *buttonStatus);
+	if(isPressed)
+	{ //SQUARE BUTTON CODE
+		if(*buttonStatus < DEBOUNCE_TIME) //only run this if the button had been released.
+		{
+			//Code for if Square / X button is pressed
+			*buttonStatus = 1; //Change this so code doens't get spam ran.
+			return BUTTON_PRESSED;
+		}
+		*buttonStatus = 1; //Change this so code doens't get spam ran.
+	}
+	else if (!isPressed)
+	{
+		*buttonStatus = *buttonStatus - 1;
+		if (*buttonStatus == DEBOUNCE_TIME)
+		{  //once the button has been released for long enough, run released code.
+			//Code for if Square / X button is released	
+			//Stop doing whatever it square made it do.
+			return BUTTON_RELEASED;
+		}
+	}
+	return BUTTON_HELD;
+	/*
+	That probably seemed very messy- and will continue to seem so. The logic behind it is thus.
+	Soem of The buttons flicker between 1 and 0 when pressed, so I had to make sure it had been 0 for
+	a sufficient ammount of time. also, I had to make sure the code for when the button is pressed is
+	only ran once. so, whenever the input is 1 it updates the status varaible to 1, and when it was previously less
+	than -5 it runs the button pressed code. Then, when the button is off, it decreements  the status variable. 
+	Once it has been off for enough iterations, indicated by becoming -5, it runs the button released code.
+	*/
+}
+
+// buttonDebouncer(), one button at a time, as the reference for
+// buttonsDebounce(). It has one quirk: a press on the very next sample after
+// a release is ignored, because its counter is still exactly DEBOUNCE_TIME
+// then. That was never the intent, so step the counter past it, and anything
+// else is a real difference. Only the default windows match it.
+#define DEBOUNCE_REFERENCE ((DEBOUNCE_PRESS_SAMPLES == 1) && (DEBOUNCE_RELEASE_SAMPLES == 1 - DEBOUNCE_TIME))
+
+struct debounce_reference {
+	int counters[BUTTON_COUNT];
+	uint16_t held;
+};
+
+static void debounce_reference_init(struct debounce_reference *ref)
+{
+	// The old code started its counters at 0, which swallowed the first
+	// press of every button, so start from "released a long time ago".
+	for (int b = 0; b < BUTTON_COUNT; b++) {
+		ref->counters[b] = DEBOUNCE_TIME - 1;
+	}
+	ref->held = 0;
+}
+
+// Returns the bits which changed, like buttonsDebounce()
+static uint16_t debounce_reference_step(struct debounce_reference *ref, uint16_t raw)
+{
+	uint16_t prev = ref->held;
+
+	for (int b = 0; b < BUTTON_COUNT; b++) {
+		if (ref->counters[b] == DEBOUNCE_TIME) {
+			ref->counters[b]--;
+		}
+
+		int result = buttonDebouncer(raw & BUTTON_BIT(b), &ref->counters[b]);
+		if (result == BUTTON_PRESSED) {
+			ref->held |= BUTTON_BIT(b);
+		} else if (result == BUTTON_RELEASED) {
+			ref->held &= ~BUTTON_BIT(b);
+		}
+	}
+
+	return ref->held ^ prev;
+}
+
+// Feed the button words from the recording through buttonsDebounce() and
+// the reference, and count the reports where they disagree.
+static unsigned int check_debounce(const struct hid_decoder *decoder)
+{
+	struct buttonStatus status = { 0 };
+	struct debounce_reference ref;
+	unsigned int mismatches = 0;
+
+	debounce_reference_init(&ref);
+
+	for (unsigned int i = 0; i < recording.n; i++) {
+		struct bt_hid_state state;
+		if (!hid_decoder_decode(decoder, &recording.data[i][1], recording.len[i] - 1, &state)) {
+			continue;
+		}
+
+		uint16_t raw = buttonsPack(state);
+		uint16_t changed = buttonsDebounce(raw, &status);
+		if ((changed != debounce_reference_step(&ref, raw)) || (status.held != ref.held)) {
+			mismatches++;
+		}
+	}
+
+	fprintf(stderr, "Debounce: %s, %u reports where the debouncers disagree\n",
+	        mismatches ? "FAILED" : "ok", mismatches);
+	return mismatches;
+}
+
+// The hand-written flicker cases in host/fixtures/debounce.txt: lines of
+// "raw held", as words of BUTTON_BIT()s. Both debouncers have to give the
+// expected held state after every sample.
+static unsigned int check_debounce_fixture(const char *path)
+{
+	struct buttonStatus status = { 0 };
+	struct debounce_reference ref;
+	unsigned int samples = 0, problems = 0, line_no = 0;
+	char line[MAX_LINE];
+
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return 1;
+	}
+
+	debounce_reference_init(&ref);
+
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned int raw, expected;
+		char *comment = strchr(line, '#');
+
+		line_no++;
+		if (comment) {
+			*comment = '\0';
+		}
+		if (sscanf(line, "%x %x", &raw, &expected) != 2) {
+			continue;
+		}
+
+		uint16_t prev = status.held;
+		uint16_t changed = buttonsDebounce(raw, &status);
+		uint16_t ref_changed = debounce_reference_step(&ref, raw);
+		if ((status.held != expected) || (changed != (prev ^ expected)) ||
+		    (ref.held != expected) || (ref_changed != changed)) {
+			fprintf(stderr, "%s:%u: raw %04x expected %04x, got %04x (reference %04x)\n",
+			        path, line_no, raw, expected, status.held, ref.held);
+			problems++;
+		}
+		samples++;
+	}
+
+	fclose(fp);
+
+	if (!samples) {
+		fprintf(stderr, "No samples found in %s\n", path);
+		return 1;
+	}
+
+	fprintf(stderr, "Debounce fixture: %s, %u samples\n", problems ? "FAILED" : "ok", samples);
+	return problems;
+}
+
+// The reference decode, for checking the compiled tables: walk the
+// descriptor with btstack_hid_parser for every report, and put each value
+// where it goes in struct bt_hid_state directly. Written separately from
+// hid_decoder.c on purpose, so a mistake there doesn't show up here too.
+// Axes are scaled to 8 bits, signed ones re-centred on 0x80. The hat goes in
+// the bottom nibble of buttons, buttons 1-4 above it, 5-12 in triggers. The
+// first field to land on a bit keeps it.
+static bool reference_decode(uint8_t report_id, const uint8_t *report, uint16_t report_len,
+                             struct bt_hid_state *dst)
+{
+	// The parser can read a byte past the end of the report
+	uint8_t padded[MAX_REPORT_LEN + 4] = { 0 };
+	uint8_t claimed[sizeof(*dst)] = { 0 };
+	struct bt_hid_state state = default_state;
+	uint8_t *out = (uint8_t *)&state;
+	btstack_hid_parser_t parser;
+
+	if ((report_len > MAX_REPORT_LEN) || (report_id && (report[0] != report_id))) {
+		return false;
+	}
+	memcpy(padded, report, report_len);
+
+	btstack_hid_parser_init(&parser, descriptor, descriptor_len, HID_REPORT_TYPE_INPUT, padded, report_len);
+	while (btstack_hid_parser_has_more(&parser)) {
+		unsigned int end_bit = parser.report_pos_in_bit + parser.global_report_size;
+		unsigned int width = parser.global_report_size;
+		bool is_variable = (parser.descriptor_item.item_value & 2) != 0;
+		bool is_signed = parser.global_logical_minimum < 0;
+		uint16_t usage_page, usage;
+		int32_t value;
+		unsigned int byte, shift;
+		bool axis = false;
+
+		btstack_hid_parser_get_field(&parser, &usage_page, &usage, &value);
+		if (!is_variable || !width || (width > 16)) {
+			continue;
+		}
+
+		if (usage_page == 0x01) {
+			switch (usage) {
+			case 0x30: byte = offsetof(struct bt_hid_state, lx); axis = true; break;
+			case 0x31: byte = offsetof(struct bt_hid_state, ly); axis = true; break;
+			case 0x32: byte = offsetof(struct bt_hid_state, rx); axis = true; break;
+			case 0x35: byte = offsetof(struct bt_hid_state, ry); axis = true; break;
+			case 0x39: byte = offsetof(struct bt_hid_state, buttons); shift = 0; break;
+			default: continue;
+			}
+		} else if ((usage_page == 0x09) && (usage >= 1) && (usage <= 4)) {
+			byte = offsetof(struct bt_hid_state, buttons);
+			shift = usage + 3;
+		} else if ((usage_page == 0x09) && (usage >= 5) && (usage <= 12)) {
+			byte = offsetof(struct bt_hid_state, triggers);
+			shift = usage - 5;
+		} else {
+			continue;
+		}
+
+		uint32_t u = (uint32_t)value & ((1u << width) - 1);
+		uint8_t bits;
+		if (axis) {
+			if (is_signed) {
+				u = (u + (1u << (width - 1))) & ((1u << width) - 1);
+			}
+			u = width > 8 ? u >> (width - 8) : u << (8 - width);
+			bits = width >= 8 ? 0xff : ((1u << width) - 1) << (8 - width);
+			shift = 0;
+		} else if (shift + width > 8) {
+			continue;
+		} else {
+			bits = ((1u << width) - 1) << shift;
+			u <<= shift;
+		}
+
+		if (claimed[byte] & bits) {
+			continue;
+		}
+		claimed[byte] |= bits;
+
+		// A report too short for a field we use doesn't count
+		if (end_bit > report_len * 8u) {
+			return false;
+		}
+
+		out[byte] = (out[byte] & ~bits) | (u & bits);
+	}
+
+	*dst = state;
+	return true;
+}
+
+// COMBO_TABLE's names, as the fixture spells them
+#define COMBO_TAG(arg, name, kind, a, b, c, ms, desc) [COMBO_ ## name] = #name,
+static const char *const combo_tags[COMBO_COUNT] = {
+	COMBO_TABLE(COMBO_TAG, 0)
+};
+
+// Parse a fixture's list of combo names, or - for none, into a mask. Returns
+// false if there's a name it doesn't know.
+static bool combo_parse_fired(char *list, uint32_t *mask)
+{
+	*mask = 0;
+	if (!strcmp(list, "-")) {
+		return true;
+	}
+
+	for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		unsigned int c;
+		for (c = 0; (c < COMBO_COUNT) && strcmp(tok, combo_tags[c]); c++) {
+		}
+		if (c == COMBO_COUNT) {
+			return false;
+		}
+		*mask |= 1u << c;
+	}
+
+	return true;
+}
+
+// The hand-written streams in host/fixtures/combos.txt: lines of
+// "ms held fired", fed to combo_update() one by one, which has to fire
+// exactly what each line says. Every combo has to be expected to fire at
+// least once, so none of them goes untested.
+static unsigned int check_combo_fixture(const char *path)
+{
+	struct combo_status status = { 0 };
+	unsigned int expected_count[COMBO_COUNT] = { 0 };
+	unsigned int samples = 0, problems = 0, line_no = 0;
+	uint16_t prev = 0;
+	char line[MAX_LINE];
+
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned int ms, held;
+		char list[MAX_LINE];
+		uint32_t expected;
+		char *comment = strchr(line, '#');
+
+		line_no++;
+		if (comment) {
+			*comment = '\0';
+		}
+		if (sscanf(line, "%u %x %s", &ms, &held, list) != 3) {
+			continue;
+		}
+		if (!combo_parse_fired(list, &expected)) {
+			fprintf(stderr, "%s:%u: unknown combo\n", path, line_no);
+			problems++;
+			continue;
+		}
+
+		uint32_t fired = combo_update(&status, prev ^ held, held, ms * 1000);
+		if (fired != expected) {
+			fprintf(stderr, "%s:%u: fired 0x%" PRIx32 ", expected 0x%" PRIx32 "\n",
+			        path, line_no, fired, expected);
+			problems++;
+		}
+
+		for (uint32_t mask = expected; mask; mask &= mask - 1) {
+			expected_count[__builtin_ctz(mask)]++;
+		}
+		prev = held;
+		samples++;
+	}
+
+	fclose(fp);
+
+	for (unsigned int c = 0; c < COMBO_COUNT; c++) {
+		if (!expected_count[c]) {
+			fprintf(stderr, "%s: nothing expects %s to fire\n", path, combo_tags[c]);
+			problems++;
+		}
+	}
+
+	fprintf(stderr, "Combo fixture: %s, %u samples\n", problems ? "FAILED" : "ok", samples);
+	return problems;
+}
+
+// The hand-written streams first, then the recording, as if it came at
+// 800 Hz, to see what the combos cost. Nothing is known about what should
+// fire in the recording, so that's only counted.
+static unsigned int check_combos(const struct hid_decoder *decoder, unsigned int loops)
+{
+	// Just count them here
+	for (unsigned int c = 0; c < COMBO_COUNT; c++) {
+		combo_register(c, NULL);
+	}
+
+	unsigned int problems = check_combo_fixture(COMBO_FIXTURE);
+
+	// Debounce up front, so only the combos are timed
+	static uint16_t changed[MAX_REPORTS], held[MAX_REPORTS];
+	struct buttonStatus status = { 0 };
+	unsigned int samples = 0;
+	for (unsigned int i = 0; i < recording.n; i++) {
+		struct bt_hid_state state;
+		if (hid_decoder_decode(decoder, &recording.data[i][1], recording.len[i] - 1, &state)) {
+			changed[samples] = buttonsDebounce(buttonsPack(state), &status);
+			held[samples] = status.held;
+			samples++;
+		}
+	}
+
+	unsigned int fired[COMBO_COUNT] = { 0 };
+	struct combo_status combos = { 0 };
+	uint32_t now_us = 0;
+	uint64_t start = time_us_64();
+	for (unsigned int l = 0; l < loops; l++) {
+		for (unsigned int i = 0; i < samples; i++, now_us += 1250) {
+			for (uint32_t mask = combo_update(&combos, changed[i], held[i], now_us); mask; mask &= mask - 1) {
+				fired[__builtin_ctz(mask)]++;
+			}
+		}
+	}
+	uint64_t elapsed_us = time_us_64() - start;
+
+	fprintf(stderr, "Combos: %.1f ns per report, in the recording:",
+	        samples ? (double)elapsed_us * 1000 / loops / samples : 0.0);
+	for (unsigned int c = 0; c < COMBO_COUNT; c++) {
+		fprintf(stderr, " %s %u%s", combo_name(c), fired[c] / loops, c == COMBO_COUNT - 1 ? "\n" : ",");
+	}
+
+	return problems;
+}
+
+// ButtonHandler()'s buttons as they were before the bitmask engine: each of
+// the twelve buttons through buttonDebouncer() with its own branch, and the
+// dpad through a switch on the hat, every call. The printf()s are counts here,
+// as they are for the new one below, so only the button logic is timed.
+static unsigned int old_button_events;
+
+static void old_button_handler(struct bt_hid_state state, int counters[12])
+{
+	for (int b = 0; b < 12; b++) {
+		uint8_t byte = b < 4 ? state.buttons : state.triggers;
+		int bit = b < 4 ? b + 4 : b - 4;
+		int result = buttonDebouncer(byte & (1 << bit), &counters[b]);
+		if (result == BUTTON_PRESSED) {
+			old_button_events++;
+		} else if (result == BUTTON_RELEASED) {
+			old_button_events++;
+		}
+	}
+
+	switch (state.buttons & 0xf) {
+	case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+		old_button_events++;
+		break;
+	default:
+		break;
+	}
+}
+
+static unsigned int new_button_events;
+
+static void count_button_event(enum button_id button)
+{
+	(void)button;
+	new_button_events++;
+}
+
+// Report-to-handler latency of the main loop, with a thread standing in for
+// the BT core: reports go in at 800 Hz, as a DS4 sends them, and the main
+// thread takes them off the queue as main() does. WAKEUP_POLL_MS is the old
+// loop's sleep. The host has no second core, so this is the semaphore and
+// the queue on top of the OS scheduler, not the RP2040's wake-up time, but
+// the difference between the two loops is the same.
+#define WAKEUP_INTERVAL_US 1250
+#define WAKEUP_TICK_US     20000
+#define WAKEUP_POLL_MS     20
+
+struct wakeup_producer {
+	unsigned int n;
+	atomic_bool done;
+};
+
+static void *wakeup_producer_thread(void *arg)
+{
+	struct wakeup_producer *producer = arg;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (unsigned int i = 0; i < producer->n; i++) {
+		next.tv_nsec += WAKEUP_INTERVAL_US * 1000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		unsigned int r = i % recording.n;
+		hid_host_handle_interrupt_report(0, recording.data[r], recording.len[r]);
+	}
+
+	atomic_store(&producer->done, true);
+	return NULL;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Returns the number of reports handled, with their latencies in lat
+static unsigned int wakeup_run(unsigned int n, bool poll, uint32_t *lat)
+{
+	struct wakeup_producer producer = { .n = n };
+	struct buttonStatus status = { 0 };
+	struct combo_status combos = { 0 };
+	struct bt_hid_state state;
+	unsigned int handled = 0;
+	pthread_t thread;
+
+	atomic_init(&producer.done, false);
+	while (bt_hid_peek_report()) {
+		bt_hid_release_report();
+	}
+	if (pthread_create(&thread, NULL, wakeup_producer_thread, &producer)) {
+		perror("pthread_create");
+		return 0;
+	}
+
+	for ( ;; ) {
+		bool done = atomic_load(&producer.done);
+
+		if (poll) {
+			usleep(WAKEUP_POLL_MS * 1000);
+		} else {
+			bt_hid_wait_latest_timeout_us(0, &state, WAKEUP_TICK_US);
+		}
+
+		const struct bt_hid_report *report;
+		while ((report = bt_hid_peek_report())) {
+			if (handled < n) {
+				lat[handled++] = time_us_32() - report->time_us;
+			}
+			uint16_t changed = ButtonHandler(report->state, &report->sticks, &status);
+			combo_update(&combos, changed, status.held, report->time_us);
+			bt_hid_release_report();
+		}
+
+		if (done) {
+			break;
+		}
+	}
+
+	pthread_join(thread, NULL);
+	return handled;
+}
+
+static void bench_wakeup(unsigned int n)
+{
+	uint32_t *lat = malloc(n * sizeof(*lat));
+	if (!lat) {
+		return;
+	}
+
+	for (int poll = 0; poll <= 1; poll++) {
+		unsigned int handled = wakeup_run(n, poll, lat);
+		if (!handled) {
+			continue;
+		}
+
+		qsort(lat, handled, sizeof(*lat), compare_u32);
+		fprintf(stderr, "%-18s %u reports, decode to handler p50 %" PRIu32 " us, p99 %" PRIu32
+		        " us, max %" PRIu32 " us\n", poll ? "wake (poll 20 ms)" : "wake (semaphore)", handled,
+		        lat[handled / 2], lat[handled * 99 / 100], lat[handled - 1]);
+	}
+
+	free(lat);
+}
+
+// Time the old per-button code against ButtonHandler(), over the decoded
+// recording. The sticks are left centred, so neither prints anything, and the
+// new one's callbacks are swapped for counters, so run this after anything
+// that wants them printing.
+static void bench_buttons(const struct hid_decoder *decoder, unsigned int loops)
+{
+	static struct bt_hid_state states[MAX_REPORTS];
+	const struct bt_hid_sticks centred = { 0 };
+	unsigned int samples = 0;
+
+	for (unsigned int i = 0; i < recording.n; i++) {
+		samples += hid_decoder_decode(decoder, &recording.data[i][1], recording.len[i] - 1, &states[samples]);
+	}
+	if (!samples) {
+		return;
+	}
+
+	for (int b = 0; b < BUTTON_COUNT; b++) {
+		buttonRegister(b, count_button_event, count_button_event);
+	}
+
+	int counters[12];
+	for (int b = 0; b < 12; b++) {
+		counters[b] = DEBOUNCE_TIME - 1;
+	}
+	uint64_t start = time_us_64();
+	for (unsigned int l = 0; l < loops; l++) {
+		for (unsigned int i = 0; i < samples; i++) {
+			old_button_handler(states[i], counters);
+		}
+	}
+	uint64_t old_us = time_us_64() - start;
+
+	struct buttonStatus status = { 0 };
+	start = time_us_64();
+	for (unsigned int l = 0; l < loops; l++) {
+		for (unsigned int i = 0; i < samples; i++) {
+			ButtonHandler(states[i], &centred, &status);
+		}
+	}
+	uint64_t new_us = time_us_64() - start;
+
+	double old_ns = (double)old_us * 1000 / loops / samples;
+	double new_ns = (double)new_us * 1000 / loops / samples;
+	fprintf(stderr, "buttons (old)    %8.1f ns/report, %u events\n", old_ns, old_button_events / loops);
+	fprintf(stderr, "buttons (new)    %8.1f ns/report, %u events, %.1fx faster\n", new_ns,
+	        new_button_events / loops, new_ns > 0 ? old_ns / new_ns : 0.0);
+}
+
+static void print_result(const char *name, unsigned int loops, uint64_t elapsed_us)
+{
+	uint64_t reports = (uint64_t)loops * recording.n;
+
+	if (!elapsed_us) {
+		elapsed_us = 1;
+	}
+
+	fprintf(stderr, "%-16s %10" PRIu64 " reports/s %8.1f ns/report\n", name,
+	        reports * 1000000 / elapsed_us, (double)elapsed_us * 1000 / reports);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-d descriptor.txt] [-i vid:pid] [-n loops] [-c controllers] [-b burst] [-w reports] reports.txt\n",
+	        prog);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct hid_profile *profile = &hid_profile_default;
+	const char *descriptor_path = NULL;
+	unsigned int vendor_id = 0, product_id = 0;
+	unsigned int loops = 100;
+	unsigned int controllers = 0, burst = 4;
+	unsigned int wakeup_reports = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:c:d:i:n:w:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			burst = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			controllers = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			descriptor_path = optarg;
+			break;
+		case 'i':
+			if (sscanf(optarg, "%x:%x", &vendor_id, &product_id) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			wakeup_reports = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if ((optind != argc - 1) || !loops || !burst || (controllers > BT_HID_MAX_CONTROLLERS)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (load_reports(argv[optind]) <= 0) {
+		fprintf(stderr, "No reports found in %s\n", argv[optind]);
+		return 1;
+	}
+
+	bt_hid_report_init();
+
+	// Same order as on a real connection: Device ID first, then descriptor
+	if (vendor_id || product_id) {
+		profile = bt_hid_report_set_device_id(0, vendor_id, product_id);
+		if (!profile) {
+			fprintf(stderr, "No profile for %04x:%04x\n", vendor_id, product_id);
+			return 1;
+		}
+	}
+
+	if (descriptor_path) {
+		if (load_descriptor(descriptor_path) <= 0) {
+			fprintf(stderr, "No descriptor found in %s\n", descriptor_path);
+			return 1;
+		}
+
+		profile = bt_hid_report_set_descriptor(0, descriptor, descriptor_len);
+		if (!profile) {
+			fprintf(stderr, "No usable input report in descriptor\n");
+			return 1;
+		}
+		fprintf(stderr, "Descriptor hash 0x%08" PRIx32 "\n", hid_profile_hash(descriptor, descriptor_len));
+	}
+
+	const struct hid_decoder *decoder = bt_hid_report_get_decoder(0);
+	fprintf(stderr, "%u reports, profile %s, decoding report 0x%02x with %d fields, %u loops\n",
+	        recording.n, profile->name, decoder->report_id, decoder->num_fields, loops);
+
+	if (check_stale() || check_torn_reads() || check_output() || check_calibration() || check_sticks(loops)) {
+		return 1;
+	}
+
+#if DEBOUNCE_REFERENCE
+	if (check_debounce_fixture(DEBOUNCE_FIXTURE) || check_debounce(decoder)) {
+		return 1;
+	}
+#else
+	fprintf(stderr, "Debounce: not checked, the windows aren't the defaults\n");
+#endif
+
+	if (check_combos(decoder, loops)) {
+		return 1;
+	}
+
+	// Full pipeline: decode, queue, drain, ButtonHandler() and the combos
+	struct buttonStatus status[BT_HID_MAX_CONTROLLERS] = { 0 };
+	struct combo_status combos[BT_HID_MAX_CONTROLLERS] = { 0 };
+	uint64_t start = time_us_64();
+	for (unsigned int l = 0; l < loops; l++) {
+		run_pipeline(status, combos);
+	}
+	print_result("pipeline", loops, time_us_64() - start);
+
+	// The same again, as several controllers sharing the queue
+	if (controllers && run_controllers(controllers, burst, loops, vendor_id, product_id)) {
+		return 1;
+	}
+
+	// The main loop as a whole, in real time
+	if (wakeup_reports) {
+		bench_wakeup(wakeup_reports);
+	}
+
+	// Just the buttons, old and new, without the printing
+	bench_buttons(decoder, loops);
+
+	// Just the decode, with the profile's decode function...
+	struct bt_hid_state state;
+	uint32_t decoded = 0, sum = 0;
+	start = time_us_64();
+	for (unsigned int l = 0; l < loops; l++) {
+		for (unsigned int i = 0; i < recording.n; i++) {
+			decoded += profile->decode(decoder, &recording.data[i][1], recording.len[i] - 1, &state);
+			sum += state.buttons + state.triggers + state.lx + state.ly + state.rx + state.ry;
+		}
+	}
+	print_result("decode (table)", loops, time_us_64() - start);
+
+	if (!descriptor_len) {
+		fprintf(stderr, "%" PRIu32 " decoded (checksum %" PRIu32 ")\n", decoded, sum);
+		return 0;
+	}
+
+	// ...and by walking the descriptor with btstack_hid_parser every time,
+	// which is all the reference does, there's no table to build
+	start = time_us_64();
+	for (unsigned int l = 0; l < loops; l++) {
+		for (unsigned int i = 0; i < recording.n; i++) {
+			reference_decode(decoder->report_id, &recording.data[i][1], recording.len[i] - 1, &state);
+			sum += state.buttons + state.triggers + state.lx + state.ly + state.rx + state.ry;
+		}
+	}
+	print_result("decode (parser)", loops, time_us_64() - start);
+
+	// Both should always agree
+	unsigned int mismatches = 0;
+	for (unsigned int i = 0; i < recording.n; i++) {
+		struct bt_hid_state fast, slow;
+		bool ok_fast = profile->decode(decoder, &recording.data[i][1], recording.len[i] - 1, &fast);
+		bool ok_slow = reference_decode(decoder->report_id, &recording.data[i][1], recording.len[i] - 1, &slow);
+		if ((ok_fast != ok_slow) || (ok_fast && memcmp(&fast, &slow, sizeof(fast)))) {
+			mismatches++;
+		}
+	}
+
+	fprintf(stderr, "%" PRIu32 " decoded (checksum %" PRIu32 "), %u table/parser mismatches\n",
+	        decoded, sum, mismatches);
+
+	return mismatches ? 1 : 0;
+}
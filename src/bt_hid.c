@@ -46,6 +46,7 @@
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "pico/async_context.h"
+#include "hardware/sync.h"
 
 #include "btstack_run_loop.h"
 #include "btstack_config.h"
@@ -53,178 +54,1332 @@
 #include "classic/sdp_server.h"
 
 #include "bt_hid.h"
+#include "bt_hid_event.h"
+#include "bt_hid_report.h"
+#include "bt_hog.h"
+#include "hid_cache.h"
+#include "hid_decoder.h"
+#include "hid_profile.h"
+#include "hid_registry.h"
+#include "latency.h"
 
 #define MAX_ATTRIBUTE_VALUE_SIZE 512
 
-// SN30 Pro
-//static const char * remote_addr_string = "E4:17:D8:EE:73:0E";
-// Real DS4
-//static const char * remote_addr_string = "00:22:68:DB:D3:66";
-// Knockoff DS4
-//static const char * remote_addr_string = "A5:15:66:8E:91:3B";
-// Brian C Knockoff DS4
-//static const char * remote_addr_string = "8C:41:F2:D0:32:43";
-//William Switch Pro Controller
-//static const char * remote_addr_string = "60:6B:FF:18:73:BC";
-// William PS5 Controller
-//static const char * remote_addr_string = "10:18:49:14:BF:C7";
-// William knockoff PS4 controller
-static const char * remote_addr_string = "89:38:38:07:44:9C";
+#if MAX_NR_HID_HOST_CONNECTIONS < BT_HID_MAX_CONTROLLERS
+#error "btstack_config.h doesn't allow enough HID connections for BT_HID_MAX_CONTROLLERS"
+#endif
 
+// How long to look for new controllers for, in 1.28 s units
+#define INQUIRY_DURATION 8
+
+// Discovery mode looks for longer, to give the name requests a chance, and
+// lists up to this many devices
+#define DISCOVERY_DURATION    10
+#define DISCOVERY_MAX_DEVICES 16
+
+// How long to page each known controller for, in 0.625 ms units. The
+// default is 15 s, but a controller which is on scans at least every 1.28 s,
+// so 2.56 s is two chances to find it.
+#define PAGE_TIMEOUT 0x1000
+
+// Page scan interval/window, in 0.625 ms units. With nothing connected,
+// scan often, so a controller pressing PS finds us quickly. Once one is
+// connected, go back to the standard rate, because every scan window is
+// time the radio isn't listening to it.
+#define PAGE_SCAN_FAST_INTERVAL 0x0100 // 160 ms
+#define PAGE_SCAN_FAST_WINDOW   0x0012 // 11.25 ms
+#define PAGE_SCAN_SLOW_INTERVAL 0x0800 // 1.28 s
+#define PAGE_SCAN_SLOW_WINDOW   0x0012
+
+// How long to wait, just connectable, between rounds of paging. Doubles
+// every round nobody answers, +/- 25%, and starts again from the minimum
+// whenever a controller connects or disconnects.
+#define RECONNECT_BACKOFF_MIN_MS 1000
+#define RECONNECT_BACKOFF_MAX_MS 32000
+
+// BT_HID_LINK_LATENCY: how long without a change in input before the link
+// is allowed to sniff, and the sniff parameters to use then (0.625 ms units)
+#define LINK_IDLE_MS             30000
+#define LINK_IDLE_SNIFF_MIN      0x0020 // 20 ms
+#define LINK_IDLE_SNIFF_MAX      0x0040 // 40 ms
+
+// BT_HID_LINK_BALANCED: the longest sniff interval we'll put up with, and
+// the subrating limits (0.625 ms units)
+#define LINK_BALANCED_SNIFF_MIN  0x0008 // 5 ms
+#define LINK_BALANCED_SNIFF_MAX  0x0010 // 10 ms
+#define LINK_BALANCED_SUBRATE_MAX_LATENCY 0x0020 // 20 ms
+#define LINK_BALANCED_SUBRATE_TIMEOUT     0x0320 // 500 ms
+
+#define LINK_SNIFF_ATTEMPT 2
+#define LINK_SNIFF_TIMEOUT 1
+
+#define LINK_TIMER_MS 1000
+
+// How often to check for controllers which have stopped sending reports
+#define STALE_CHECK_MS 20
+
+// An output report normally goes out within a couple of ms. If the
+// controller hasn't taken it by now, stop waiting and send the next one.
+#define OUTPUT_TIMEOUT_MS 50
+
+// One connected (or connecting) controller. Its index in conns[] is the
+// controller index the app sees, and is fixed until it disconnects.
+struct bt_hid_conn {
+	uint16_t  cid; // 0 if the slot is free
+	bd_addr_t addr;
+	bool      channels_open; // Both L2CAP channels up, reports can go out
+
+	// What the connection is actually using, and what we'd like it to
+	// use. The profile and the descriptor cache can both change it.
+	hid_protocol_mode_t protocol_mode;
+	hid_protocol_mode_t wanted_mode;
+
+	// Descriptor cache. In report mode, a controller we've already got the
+	// descriptor for is connected in boot mode, which goes straight to the
+	// L2CAP channels without waiting for SDP, then switched to report mode.
+	// The SDP query still runs, in the background, in case the descriptor
+	// has changed.
+	uint8_t  cached_descriptor[HID_CACHE_MAX_DESCRIPTOR_LEN];
+	uint16_t cached_descriptor_len;
+
+	// Queued up with the SDP client, which only does one query at a time
+	btstack_context_callback_registration_t device_id_query_request;
+	btstack_context_callback_registration_t descriptor_query_request;
+
+	// To see what the cache buys us: time from connecting to the first report
+	uint32_t connect_start_us;
+	bool     first_report_pending;
+
+	// Link mode (HCI_EVENT_MODE_CHANGE) and what the link policy is doing
+	// about it
+	hci_con_handle_t con_handle;
+	uint8_t  link_mode;
+	uint16_t sniff_interval;
+	uint32_t last_active_us;
+	bool     link_idle;           // Latency policy: idle, so sniff is allowed
+	bool     link_policy_pending; // Link policy settings still to be written
+	bool     resniff;             // Balanced policy: re-enter sniff, bounded
+
+	// Output (rumble, lightbar). hid_host keeps one state for both channels,
+	// so an output report mustn't go out while a SET_PROTOCOL or GET_REPORT
+	// is waiting for its response, and those get refused while an output
+	// report is waiting to go.
+	bool     control_pending;   // SET_PROTOCOL or GET_REPORT sent, no response yet
+	bool     feature_wanted;    // GET_REPORT for feature 0x05 still to send
+	bool     incoming;          // hid_host sends its own SET_PROTOCOL for these
+	bool     output_in_flight;  // Until the controller has acked the ACL packet
+	uint8_t  output_acks_left;  // Packets on the link to be acked, up to and including ours
+	uint32_t output_sent_us;
+	struct bt_hid_output output_sending;
+	// Only once it's been acked, so a lost one is sent again
+	bool     output_sent_valid;
+	struct bt_hid_output output_sent;
+	// hid_host sends from here, so it can't change until the report is out
+	uint8_t  output_report[HID_PROFILE_MAX_OUTPUT_LEN];
+};
+
+static struct bt_hid_conn conns[BT_HID_MAX_CONTROLLERS];
+
+// Slots taken by BLE controllers (bt_hog.c), which leave their conn unused
+static uint32_t le_slots;
+
+// Where we're paging, or the last one we paged
 static bd_addr_t remote_addr;
-static bd_addr_t connected_addr;
+static uint32_t  remote_cod;
+static uint16_t  paging_cid;
+
+// Reconnect scheduler. While there's a free slot, it goes round:
+//  PAGE:    page each known controller in turn, most recently seen first
+//  INQUIRY: look for new controllers, only if none are connected
+//  SCAN:    just connectable for a while, with backoff, for controllers
+//           to connect to us
+// and is IDLE when all the slots are in use. DISCOVER is only on request, it
+// lists everything nearby and then pairs with the first HID device.
+enum reconnect_phase {
+	RECONNECT_IDLE,
+	RECONNECT_PAGE,
+	RECONNECT_INQUIRY,
+	RECONNECT_SCAN,
+	RECONNECT_DISCOVER,
+};
+
+static const char *const reconnect_phase_names[] = {
+	[RECONNECT_IDLE]     = "idle",
+	[RECONNECT_PAGE]     = "page",
+	[RECONNECT_INQUIRY]  = "inquiry",
+	[RECONNECT_SCAN]     = "scan",
+	[RECONNECT_DISCOVER] = "discover",
+};
+
+static enum reconnect_phase reconnect_phase;
+static uint32_t reconnect_phase_start_us;
+static uint32_t reconnect_backoff_ms;
+static uint32_t reconnect_rand;
+static btstack_timer_source_t reconnect_timer;
+static bool page_scan_fast;
+
+// Next controller to page, as an index into the registry
+static unsigned int page_idx;
+
+// A new controller found by inquiry, waiting for the inquiry to stop
+static bool inquiry_found;
+
+// Everything discovery mode has found. Names are asked for one at a time,
+// in the order the devices were found: BTstack only has room for one
+// request, and the controller would only make them wait for each other.
+struct discovery_device {
+	bd_addr_t addr;
+	uint32_t  cod;
+	uint8_t   page_scan_repetition_mode;
+	uint16_t  clock_offset;
+	bool      named;
+};
+
+static struct discovery_device discovery_devices[DISCOVERY_MAX_DEVICES];
+static unsigned int discovery_count;
+static unsigned int discovery_next_name;
+static bool discovery_name_pending;
+static bool discovery_inquiry_done;
+// Asked for while paging or looking, it starts when that's finished
+static bool discovery_wanted;
+static btstack_context_callback_registration_t discovery_request;
+
+// When the last incoming ACL connection was requested, to time the whole
+// connection from when the controller found us
+static uint32_t link_request_us;
+
+static enum bt_hid_link_policy link_policy = BT_HID_LINK_POLICY;
+static volatile enum bt_hid_link_policy link_policy_requested = BT_HID_LINK_POLICY;
+static btstack_context_callback_registration_t link_policy_request;
+static btstack_timer_source_t link_timer;
+static btstack_timer_source_t stale_timer;
+
+// What the app wants each slot's output to be. Written by one core, under a
+// seqlock like the latest state, then the BT core is asked to send it. The
+// registration is only queued once however many times it's asked.
+struct output_request {
+	struct bt_hid_output output;
+	volatile uint32_t seq;
+	btstack_context_callback_registration_t registration;
+};
+
+static struct output_request output_requests[BT_HID_MAX_CONTROLLERS];
+static btstack_timer_source_t output_timer;
 static btstack_packet_callback_registration_t hci_event_callback_registration;
 
-// SDP
-static uint8_t hid_descriptor_storage[MAX_ATTRIBUTE_VALUE_SIZE];
+// SDP. hid_host keeps every connection's descriptor in here.
+static uint8_t hid_descriptor_storage[MAX_ATTRIBUTE_VALUE_SIZE * BT_HID_MAX_CONTROLLERS];
+
+// Set to 1 to connect in report protocol. Only then is there a descriptor
+// from SDP, and so only then does the descriptor cache (hid_cache.h) get
+// used, to skip SDP on reconnects. Boot protocol never does SDP, so it has
+// nothing to skip.
+#ifndef BT_HID_REPORT_PROTOCOL
+#define BT_HID_REPORT_PROTOCOL 0
+#endif
+
+#if BT_HID_REPORT_PROTOCOL
+static hid_protocol_mode_t hid_host_report_mode = HID_PROTOCOL_MODE_REPORT; //report mode
+#else
+static hid_protocol_mode_t hid_host_report_mode = HID_PROTOCOL_MODE_BOOT; //boot mode. one of these might work. oh my gosh it actually worked
+#endif
+
+// The connection the SDP client is currently querying for. It's checked
+// against the cid in case it went away in the meantime.
+static struct bt_hid_conn *sdp_conn;
+static uint16_t sdp_cid;
+
+// SDP Device ID (PnP Information) query, to pick a profile
+static uint8_t  device_id_attribute[8];
+static uint16_t device_id_vendor_id;
+static uint16_t device_id_product_id;
+
+// SDP query to re-check a cached descriptor
+static uint8_t  descriptor_attribute[MAX_ATTRIBUTE_VALUE_SIZE];
+static const uint8_t *fresh_descriptor;
+static uint16_t fresh_descriptor_len;
+
+static void packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static inline unsigned int bt_hid_conn_idx(const struct bt_hid_conn *conn)
+{
+	return conn - conns;
+}
+
+static const char *const link_policy_names[] = {
+	[BT_HID_LINK_LATENCY]  = "latency",
+	[BT_HID_LINK_BALANCED] = "balanced",
+	[BT_HID_LINK_POWER]    = "power",
+};
+
+// Link policy settings for conn, or the default for new connections if NULL
+static uint16_t bt_hid_link_policy_settings(const struct bt_hid_conn *conn)
+{
+	uint16_t settings = LM_LINK_POLICY_ENABLE_ROLE_SWITCH;
+
+	if ((link_policy != BT_HID_LINK_LATENCY) || (conn && conn->link_idle)) {
+		settings |= LM_LINK_POLICY_ENABLE_SNIFF_MODE;
+	}
+
+	return settings;
+}
+
+// Write any link policy settings which have changed, if the controller can
+// take a command now. Anything left over is retried from link_timer.
+static void bt_hid_link_flush(void)
+{
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		struct bt_hid_conn *conn = &conns[i];
+		if (!conn->cid || !conn->link_policy_pending) {
+			continue;
+		}
+
+		if (!hci_can_send_command_packet_now()) {
+			return;
+		}
+
+		hci_send_cmd(&hci_write_link_policy_settings, conn->con_handle, bt_hid_link_policy_settings(conn));
+		conn->link_policy_pending = false;
+	}
+}
+
+// Get out of a sniff interval that's longer than the balanced policy allows,
+// so we can go back in with our own
+static void bt_hid_link_bound_sniff(struct bt_hid_conn *conn)
+{
+	if ((conn->link_mode == LATENCY_LINK_SNIFF) && (conn->sniff_interval > LINK_BALANCED_SNIFF_MAX)) {
+		conn->resniff = true;
+		gap_sniff_mode_exit(conn->con_handle);
+	}
+}
+
+// Set a connection up for the current policy, when it connects or the
+// policy changes. write says whether its link policy settings need writing,
+// new connections get the default.
+static void bt_hid_link_apply(struct bt_hid_conn *conn, bool write)
+{
+	conn->link_idle = false;
+	conn->resniff = false;
+	conn->last_active_us = time_us_32();
+	conn->link_policy_pending = write;
+
+	switch (link_policy) {
+	case BT_HID_LINK_LATENCY:
+		if (conn->link_mode == LATENCY_LINK_SNIFF) {
+			gap_sniff_mode_exit(conn->con_handle);
+		}
+		break;
+	case BT_HID_LINK_BALANCED:
+		gap_sniff_subrating_configure(conn->con_handle, LINK_BALANCED_SUBRATE_MAX_LATENCY,
+		                              LINK_BALANCED_SUBRATE_TIMEOUT, LINK_BALANCED_SUBRATE_TIMEOUT);
+		bt_hid_link_bound_sniff(conn);
+		break;
+	case BT_HID_LINK_POWER:
+		break;
+	}
+}
+
+static void bt_hid_link_policy_handler(void *context)
+{
+	UNUSED(context);
+
+	if (link_policy_requested == link_policy) {
+		return;
+	}
+
+	link_policy = link_policy_requested;
+	bt_hid_event_push_name(BT_HID_EVENT_LINK_POLICY, BT_HID_EVENT_NO_IDX, 0, 0, link_policy_names[link_policy], false);
+
+	gap_set_default_link_policy_settings(bt_hid_link_policy_settings(NULL));
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		if (conns[i].cid) {
+			bt_hid_link_apply(&conns[i], true);
+		}
+	}
+	bt_hid_link_flush();
+}
+
+void bt_hid_set_link_policy(enum bt_hid_link_policy policy)
+{
+	link_policy_requested = policy;
+	link_policy_request.callback = &bt_hid_link_policy_handler;
+	btstack_run_loop_execute_on_main_thread(&link_policy_request);
+}
+
+// The controller's input changed
+static void bt_hid_link_active(struct bt_hid_conn *conn)
+{
+	conn->last_active_us = time_us_32();
+
+	if ((link_policy != BT_HID_LINK_LATENCY) || !conn->link_idle) {
+		return;
+	}
+
+	// Back out of sniff, and stay out
+	conn->link_idle = false;
+	conn->link_policy_pending = true;
+	if (conn->link_mode == LATENCY_LINK_SNIFF) {
+		gap_sniff_mode_exit(conn->con_handle);
+	}
+	bt_hid_link_flush();
+}
+
+static void bt_hid_link_mode_changed(struct bt_hid_conn *conn, uint8_t mode, uint16_t interval)
+{
+	conn->link_mode = mode;
+	conn->sniff_interval = interval;
+
+	bt_hid_event_push(BT_HID_EVENT_LINK_MODE, bt_hid_conn_idx(conn), conn->cid, mode,
+	                  mode == LATENCY_LINK_SNIFF ? (uint32_t)interval * 625 : 0, conn->addr);
+
+	switch (link_policy) {
+	case BT_HID_LINK_LATENCY:
+		// It got in before the policy was written
+		if ((mode == LATENCY_LINK_SNIFF) && !conn->link_idle) {
+			gap_sniff_mode_exit(conn->con_handle);
+		}
+		break;
+	case BT_HID_LINK_BALANCED:
+		if ((mode == LATENCY_LINK_ACTIVE) && conn->resniff) {
+			conn->resniff = false;
+			gap_sniff_mode_enter(conn->con_handle, LINK_BALANCED_SNIFF_MIN, LINK_BALANCED_SNIFF_MAX,
+			                     LINK_SNIFF_ATTEMPT, LINK_SNIFF_TIMEOUT);
+		} else {
+			bt_hid_link_bound_sniff(conn);
+		}
+		break;
+	case BT_HID_LINK_POWER:
+		break;
+	}
+}
+
+static void link_timer_handler(btstack_timer_source_t *ts)
+{
+	uint32_t now = time_us_32();
+
+	for (unsigned int i = 0; (link_policy == BT_HID_LINK_LATENCY) && (i < BT_HID_MAX_CONTROLLERS); i++) {
+		struct bt_hid_conn *conn = &conns[i];
+		if (!conn->cid) {
+			continue;
+		}
+
+		if (!conn->link_idle && (now - conn->last_active_us >= LINK_IDLE_MS * 1000)) {
+			bt_hid_event_push(BT_HID_EVENT_LINK_IDLE, i, conn->cid, 0, 0, conn->addr);
+			conn->link_idle = true;
+			conn->link_policy_pending = true;
+		} else if (conn->link_idle && !conn->link_policy_pending && (conn->link_mode == LATENCY_LINK_ACTIVE)) {
+			// Once sniff is allowed, save the controller some power
+			gap_sniff_mode_enter(conn->con_handle, LINK_IDLE_SNIFF_MIN, LINK_IDLE_SNIFF_MAX,
+			                     LINK_SNIFF_ATTEMPT, LINK_SNIFF_TIMEOUT);
+		}
+	}
+
+	bt_hid_link_flush();
+
+	btstack_run_loop_set_timer(ts, LINK_TIMER_MS);
+	btstack_run_loop_add_timer(ts);
+}
+
+static void hid_host_setup(void){
+	// Initialize L2CAP
+	l2cap_init();
+
+	sdp_init();
+
+	// Initialize HID Host
+	hid_host_init(hid_descriptor_storage, sizeof(hid_descriptor_storage));
+	hid_host_register_packet_handler(packet_handler);
+
+	// Support role switch, and sniff mode depending on the link policy
+	gap_set_default_link_policy_settings(bt_hid_link_policy_settings(NULL));
+
+	// try to become master on incoming connections
+	hci_set_master_slave_policy(HCI_ROLE_MASTER);
+
+	gap_set_page_timeout(PAGE_TIMEOUT);
+	gap_set_page_scan_type(PAGE_SCAN_MODE_INTERLACED);
+
+	// register for HCI events
+	hci_event_callback_registration.callback = &packet_handler;
+	hci_add_event_handler(&hci_event_callback_registration);
+}
+
+static struct bt_hid_conn *bt_hid_conn_find(uint16_t cid)
+{
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		if ((conns[i].cid == cid) && (cid || !(le_slots & (1u << i)))) {
+			return &conns[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct bt_hid_conn *bt_hid_conn_find_addr(bd_addr_t addr)
+{
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		if (conns[i].cid && !bd_addr_cmp(conns[i].addr, addr)) {
+			return &conns[i];
+		}
+	}
+
+	return NULL;
+}
+
+static unsigned int bt_hid_num_connected(void)
+{
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		n += conns[i].cid != 0;
+	}
+
+	return n + __builtin_popcount(le_slots);
+}
+
+static void bt_hid_output_run(struct bt_hid_conn *conn);
+
+// hid_host only does one control request at a time, and anything asked for
+// while it's busy is refused, or worse, quietly dropped. So they go out one
+// by one from here: the protocol first, then the feature report, then any
+// output. Called again whenever whatever was in the way finishes: a
+// SET_PROTOCOL or GET_REPORT response, or an output report being acked.
+static void bt_hid_control_run(struct bt_hid_conn *conn)
+{
+	if (!conn->cid || conn->control_pending || conn->output_in_flight) {
+		return;
+	}
+
+	if (conn->protocol_mode != conn->wanted_mode) {
+		if (hid_host_send_set_protocol_mode(conn->cid, conn->wanted_mode) == ERROR_CODE_SUCCESS) {
+			conn->control_pending = true;
+		}
+		return;
+	}
+
+	if (conn->feature_wanted) {
+		// Switches the DS4 to its "full" report, 0x11
+		if (hid_host_send_get_report(conn->cid, HID_REPORT_TYPE_FEATURE, 0x05) == ERROR_CODE_SUCCESS) {
+			conn->feature_wanted = false;
+			conn->control_pending = true;
+		}
+		return;
+	}
+
+	bt_hid_output_run(conn);
+}
+
+static void bt_hid_set_protocol(struct bt_hid_conn *conn, hid_protocol_mode_t mode)
+{
+	conn->wanted_mode = mode;
+	bt_hid_control_run(conn);
+}
+
+static void bt_hid_output_read(unsigned int idx, struct bt_hid_output *dst)
+{
+	const struct output_request *request = &output_requests[idx];
+
+	for ( ;; ) {
+		uint32_t seq = request->seq;
+		__mem_fence_acquire();
+
+		if (!(seq & 1)) {
+			memcpy(dst, &request->output, sizeof(*dst));
+			__mem_fence_acquire();
+			if (request->seq == seq) {
+				return;
+			}
+		}
+
+		tight_loop_contents();
+	}
+}
+
+// Send the slot's output, if it's different to what was last sent and
+// nothing is in the way. Called again whenever something that was in the way
+// finishes, so the report that goes out is always the latest.
+static void bt_hid_output_run(struct bt_hid_conn *conn)
+{
+	unsigned int idx = bt_hid_conn_idx(conn);
+	uint32_t now = time_us_32();
+	struct bt_hid_output output;
+
+	if (!conn->cid || !conn->channels_open || conn->control_pending) {
+		return;
+	}
+
+	if (conn->output_in_flight) {
+		if (now - conn->output_sent_us < OUTPUT_TIMEOUT_MS * 1000) {
+			return;
+		}
+		conn->output_in_flight = false;
+	}
+
+	bt_hid_output_read(idx, &output);
+	if (conn->output_sent_valid && !memcmp(&output, &conn->output_sent, sizeof(output))) {
+		return;
+	}
+
+	uint16_t len = bt_hid_report_get_profile(idx)->encode_output(&output, conn->output_report);
+	if (len < 2) {
+		return;
+	}
+
+	hci_connection_t *hci_conn = hci_connection_for_handle(conn->con_handle);
+	if (!hci_conn) {
+		return;
+	}
+	uint8_t queued = hci_conn->num_packets_sent;
+
+	// The first byte is the report ID, which hid_host wants separately
+	if (hid_host_send_report(conn->cid, conn->output_report[0], &conn->output_report[1], len - 1) != ERROR_CODE_SUCCESS) {
+		return;
+	}
+
+	// The controller acks each link's packets in order, so ours is done
+	// once everything queued ahead of it is. It's normally sent straight
+	// away, otherwise it's next once a buffer frees up.
+	conn->output_acks_left = (hci_conn->num_packets_sent != queued) ? hci_conn->num_packets_sent : queued + 1;
+	conn->output_sending = output;
+	conn->output_sent_us = now;
+	conn->output_in_flight = true;
+
+	btstack_run_loop_remove_timer(&output_timer);
+	btstack_run_loop_set_timer(&output_timer, OUTPUT_TIMEOUT_MS);
+	btstack_run_loop_add_timer(&output_timer);
+}
+
+// The controller has acked num packets on con_handle, which might include
+// the output report. Once it does, anything refused meanwhile can go.
+static void bt_hid_output_done(hci_con_handle_t con_handle, uint16_t num)
+{
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		struct bt_hid_conn *conn = &conns[i];
+		if (!conn->cid || !conn->output_in_flight || (conn->con_handle != con_handle)) {
+			continue;
+		}
+
+		if (num < conn->output_acks_left) {
+			conn->output_acks_left -= num;
+			continue;
+		}
+
+		conn->output_in_flight = false;
+		conn->output_sent = conn->output_sending;
+		conn->output_sent_valid = true;
+		bt_hid_control_run(conn);
+	}
+}
+
+// Catch any report that was never acked, and send it again
+static void output_timer_handler(btstack_timer_source_t *ts)
+{
+	UNUSED(ts);
+
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		if (conns[i].output_in_flight) {
+			bt_hid_output_run(&conns[i]);
+		}
+	}
+}
+
+static void bt_hid_output_handler(void *context)
+{
+	bt_hid_output_run(context);
+}
+
+void bt_hid_set_output(unsigned int idx, const struct bt_hid_output *output)
+{
+	struct output_request *request = &output_requests[idx];
+
+	request->seq = request->seq + 1;
+	__mem_fence_release();
+	memcpy(&request->output, output, sizeof(request->output));
+	__mem_fence_release();
+	request->seq = request->seq + 1;
+
+	// BTstack isn't thread-safe, so hand it over to the BT core
+	btstack_run_loop_execute_on_main_thread(&request->registration);
+}
+
+// hash is the descriptor's, if that's what picked the profile
+static void bt_hid_use_profile(struct bt_hid_conn *conn, const struct hid_profile *profile, uint32_t hash)
+{
+	bt_hid_event_push_name(BT_HID_EVENT_PROFILE, bt_hid_conn_idx(conn), 0, hash, profile->name, false);
+	bt_hid_set_protocol(conn, profile->protocol_mode);
+}
+
+static bool bt_hid_use_descriptor(struct bt_hid_conn *conn, const uint8_t *desc, uint16_t dlen)
+{
+	unsigned int idx = bt_hid_conn_idx(conn);
+
+	const struct hid_profile *profile = bt_hid_report_set_descriptor(idx, desc, dlen);
+	if (!profile) {
+		bt_hid_event_push_name(BT_HID_EVENT_PROFILE, idx, 1, 0, bt_hid_report_get_profile(idx)->name, false);
+		return false;
+	}
+
+	// The hash is what new controllers get added to the table with
+	bt_hid_use_profile(conn, profile, hid_profile_hash(desc, dlen));
+	return true;
+}
+
+// Parsed once here, so each report just needs a multiply per axis
+static void bt_hid_use_calibration(struct bt_hid_conn *conn, const uint8_t *report, uint16_t report_len)
+{
+	unsigned int idx = bt_hid_conn_idx(conn);
+	struct hid_imu_calibration calibration;
+
+	if (!bt_hid_report_parse_calibration(idx, report, report_len, &calibration)) {
+		return;
+	}
+
+	bt_hid_report_set_calibration(idx, &calibration);
+	if (hid_cache_put_calibration(conn->addr, &calibration)) {
+		BT_HID_LOG("[%u] Cached IMU calibration\n", idx);
+	}
+}
+
+// Pick the protocol mode to connect to addr with, loading its cached
+// descriptor if we're going to need it. start_us is when the connection
+// attempt started.
+static hid_protocol_mode_t bt_hid_connect_mode(struct bt_hid_conn *conn, bd_addr_t addr, uint32_t start_us)
+{
+	bd_addr_copy(conn->addr, addr);
+	conn->channels_open = false;
+	conn->cached_descriptor_len = 0;
+	conn->connect_start_us = start_us;
+	conn->first_report_pending = true;
+	conn->control_pending = false;
+	conn->feature_wanted = false;
+	conn->incoming = false;
+	conn->output_in_flight = false;
+	conn->output_sent_valid = false;
+
+	// Calibrated from the first report, if we've seen it before. It's
+	// fetched again once connected anyway, in case it's changed.
+	struct hid_imu_calibration calibration;
+	bool calibrated = hid_cache_get_calibration(addr, &calibration);
+	bt_hid_report_set_calibration(bt_hid_conn_idx(conn), calibrated ? &calibration : NULL);
+
+	if (hid_host_report_mode == HID_PROTOCOL_MODE_BOOT) {
+		// No SDP query to skip
+		return hid_host_report_mode;
+	}
+
+	conn->cached_descriptor_len = hid_cache_get(addr, conn->cached_descriptor, sizeof(conn->cached_descriptor));
+	if (conn->cached_descriptor_len) {
+		BT_HID_LOG("[%u] Using cached HID descriptor\n", bt_hid_conn_idx(conn));
+		return HID_PROTOCOL_MODE_BOOT;
+	}
+
+	return hid_host_report_mode;
+}
+
+// Returns the connection the SDP client's results are for, or NULL if it
+// has gone away.
+static struct bt_hid_conn *bt_hid_sdp_conn(void)
+{
+	if (!sdp_conn || !sdp_cid || (sdp_conn->cid != sdp_cid)) {
+		return NULL;
+	}
+
+	return sdp_conn;
+}
+
+static void descriptor_query_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
+{
+	UNUSED(packet_type);
+	UNUSED(channel);
+	UNUSED(size);
+
+	struct bt_hid_conn *conn;
+
+	switch (hci_event_packet_get_type(packet)) {
+	case SDP_EVENT_QUERY_ATTRIBUTE_VALUE:
+		{
+			uint16_t id = sdp_event_query_attribute_byte_get_attribute_id(packet);
+			uint16_t len = sdp_event_query_attribute_byte_get_attribute_length(packet);
+			uint16_t offset = sdp_event_query_attribute_byte_get_data_offset(packet);
+
+			if ((id != BLUETOOTH_ATTRIBUTE_HID_DESCRIPTOR_LIST) || (len > sizeof(descriptor_attribute))) {
+				break;
+			}
+
+			descriptor_attribute[offset] = sdp_event_query_attribute_byte_get_data(packet);
+			if (offset + 1 != len) {
+				break;
+			}
+
+			// A list of (type, descriptor) lists, same as hid_host takes the
+			// first descriptor string it finds
+			des_iterator_t list_it, desc_it;
+			for (des_iterator_init(&list_it, descriptor_attribute); des_iterator_has_more(&list_it); des_iterator_next(&list_it)) {
+				if (des_iterator_get_type(&list_it) != DE_DES) {
+					continue;
+				}
+				for (des_iterator_init(&desc_it, des_iterator_get_element(&list_it)); des_iterator_has_more(&desc_it); des_iterator_next(&desc_it)) {
+					if (des_iterator_get_type(&desc_it) != DE_STRING) {
+						continue;
+					}
+					uint8_t *element = des_iterator_get_element(&desc_it);
+					fresh_descriptor = de_get_string(element);
+					fresh_descriptor_len = de_get_data_size(element);
+					return;
+				}
+			}
+		}
+		break;
+	case SDP_EVENT_QUERY_COMPLETE:
+		conn = bt_hid_sdp_conn();
+		sdp_conn = NULL;
+		if (!conn) {
+			break;
+		}
+
+		if (!fresh_descriptor_len) {
+			BT_HID_LOG("[%u] Couldn't re-check the cached HID descriptor\n", bt_hid_conn_idx(conn));
+			break;
+		}
+
+		if ((fresh_descriptor_len == conn->cached_descriptor_len) &&
+		    !memcmp(fresh_descriptor, conn->cached_descriptor, fresh_descriptor_len)) {
+			break;
+		}
+
+		// Even if there's no room to cache it any more
+		BT_HID_LOG("[%u] HID descriptor has changed\n", bt_hid_conn_idx(conn));
+		bt_hid_use_descriptor(conn, fresh_descriptor, fresh_descriptor_len);
+		if (!hid_cache_put(conn->addr, fresh_descriptor, fresh_descriptor_len)) {
+			hid_cache_forget(conn->addr);
+		}
+		break;
+	}
+}
+
+static void descriptor_query_start(void *context)
+{
+	struct bt_hid_conn *conn = context;
+
+	// It might have gone away while we waited for the SDP client
+	if (!conn->cid) {
+		return;
+	}
+
+	sdp_conn = conn;
+	sdp_cid = conn->cid;
+	fresh_descriptor = NULL;
+	fresh_descriptor_len = 0;
+	sdp_client_query_uuid16(&descriptor_query_handler, conn->addr, BLUETOOTH_SERVICE_CLASS_HUMAN_INTERFACE_DEVICE_SERVICE);
+}
+
+static void device_id_query_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
+{
+	UNUSED(packet_type);
+	UNUSED(channel);
+	UNUSED(size);
+
+	struct bt_hid_conn *conn;
+
+	switch (hci_event_packet_get_type(packet)) {
+	case SDP_EVENT_QUERY_ATTRIBUTE_VALUE:
+		{
+			uint16_t id = sdp_event_query_attribute_byte_get_attribute_id(packet);
+			uint16_t len = sdp_event_query_attribute_byte_get_attribute_length(packet);
+			uint16_t offset = sdp_event_query_attribute_byte_get_data_offset(packet);
+
+			// Only the two IDs are interesting, and they're both small
+			if (((id != BLUETOOTH_ATTRIBUTE_VENDOR_ID) && (id != BLUETOOTH_ATTRIBUTE_PRODUCT_ID)) ||
+			    (len > sizeof(device_id_attribute))) {
+				break;
+			}
+
+			device_id_attribute[offset] = sdp_event_query_attribute_byte_get_data(packet);
+			if (offset + 1 != len) {
+				break;
+			}
+
+			uint16_t value;
+			if (de_element_get_uint16(device_id_attribute, &value)) {
+				if (id == BLUETOOTH_ATTRIBUTE_VENDOR_ID) {
+					device_id_vendor_id = value;
+				} else {
+					device_id_product_id = value;
+				}
+			}
+		}
+		break;
+	case SDP_EVENT_QUERY_COMPLETE:
+		conn = bt_hid_sdp_conn();
+		sdp_conn = NULL;
+		if (!conn) {
+			break;
+		}
+
+		bt_hid_event_push(BT_HID_EVENT_DEVICE_ID, bt_hid_conn_idx(conn), conn->cid, 0,
+		                  ((uint32_t)device_id_vendor_id << 16) | device_id_product_id, conn->addr);
+
+		const struct hid_profile *profile = bt_hid_report_set_device_id(bt_hid_conn_idx(conn),
+		                                                                device_id_vendor_id, device_id_product_id);
+		if (profile) {
+			bt_hid_use_profile(conn, profile, 0);
+		}
+		break;
+	}
+}
+
+static void device_id_query_start(void *context)
+{
+	struct bt_hid_conn *conn = context;
 
-static uint16_t hid_host_cid = 0;
-static bool     hid_host_descriptor_available = false;
-//static hid_protocol_mode_t hid_host_report_mode = HID_PROTOCOL_MODE_REPORT; //report mode
-static hid_protocol_mode_t hid_host_report_mode = HID_PROTOCOL_MODE_BOOT; //boot mode. one of these might work. oh my gosh it actually worked
+	// It might have gone away while we waited for the SDP client
+	if (!conn->cid) {
+		return;
+	}
 
-static void packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+	sdp_conn = conn;
+	sdp_cid = conn->cid;
+	device_id_vendor_id = 0;
+	device_id_product_id = 0;
+	sdp_client_query_uuid16(&device_id_query_handler, conn->addr, BLUETOOTH_SERVICE_CLASS_PNP_INFORMATION);
+}
 
-static void hid_host_setup(void){
-	// Initialize L2CAP
-	l2cap_init();
+static bool bt_hid_is_bonded(bd_addr_t addr)
+{
+	link_key_t link_key;
+	link_key_type_t type;
 
-	sdp_init();
+	return gap_get_link_key_for_bd_addr(addr, link_key, &type);
+}
 
-	// Initialize HID Host
-	hid_host_init(hid_descriptor_storage, sizeof(hid_descriptor_storage));
-	hid_host_register_packet_handler(packet_handler);
+// Anything BTstack has a link key for should be in the registry, even if it
+// was paired before the registry existed.
+static void bt_hid_import_bonded(void)
+{
+	btstack_link_key_iterator_t it;
+	link_key_t link_key;
+	link_key_type_t type;
+	bd_addr_t addr;
 
-	// Allow sniff mode requests by HID device and support role switch
-	gap_set_default_link_policy_settings(LM_LINK_POLICY_ENABLE_SNIFF_MODE | LM_LINK_POLICY_ENABLE_ROLE_SWITCH);
+	if (!gap_link_key_iterator_init(&it)) {
+		return;
+	}
 
-	// try to become master on incoming connections
-	hci_set_master_slave_policy(HCI_ROLE_MASTER);
+	while (gap_link_key_iterator_get_next(&it, addr, link_key, &type)) {
+		hid_registry_add(addr);
+	}
 
-	// register for HCI events
-	hci_event_callback_registration.callback = &packet_handler;
-	hci_add_event_handler(&hci_event_callback_registration);
+	gap_link_key_iterator_done(&it);
 }
 
-const struct bt_hid_state default_state = {
-	.buttons = 0,
-	.triggers = 0,
-	.lx = 0x80,
-	.ly = 0x80,
-	.rx = 0x80,
-	.ry = 0x80,
-	//.l2 = 0x80,
-	//.r2 = 0x80,
-	//.hat = 0x8,
-};
+static bool bt_hid_connect(bd_addr_t addr)
+{
+	struct bt_hid_conn *conn = bt_hid_conn_find(0);
+	if (!conn) {
+		return false;
+	}
 
-struct bt_hid_state latest;
-
-struct __attribute__((packed)) input_report_17 {
-	/*
-	//replacing the old code with my new report that uses 8 bytes.
-	uint8_t report_id;
-	uint8_t pad[2];
-
-	uint8_t lx, ly;
-	uint8_t rx, ry;
-	uint8_t buttons[3];
-	uint8_t l2, r2;
-
-	uint16_t timestamp;
-	uint16_t temperature;
-	uint16_t gyro[3];
-	uint16_t accel[3];
-	uint8_t pad2[5];
-	uint8_t status[2];
-	uint8_t pad3;
-	*/
-	//uint8_t report_id;
-	uint8_t pad;
-	uint8_t lx, ly;
-	uint8_t rx, ry;
-	uint8_t buttons;
-	uint8_t triggers;
-	uint8_t others[2];
-};
+	bd_addr_copy(remote_addr, addr);
+
+	uint8_t status = hid_host_connect(remote_addr, bt_hid_connect_mode(conn, remote_addr, time_us_32()), &conn->cid);
+	if (status != ERROR_CODE_SUCCESS){
+		bt_hid_event_push(BT_HID_EVENT_CONNECT_FAILED, bt_hid_conn_idx(conn), 0, status, 0, remote_addr);
+		conn->cid = 0;
+		return false;
+	}
+
+	bt_hid_event_push(BT_HID_EVENT_CONNECTING, bt_hid_conn_idx(conn), conn->cid, 0, 0, remote_addr);
+	paging_cid = conn->cid;
+	return true;
+}
+
+static void bt_hid_update_page_scan(void)
+{
+	bt_hog_update_scan();
+
+	bool fast = !bt_hid_num_connected();
+	if (fast == page_scan_fast) {
+		return;
+	}
+
+	page_scan_fast = fast;
+	if (fast) {
+		gap_set_page_scan_activity(PAGE_SCAN_FAST_INTERVAL, PAGE_SCAN_FAST_WINDOW);
+	} else {
+		gap_set_page_scan_activity(PAGE_SCAN_SLOW_INTERVAL, PAGE_SCAN_SLOW_WINDOW);
+	}
+}
+
+// Log how long the phase we're leaving took, to see where the time goes
+static void reconnect_set_phase(enum reconnect_phase phase)
+{
+	uint32_t now = time_us_32();
+
+	if (reconnect_phase != RECONNECT_IDLE) {
+		bt_hid_event_push_name(BT_HID_EVENT_RECONNECT, BT_HID_EVENT_NO_IDX, 0,
+		                       (now - reconnect_phase_start_us) / 1000, reconnect_phase_names[reconnect_phase], false);
+	}
+
+	reconnect_phase = phase;
+	reconnect_phase_start_us = now;
+}
+
+// xorshift32, only for jitter, so that several Pico Ws (or controllers)
+// don't stay in lockstep
+static uint32_t reconnect_random(void)
+{
+	reconnect_rand ^= reconnect_rand << 13;
+	reconnect_rand ^= reconnect_rand >> 17;
+	reconnect_rand ^= reconnect_rand << 5;
+	return reconnect_rand;
+}
+
+static void reconnect_page(void);
+
+static void reconnect_timer_handler(btstack_timer_source_t *ts)
+{
+	UNUSED(ts);
+
+	page_idx = 0;
+	reconnect_page();
+}
+
+// Stay connectable for a while before trying again
+static void reconnect_scan(void)
+{
+	if (!bt_hid_conn_find(0)) {
+		reconnect_set_phase(RECONNECT_IDLE);
+		return;
+	}
+
+	// backoff +/- 25%
+	uint32_t jitter = reconnect_backoff_ms / 2;
+	uint32_t delay_ms = reconnect_backoff_ms - jitter / 2 + reconnect_random() % (jitter + 1);
+
+	reconnect_set_phase(RECONNECT_SCAN);
+	bt_hid_event_push(BT_HID_EVENT_RECONNECT_WAIT, BT_HID_EVENT_NO_IDX, 0, 0, delay_ms, NULL);
+
+	reconnect_backoff_ms = btstack_min(reconnect_backoff_ms * 2, RECONNECT_BACKOFF_MAX_MS);
+
+	btstack_run_loop_set_timer_handler(&reconnect_timer, &reconnect_timer_handler);
+	btstack_run_loop_set_timer(&reconnect_timer, delay_ms);
+	btstack_run_loop_add_timer(&reconnect_timer);
+}
+
+// Page the next bonded controller in the registry, one at a time, until
+// they're all connected or we're full. If nothing connected, look for new
+// ones. Known controllers can still connect to us meanwhile.
+static void reconnect_page(void)
+{
+	paging_cid = 0;
+
+	if (reconnect_phase != RECONNECT_PAGE) {
+		reconnect_set_phase(RECONNECT_PAGE);
+	}
+
+	while ((page_idx < hid_registry_count()) && bt_hid_conn_find(0)) {
+		const struct hid_registry_device *device = hid_registry_get(page_idx++);
+
+		// Without a link key, it'd have to be in pairing mode to connect
+		bd_addr_t addr;
+		bd_addr_copy(addr, device->addr);
+		if (!bt_hid_is_bonded(addr) || bt_hid_conn_find_addr(addr)) {
+			continue;
+		}
+
+		remote_cod = device->class_of_device;
+		if (bt_hid_connect(addr)) {
+			return;
+		}
+	}
+
+	if (!bt_hid_conn_find(0)) {
+		reconnect_set_phase(RECONNECT_IDLE);
+		return;
+	}
+
+	// Inquiry takes a lot of the radio's time, which the controllers we
+	// already have would notice
+	if (bt_hid_num_connected()) {
+		reconnect_scan();
+		return;
+	}
+
+	reconnect_set_phase(RECONNECT_INQUIRY);
+	inquiry_found = false;
+	BT_HID_LOG("Looking for new controllers, put one in pairing mode\n");
+	gap_inquiry_start(INQUIRY_DURATION);
+}
+
+// Start a new round straight away, from the minimum backoff. Doesn't
+// interrupt a round which is already paging or looking.
+static void reconnect_start(void)
+{
+	reconnect_backoff_ms = RECONNECT_BACKOFF_MIN_MS;
+
+	switch (reconnect_phase) {
+	case RECONNECT_PAGE:
+	case RECONNECT_INQUIRY:
+	case RECONNECT_DISCOVER:
+		return;
+	case RECONNECT_SCAN:
+		btstack_run_loop_remove_timer(&reconnect_timer);
+		break;
+	case RECONNECT_IDLE:
+		break;
+	}
+
+	page_idx = 0;
+	reconnect_page();
+}
+
+// Something connected, so go back to short waits. If that used the last
+// slot, there's nothing left to do.
+static void reconnect_connected(void)
+{
+	reconnect_backoff_ms = RECONNECT_BACKOFF_MIN_MS;
+	bt_hid_update_page_scan();
+
+	if ((reconnect_phase == RECONNECT_SCAN) && !bt_hid_conn_find(0)) {
+		btstack_run_loop_remove_timer(&reconnect_timer);
+		reconnect_set_phase(RECONNECT_IDLE);
+	}
+}
+
+static void discovery_begin(void);
+
+// An outgoing connection we started has finished, one way or the other
+static void reconnect_connect_done(void)
+{
+	paging_cid = 0;
+
+	if (discovery_wanted) {
+		discovery_begin();
+		return;
+	}
+
+	switch (reconnect_phase) {
+	case RECONNECT_PAGE:
+		reconnect_page();
+		break;
+	case RECONNECT_INQUIRY:
+		reconnect_scan();
+		break;
+	case RECONNECT_DISCOVER:
+		// Back to the usual round, for anything else we know
+		page_idx = 0;
+		reconnect_page();
+		break;
+	default:
+		break;
+	}
+}
+
+static void discovery_begin(void)
+{
+	discovery_wanted = false;
+	discovery_count = 0;
+	discovery_next_name = 0;
+	discovery_name_pending = false;
+	discovery_inquiry_done = false;
+	inquiry_found = false;
+
+	reconnect_set_phase(RECONNECT_DISCOVER);
+	if (bt_hid_conn_find(0)) {
+		BT_HID_LOG("Discovery: looking for devices, put the controller in pairing mode\n");
+	} else {
+		BT_HID_LOG("Discovery: looking for devices, but there's no free slot to pair with one\n");
+	}
+	gap_inquiry_start(DISCOVERY_DURATION);
+}
+
+// Once the inquiry has stopped and all the names are in, pair with the HID
+// device we found, or carry on as usual
+static void discovery_finish(void)
+{
+	if (!discovery_inquiry_done || discovery_name_pending) {
+		return;
+	}
+
+	BT_HID_LOG("Discovery: found %u devices\n", discovery_count);
+
+	if (inquiry_found && bt_hid_conn_find(0) && !bt_hid_conn_find_addr(remote_addr)) {
+		inquiry_found = false;
+		BT_HID_LOG("Discovery: pairing with %s\n", bd_addr_to_str(remote_addr));
+		if (bt_hid_connect(remote_addr)) {
+			return;
+		}
+	}
+	inquiry_found = false;
+
+	page_idx = 0;
+	reconnect_page();
+}
+
+static void discovery_next(void)
+{
+	while (!discovery_name_pending && (discovery_next_name < discovery_count)) {
+		struct discovery_device *device = &discovery_devices[discovery_next_name++];
+		if (device->named) {
+			continue;
+		}
+
+		// Bit 15 says the clock offset is valid, which saves the
+		// controller some paging
+		if (gap_remote_name_request(device->addr, device->page_scan_repetition_mode,
+		                            device->clock_offset | 0x8000) == ERROR_CODE_SUCCESS) {
+			discovery_name_pending = true;
+		} else {
+			BT_HID_LOG("Discovery: couldn't ask %s for its name\n", bd_addr_to_str(device->addr));
+		}
+	}
+
+	discovery_finish();
+}
+
+static void discovery_inquiry_result(const uint8_t *packet)
+{
+	bd_addr_t addr;
+	gap_event_inquiry_result_get_bd_addr(packet, addr);
+
+	// Devices answer an inquiry more than once
+	for (unsigned int i = 0; i < discovery_count; i++) {
+		if (!bd_addr_cmp(discovery_devices[i].addr, addr)) {
+			return;
+		}
+	}
+	if (discovery_count >= DISCOVERY_MAX_DEVICES) {
+		return;
+	}
+
+	struct discovery_device *device = &discovery_devices[discovery_count++];
+	bd_addr_copy(device->addr, addr);
+	device->cod = gap_event_inquiry_result_get_class_of_device(packet);
+	device->page_scan_repetition_mode = gap_event_inquiry_result_get_page_scan_repetition_mode(packet);
+	device->clock_offset = gap_event_inquiry_result_get_clock_offset(packet);
+	device->named = gap_event_inquiry_result_get_name_available(packet);
+
+	BT_HID_LOG("Discovery: %s, CoD 0x%06" PRIx32 "%s\n", bd_addr_to_str(addr), device->cod,
+	           hid_registry_is_hid(device->cod) ? " (HID)" : "");
+	if (device->named) {
+		// Extended inquiry response, it already told us
+		BT_HID_LOG("Discovery: %s is \"%.*s\"\n", bd_addr_to_str(addr),
+		           gap_event_inquiry_result_get_name_len(packet), gap_event_inquiry_result_get_name(packet));
+	}
+
+	// The first HID device is the one to pair with. Stop looking, but
+	// finish getting the names of everything found so far.
+	if (!inquiry_found && hid_registry_is_hid(device->cod) && bt_hid_conn_find(0)) {
+		bd_addr_copy(remote_addr, addr);
+		remote_cod = device->cod;
+		inquiry_found = true;
+		gap_inquiry_stop();
+	}
+
+	discovery_next();
+}
+
+static void discovery_name_complete(const uint8_t *packet)
+{
+	bd_addr_t addr;
+	hci_event_remote_name_request_complete_get_bd_addr(packet, addr);
 
-static void hid_host_handle_interrupt_report(const uint8_t *packet, uint16_t packet_len){
-	static struct bt_hid_state last_state = { 0 };
-
-	//printf_hexdump(packet, packet_len);
-	/*
-	1-2 bytes don't change, I beleive are used for the report type.
-	3rd byte is left joystick, side to side
-		default value is 0x80
-	4th byte is left joystick, up and down
-		default value is 0x80
-	5th byte is right joystick, side to side
-		default value is 0x80
-	6th byte is right joystick, up and down
-		default value is 0x80
-	7th byte is the 4 face buttons and dpad. and also the left underneath buttons.
-	   default value is 0x08
-	8th byte is the triggers and bumper buttons. also, the left trigger also affects the 10th byte. but not the 9th... 
-	It's also the select and start buttons.
-	*/
-
-	/*
-	//apparently way too small, it wants a size of at least 37 but this is 10.
-	// Only interested in report_id 0x11
-	if (packet_len < sizeof(struct input_report_17) + 1) {
-		printf("Packet too small: %d\n", packet_len);
-		printf("Expected at least %zu\n", sizeof(struct input_report_17) + 1);
+	if (!discovery_name_pending || (reconnect_phase != RECONNECT_DISCOVER)) {
 		return;
 	}
-	*/
+	discovery_name_pending = false;
+
+	if (hci_event_remote_name_request_complete_get_status(packet) == ERROR_CODE_SUCCESS) {
+		BT_HID_LOG("Discovery: %s is \"%s\"\n", bd_addr_to_str(addr),
+		           hci_event_remote_name_request_complete_get_remote_name(packet));
+	} else {
+		BT_HID_LOG("Discovery: %s didn't give its name\n", bd_addr_to_str(addr));
+	}
+
+	discovery_next();
+}
 
-	/*
-	//I don't understand this one- sas packet[0] is a1 and packet1] is 01. I guess packet 2 needs to be 11 instead of 01 for some reason?
-	if ((packet[0] != 0xa1) || (packet[1] != 0x11)) {
-		printf("Invalid packet: %02x %02x\n", packet[0], packet[1]);
+// Don't interrupt a connection in progress, it'll start after. Anything
+// else can stop early.
+static void discovery_start(void *context)
+{
+	UNUSED(context);
+
+	switch (reconnect_phase) {
+	case RECONNECT_DISCOVER:
+		BT_HID_LOG("Discovery: already looking\n");
+		return;
+	case RECONNECT_PAGE:
+		discovery_wanted = true;
+		return;
+	case RECONNECT_INQUIRY:
+		// Starts once GAP_EVENT_INQUIRY_COMPLETE says it has stopped
+		discovery_wanted = true;
+		if (!paging_cid) {
+			inquiry_found = false;
+			gap_inquiry_stop();
+		}
 		return;
+	case RECONNECT_SCAN:
+		btstack_run_loop_remove_timer(&reconnect_timer);
+		break;
+	case RECONNECT_IDLE:
+		break;
 	}
-	*/
 
-	struct input_report_17 *report = (struct input_report_17 *)&packet[1];
+	discovery_begin();
+}
+
+void bt_hid_start_discovery(void)
+{
+	// BTstack isn't thread-safe, so hand it over to the BT core
+	discovery_request.callback = &discovery_start;
+	btstack_run_loop_execute_on_main_thread(&discovery_request);
+}
 
-	// Note: This assumes that we're protected by async_context's
-	// single-threaded-ness
-	latest = (struct bt_hid_state){
-		// Somewhat arbitrary packing of the buttons into a single 16-bit word
-		//.buttons = ((report->buttons[0] & 0xf0) << 8) | ((report->buttons[2] & 0x3) << 8) | (report->buttons[1]),
-		.buttons = report->buttons,
-		.triggers = report->triggers,
+static void bt_hid_disconnected(struct bt_hid_conn *conn)
+{
+	conn->cid = 0;
+	conn->channels_open = false;
+	conn->cached_descriptor_len = 0;
 
-		.lx = report->lx,
-		.ly = report->ly,
-		.rx = report->rx,
-		.ry = report->ry,
-		//.l2 = report->l2,
-		//.r2 = report->r2,
+	bt_hid_report_reset(bt_hid_conn_idx(conn));
+	bt_hid_update_page_scan();
+}
 
-		//.hat = (report->buttons[0] & 0xf),
-	};
+int bt_hid_slot_claim(void)
+{
+	struct bt_hid_conn *conn = bt_hid_conn_find(0);
+	if (!conn) {
+		return -1;
+	}
 
-	// TODO: Parse out battery, touchpad, sixaxis, timestamp, temperature(?!)
-	// Sensors will also need calibration
+	unsigned int idx = bt_hid_conn_idx(conn);
+	le_slots |= 1u << idx;
+	bt_hid_report_reset(idx);
+	latency_interval_reset(idx);
 
+	reconnect_connected();
+	return idx;
 }
 
-void bt_hid_get_latest(struct bt_hid_state *dst)
+void bt_hid_slot_release(unsigned int idx)
 {
-	async_context_t *context = cyw43_arch_async_context();
-	async_context_acquire_lock_blocking(context);
-	memcpy(dst, &latest, sizeof(*dst));
-	async_context_release_lock(context);
+	le_slots &= ~(1u << idx);
+	bt_hid_report_reset(idx);
+	bt_hid_update_page_scan();
+
+	reconnect_start();
 }
 
-static void bt_hid_disconnected(bd_addr_t addr)
+unsigned int bt_hid_slots_free(void)
 {
-	hid_host_cid = 0;
-	hid_host_descriptor_available = false;
+	return BT_HID_MAX_CONTROLLERS - bt_hid_num_connected();
+}
 
-	memcpy(&latest, &default_state, sizeof(latest));
+unsigned int bt_hid_slots_used(void)
+{
+	return bt_hid_num_connected();
 }
 
 static void packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
@@ -237,6 +1392,8 @@ static void packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *pack
 	bd_addr_t event_addr;
 	uint8_t   status;
 	uint8_t reason;
+	uint16_t  cid;
+	struct bt_hid_conn *conn;
 
 	if (packet_type != HCI_EVENT_PACKET) {
 		return;
@@ -246,23 +1403,99 @@ static void packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *pack
 	event = hci_event_packet_get_type(packet);
 	switch (event) {
 	case BTSTACK_EVENT_STATE:
-		// On boot, we try a manual connection
+		// On boot, we try the controllers we know, then look for new ones
 		if (btstack_event_state_get_state(packet) == HCI_STATE_WORKING){
-			printf("Starting hid_host_connect (%s)\n", bd_addr_to_str(remote_addr));
-			status = hid_host_connect(remote_addr, hid_host_report_mode, &hid_host_cid);
-			if (status != ERROR_CODE_SUCCESS){
-				printf("hid_host_connect command failed: 0x%02x\n", status);
+			bt_hid_boot_mark(BT_HID_BOOT_HCI);
+			hid_registry_init();
+			bt_hid_import_bonded();
+			BT_HID_LOG("%d known controllers\n", hid_registry_count());
+
+			reconnect_rand = time_us_32() | 1;
+			page_scan_fast = false;
+			bt_hid_update_page_scan();
+			reconnect_start();
+		}
+		break;
+	case GAP_EVENT_INQUIRY_RESULT:
+		if (reconnect_phase == RECONNECT_DISCOVER) {
+			discovery_inquiry_result(packet);
+			break;
+		}
+		{
+			uint32_t cod = gap_event_inquiry_result_get_class_of_device(packet);
+			if (inquiry_found || !bt_hid_conn_find(0) || !hid_registry_is_gamepad(cod)) {
+				break;
+			}
+
+			gap_event_inquiry_result_get_bd_addr(packet, remote_addr);
+			BT_HID_LOG("Found controller %s, CoD 0x%06" PRIx32 "\n", bd_addr_to_str(remote_addr), cod);
+
+			// Connect once the inquiry has stopped
+			remote_cod = cod;
+			inquiry_found = true;
+			gap_inquiry_stop();
+		}
+		break;
+	case GAP_EVENT_INQUIRY_COMPLETE:
+		if (reconnect_phase == RECONNECT_DISCOVER) {
+			discovery_inquiry_done = true;
+			discovery_finish();
+			break;
+		}
+		if (reconnect_phase != RECONNECT_INQUIRY) {
+			break;
+		}
+		if (discovery_wanted) {
+			discovery_begin();
+			break;
+		}
+		if (inquiry_found && bt_hid_conn_find(0)) {
+			inquiry_found = false;
+			if (bt_hid_connect(remote_addr)) {
+				break;
 			}
+		} else if (!bt_hid_num_connected()) {
+			BT_HID_LOG("No new controllers found\n");
 		}
+		reconnect_scan();
 		break;
-	case HCI_EVENT_CONNECTION_COMPLETE:
-		status = hci_event_connection_complete_get_status(packet);
-		printf("Connection complete: %x\n", status);
+	case HCI_EVENT_REMOTE_NAME_REQUEST_COMPLETE:
+		discovery_name_complete(packet);
+		break;
+	case HCI_EVENT_CONNECTION_REQUEST:
+		link_request_us = time_us_32();
 		break;
 	case HCI_EVENT_DISCONNECTION_COMPLETE:
-		status = hci_event_disconnection_complete_get_status(packet);
+		// hid_host has already closed the connection by now, but this is
+		// where the reason is
+		if (hci_event_disconnection_complete_get_status(packet) != ERROR_CODE_SUCCESS) {
+			break;
+		}
 		reason = hci_event_disconnection_complete_get_reason(packet);
-		printf("Disconnection complete: status: %x, reason: %x\n", status, reason);
+		for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+			if (conns[i].con_handle == hci_event_disconnection_complete_get_connection_handle(packet)) {
+				bt_hid_event_push(BT_HID_EVENT_DISCONNECTED, i, conns[i].cid, reason, 0, conns[i].addr);
+				conns[i].con_handle = HCI_CON_HANDLE_INVALID;
+			}
+		}
+		break;
+	case HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS:
+		// Handles and counts, interleaved
+		for (unsigned int i = 0; (i < packet[2]) && (3u + i * 4u + 4u <= size); i++) {
+			bt_hid_output_done(little_endian_read_16(packet, 3 + i * 4) & 0x0fff,
+			                   little_endian_read_16(packet, 3 + i * 4 + 2));
+		}
+		break;
+	case HCI_EVENT_MODE_CHANGE:
+		if (hci_event_mode_change_get_status(packet) != ERROR_CODE_SUCCESS) {
+			break;
+		}
+		for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+			if (conns[i].cid && (conns[i].con_handle == hci_event_mode_change_get_handle(packet))) {
+				bt_hid_link_mode_changed(&conns[i], hci_event_mode_change_get_mode(packet),
+				                         hci_event_mode_change_get_interval(packet));
+			}
+		}
 		break;
 	case HCI_EVENT_MAX_SLOTS_CHANGED:
 		status = hci_event_max_slots_changed_get_lmp_max_slots(packet);
@@ -281,83 +1514,186 @@ static void packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *pack
 		switch (hid_event) {
 		case HID_SUBEVENT_INCOMING_CONNECTION:
 			hid_subevent_incoming_connection_get_address(packet, event_addr);
-			printf("Accepting connection from %s\n", bd_addr_to_str(event_addr));
-			hid_host_accept_connection(hid_subevent_incoming_connection_get_hid_cid(packet), hid_host_report_mode);
+			cid = hid_subevent_incoming_connection_get_hid_cid(packet);
+			conn = bt_hid_conn_find(0);
+			if (!conn) {
+				bt_hid_event_push(BT_HID_EVENT_DECLINED, BT_HID_EVENT_NO_IDX, cid, 0, 0, event_addr);
+				hid_host_decline_connection(cid);
+				break;
+			}
+			bt_hid_event_push(BT_HID_EVENT_CONNECTING, bt_hid_conn_idx(conn), cid, 0, 1, event_addr);
+			conn->cid = cid;
+			hid_host_accept_connection(cid, bt_hid_connect_mode(conn, event_addr, link_request_us));
+			conn->incoming = true;
 			break;
 		case HID_SUBEVENT_CONNECTION_OPENED:
 			status = hid_subevent_connection_opened_get_status(packet);
 			hid_subevent_connection_opened_get_bd_addr(packet, event_addr);
+			cid = hid_subevent_connection_opened_get_hid_cid(packet);
+			conn = bt_hid_conn_find(cid);
 			if (status != ERROR_CODE_SUCCESS) {
-				printf("Connection to %s failed: 0x%02x\n", bd_addr_to_str(event_addr), status);
-				bt_hid_disconnected(event_addr);
+				bt_hid_event_push(BT_HID_EVENT_CONNECT_FAILED, conn ? bt_hid_conn_idx(conn) : BT_HID_EVENT_NO_IDX,
+				                  cid, status, conn ? (time_us_32() - conn->connect_start_us) / 1000 : 0,
+				                  event_addr);
+				if (conn) {
+					bt_hid_disconnected(conn);
+				}
+				if (cid == paging_cid) {
+					reconnect_connect_done();
+				}
 				return;
 			}
-			hid_host_descriptor_available = false;
-			hid_host_cid = hid_subevent_connection_opened_get_hid_cid(packet);
-			printf("Connected to %s\n", bd_addr_to_str(event_addr));
-			bd_addr_copy(connected_addr, event_addr);
+			if (!conn) {
+				break;
+			}
+			conn->channels_open = true;
+			conn->protocol_mode = conn->cached_descriptor_len ? HID_PROTOCOL_MODE_BOOT : hid_host_report_mode;
+			conn->wanted_mode = conn->protocol_mode;
+			// hid_host sets the protocol itself on incoming connections, once
+			// it has the descriptor (or knows it won't get one). Nothing else
+			// can go until that's answered.
+			conn->control_pending = conn->incoming;
+			bd_addr_copy(conn->addr, event_addr);
+			bt_hid_event_push(BT_HID_EVENT_CONNECTED, bt_hid_conn_idx(conn), cid, 0,
+			                  (time_us_32() - conn->connect_start_us) / 1000, event_addr);
+
+			conn->con_handle = hid_subevent_connection_opened_get_con_handle(packet);
+			conn->link_mode = LATENCY_LINK_ACTIVE;
+			conn->sniff_interval = 0;
+			bt_hid_link_apply(conn, false);
+			latency_interval_reset(bt_hid_conn_idx(conn));
+
+			// It might have connected to us while we were looking.
+			// Discovery still pairs with what it found, once it's done.
+			if (reconnect_phase != RECONNECT_DISCOVER) {
+				inquiry_found = false;
+			}
+			gap_inquiry_stop();
+
+			// Only keep the CoD if it's the one we were paging
+			hid_registry_seen(event_addr, bd_addr_cmp(event_addr, remote_addr) ? 0 : remote_cod);
+
+			// The SDP client might still be busy with another query
+			conn->device_id_query_request.callback = &device_id_query_start;
+			conn->device_id_query_request.context = conn;
+			sdp_client_register_query_callback(&conn->device_id_query_request);
+
+			// Ask for FEATURE 0x05 whatever the protocol: it switches the
+			// controller to "full" report mode, and it's also the IMU
+			// calibration. Anything the app set before now can go out
+			// after it.
+			conn->feature_wanted = true;
+			bt_hid_control_run(conn);
+
+			// On to the next known controller, if there's room
+			reconnect_connected();
+			if (cid == paging_cid) {
+				reconnect_connect_done();
+			}
 			break;
 		case HID_SUBEVENT_DESCRIPTOR_AVAILABLE:
+			cid = hid_subevent_descriptor_available_get_hid_cid(packet);
+			conn = bt_hid_conn_find(cid);
+			if (!conn) {
+				break;
+			}
 			status = hid_subevent_descriptor_available_get_status(packet);
 			if (status == ERROR_CODE_SUCCESS){
-				hid_host_descriptor_available = true;
 
-				uint16_t dlen = hid_descriptor_storage_get_descriptor_len(hid_host_cid);
-				printf("HID descriptor available. Len: %d\n", dlen);
+				const uint8_t *desc = hid_descriptor_storage_get_descriptor_data(cid);
+				uint16_t dlen = hid_descriptor_storage_get_descriptor_len(cid);
+				bt_hid_event_push(BT_HID_EVENT_DESCRIPTOR, bt_hid_conn_idx(conn), cid, 0, dlen, conn->addr);
+				if (bt_hid_use_descriptor(conn, desc, dlen) && hid_cache_put(conn->addr, desc, dlen)) {
+					BT_HID_LOG("[%u] Cached HID descriptor\n", bt_hid_conn_idx(conn));
+				}
+			} else if (conn->cached_descriptor_len) {
+				// We connected in boot mode to skip SDP, so there's no
+				// descriptor from hid_host. Use ours, and check it later.
+				bt_hid_event_push(BT_HID_EVENT_DESCRIPTOR, bt_hid_conn_idx(conn), cid, 0,
+				                  conn->cached_descriptor_len, conn->addr);
+				bt_hid_use_descriptor(conn, conn->cached_descriptor, conn->cached_descriptor_len);
 
-				// Send FEATURE 0x05, to switch the controller to "full" report mode
-				hid_host_send_get_report(hid_host_cid, HID_REPORT_TYPE_FEATURE, 0x05);
+				conn->descriptor_query_request.callback = &descriptor_query_start;
+				conn->descriptor_query_request.context = conn;
+				sdp_client_register_query_callback(&conn->descriptor_query_request);
 			} else {
-				printf("Couldn't process HID Descriptor, status: %d\n", status);
+				bt_hid_event_push(BT_HID_EVENT_DESCRIPTOR, bt_hid_conn_idx(conn), cid, status, 0, conn->addr);
 			}
+
+			// hid_host might have been too busy for FEATURE 0x05 until now
+			bt_hid_control_run(conn);
 			break;
 		case HID_SUBEVENT_REPORT:
-			if (hid_host_descriptor_available){
-				hid_host_handle_interrupt_report(hid_subevent_report_get_report(packet), hid_subevent_report_get_report_len(packet));
-			} else {
+			{
+				uint32_t now = latency_mark(LATENCY_DISPATCH);
+				conn = bt_hid_conn_find(hid_subevent_report_get_hid_cid(packet));
+				if (!conn) {
+					break;
+				}
+				latency_report_interval(bt_hid_conn_idx(conn), conn->link_mode, now);
+				if (conn->first_report_pending) {
+					conn->first_report_pending = false;
+					// status says whether the cache was used, to compare
+					bt_hid_event_push(BT_HID_EVENT_FIRST_REPORT, bt_hid_conn_idx(conn), conn->cid,
+					                  conn->cached_descriptor_len != 0,
+					                  (time_us_32() - conn->connect_start_us) / 1000, conn->addr);
+				}
 				//these are clogging the output.
-				//printf("No hid host descriptor available\n");
 				//printf_hexdump(hid_subevent_report_get_report(packet), hid_subevent_report_get_report_len(packet));
-				/* 
-				//prints out the entire packet, but the first 7 bytes I beleive are related to protocol headers.
-				printf("Raw Report (%u bytes): ", size);
-				for (int i = 0; i < size; i++) {
-					printf("%02X ", packet[i]);
+				if (hid_host_handle_interrupt_report(bt_hid_conn_idx(conn), hid_subevent_report_get_report(packet),
+				                                     hid_subevent_report_get_report_len(packet))) {
+					bt_hid_link_active(conn);
 				}
-				printf("\n");
-				*/
-				hid_host_handle_interrupt_report(hid_subevent_report_get_report(packet), hid_subevent_report_get_report_len(packet));
 			}
 			break;
 		case HID_SUBEVENT_SET_PROTOCOL_RESPONSE:
-			status = hid_subevent_set_protocol_response_get_handshake_status(packet);
-			if (status != HID_HANDSHAKE_PARAM_TYPE_SUCCESSFUL){
-				printf("Protocol handshake error: 0x%02x\n", status);
+			conn = bt_hid_conn_find(hid_subevent_set_protocol_response_get_hid_cid(packet));
+			if (!conn) {
 				break;
 			}
+			status = hid_subevent_set_protocol_response_get_handshake_status(packet);
 			hid_protocol_mode_t proto = hid_subevent_set_protocol_response_get_protocol_mode(packet);
-			switch (proto) {
-			case HID_PROTOCOL_MODE_BOOT:
-				printf("Negotiated protocol: BOOT\n");
-				break;
-			case HID_PROTOCOL_MODE_REPORT:
-				printf("Negotiated protocol: REPORT\n");
-				break;
-			default:
-				printf("Negotiated unknown protocol: 0x%x\n", proto);
-				break;
+			bt_hid_event_push(BT_HID_EVENT_PROTOCOL, bt_hid_conn_idx(conn), conn->cid, status, proto, conn->addr);
+			conn->control_pending = false;
+			if (status == HID_HANDSHAKE_PARAM_TYPE_SUCCESSFUL){
+				switch (proto) {
+				case HID_PROTOCOL_MODE_BOOT:
+				case HID_PROTOCOL_MODE_REPORT:
+					conn->protocol_mode = proto;
+					break;
+				default:
+					break;
+				}
 			}
+			// Including anything asked for while this one was in flight
+			bt_hid_control_run(conn);
 			break;
 		case HID_SUBEVENT_CONNECTION_CLOSED:
-			printf("HID connection closed: %s\n", bd_addr_to_str(connected_addr));
-			bt_hid_disconnected(connected_addr);
+			conn = bt_hid_conn_find(hid_subevent_connection_closed_get_hid_cid(packet));
+			if (!conn) {
+				break;
+			}
+			// BT_HID_EVENT_DISCONNECTED comes with HCI_EVENT_DISCONNECTION_COMPLETE
+			bt_hid_disconnected(conn);
+
+			// It might still be on, e.g. if it went out of range
+			reconnect_start();
 			break;
 		case HID_SUBEVENT_GET_REPORT_RESPONSE:
-			{
-				status = hid_subevent_get_report_response_get_handshake_status(packet);
-				uint16_t dlen =  hid_subevent_get_report_response_get_report_len(packet);
-				printf("GET_REPORT response. status: %d, len: %d\n", status, dlen);
+			conn = bt_hid_conn_find(hid_subevent_get_report_response_get_hid_cid(packet));
+			if (!conn) {
+				break;
+			}
+			status = hid_subevent_get_report_response_get_handshake_status(packet);
+			bt_hid_event_push(BT_HID_EVENT_GET_REPORT, bt_hid_conn_idx(conn), conn->cid, status,
+			                  hid_subevent_get_report_response_get_report_len(packet), conn->addr);
+			conn->control_pending = false;
+			if (status == HID_HANDSHAKE_PARAM_TYPE_SUCCESSFUL) {
+				bt_hid_use_calibration(conn, hid_subevent_get_report_response_get_report(packet),
+				                       hid_subevent_get_report_response_get_report_len(packet));
 			}
+			// A profile might have asked for another protocol meanwhile
+			bt_hid_control_run(conn);
 			break;
 		default:
 			printf("Unknown HID subevent: 0x%x\n", hid_event);
@@ -370,13 +1706,22 @@ static void packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *pack
 	}
 }
 
+static void stale_timer_handler(btstack_timer_source_t *ts)
+{
+	// The app hears about it from a BT_HID_REPORT_STALE report
+	bt_hid_report_check_stale();
+
+	btstack_run_loop_set_timer(ts, STALE_CHECK_MS);
+	btstack_run_loop_add_timer(ts);
+}
+
 #define BLINK_MS 250
 static btstack_timer_source_t blink_timer;
 static void blink_handler(btstack_timer_source_t *ts)
 {
 	static bool on = 0;
 
-	if (hid_host_cid != 0) {
+	if (bt_hid_num_connected()) {
 		on = true;
 	} else {
 		on = !on;
@@ -388,11 +1733,34 @@ static void blink_handler(btstack_timer_source_t *ts)
 	btstack_run_loop_add_timer(&blink_timer);
 }
 
+// Set once bt_main() has set up everything the app uses. Not the FIFO: the
+// multicore lockout for flash writes takes over core 0's FIFO interrupt and
+// throws away anything else that comes through it.
+static volatile bool bt_hid_ready;
+
+void bt_hid_wait_ready(void)
+{
+	while (!bt_hid_ready) {
+		__wfe();
+	}
+
+	// Everything bt_main() did before setting it
+	__mem_fence_acquire();
+}
+
 void bt_main(void) {
+	bt_hid_report_init();
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		conns[i].con_handle = HCI_CON_HANDLE_INVALID;
+	}
+
 	if (cyw43_arch_init()) {
 		printf("Wi-Fi init failed\n");
 		return;
 	}
+	bt_hid_boot_mark(BT_HID_BOOT_CYW43);
+
+	latency_init();
 
 	gap_set_security_level(LEVEL_2);
 
@@ -400,11 +1768,34 @@ void bt_main(void) {
 	btstack_run_loop_set_timer(&blink_timer, BLINK_MS);
 	btstack_run_loop_add_timer(&blink_timer);
 
+	link_timer.process = &link_timer_handler;
+	btstack_run_loop_set_timer(&link_timer, LINK_TIMER_MS);
+	btstack_run_loop_add_timer(&link_timer);
+
+	output_timer.process = &output_timer_handler;
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		output_requests[i].registration.callback = &bt_hid_output_handler;
+		output_requests[i].registration.context = &conns[i];
+	}
+
+	stale_timer.process = &stale_timer_handler;
+	btstack_run_loop_set_timer(&stale_timer, STALE_CHECK_MS);
+	btstack_run_loop_add_timer(&stale_timer);
+
 	hid_host_setup();
-	sscanf_bd_addr(remote_addr_string, remote_addr);
-	bt_hid_disconnected(remote_addr);
+	bt_hog_init();
+
+	// That's all the app needs (the run loop exists, for anything it hands
+	// over), so it can get going while the firmware downloads
+	bt_hid_boot_mark(BT_HID_BOOT_READY);
+	__mem_fence_release();
+	bt_hid_ready = true;
+	__sev();
 
+	// Opening the transport downloads the firmware, before this returns.
+	// HCI comes up from the run loop.
 	hci_power_control(HCI_POWER_ON);
+	bt_hid_boot_mark(BT_HID_BOOT_FIRMWARE);
 
 	btstack_run_loop_execute();
 }
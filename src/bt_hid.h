@@ -1,10 +1,65 @@
 // SPDX-License-Identifier: BSD-3-Clause
 // Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
 
+#ifndef BT_HID_H
+#define BT_HID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
 // Setup and run the bluetooth stack, will never return
 // i.e. start this on Core 1 with multicore_launch_core1()
 void bt_main(void);
 
+// Wait for bt_main(), launched on core 1, to get far enough that the rest of
+// the API can be used. The radio firmware is still downloading when this
+// returns.
+void bt_hid_wait_ready(void);
+
+// How many controllers can be connected at once. Each one gets a fixed
+// index, from when it connects until it disconnects. BTstack's connection
+// limits in btstack_config.h have to allow for this many.
+#ifndef BT_HID_MAX_CONTROLLERS
+#define BT_HID_MAX_CONTROLLERS 4
+#endif
+
+// If a controller stops sending reports for this long without
+// disconnecting (out of range, interference...), its state is forced to
+// default_state until the next report, so nothing keeps acting on old
+// input. 0 turns it off. Controllers which only report when their input
+// changes (see reports_on_change in hid_profile.h) aren't watched.
+#ifndef BT_HID_STALE_TIMEOUT_MS
+#define BT_HID_STALE_TIMEOUT_MS 200
+#endif
+
+// How to trade report latency against the controllers' battery life. Sniff
+// mode saves power by only talking every so often, which makes the time
+// between reports longer and less regular.
+enum bt_hid_link_policy {
+	// No sniff while the controller is in use. After 30 s without any
+	// change in input, it's allowed to sniff until the next one.
+	BT_HID_LINK_LATENCY,
+	// Sniff is allowed, but with the interval and subrating bounded, so
+	// reports are never more than ~10-20 ms apart
+	BT_HID_LINK_BALANCED,
+	// Whatever the controller asks for
+	BT_HID_LINK_POWER,
+};
+
+#ifndef BT_HID_LINK_POLICY
+#define BT_HID_LINK_POLICY BT_HID_LINK_LATENCY
+#endif
+
+// Change the link policy, for all controllers. Can be called from either
+// core, it takes effect shortly after.
+void bt_hid_set_link_policy(enum bt_hid_link_policy policy);
+
+// Look for nearby devices and list them, with their names, on stdio. This is
+// how to find out a controller's address. The first HID device found (put
+// the controller in pairing mode first) is paired with and connected, if
+// there's a free slot. Can be called from either core.
+void bt_hid_start_discovery(void);
+
 struct bt_hid_state {
 	/*
 	uint16_t buttons;
@@ -25,5 +80,226 @@ struct bt_hid_state {
 	uint8_t ry;
 };
 
-// Get the latest controller state
-void bt_hid_get_latest(struct bt_hid_state *dst);
+// The sticks, conditioned (see stick.h): radial deadzone and response curve
+// applied, Q15 (-32767 to 32767), 0 in the middle, x right and y up.
+struct bt_hid_sticks {
+	int16_t lx;
+	int16_t ly;
+	int16_t rx;
+	int16_t ry;
+};
+
+struct bt_hid_touch {
+	uint8_t active;
+	uint8_t id;  // Changes with each new touch
+	uint16_t x;  // 0 - 1919
+	uint16_t y;  // 0 - 942
+};
+
+// Units of the gyro and accelerometer, once they're calibrated from the
+// controller's own calibration report. Without one they're raw, which for a
+// DS4 is roughly the same but a bit off in scale and centre.
+#define BT_HID_GYRO_PER_DEG_S 16
+#define BT_HID_ACCEL_PER_G    8192
+
+// Everything else from the DS4's full report (0x11). This is only filled in
+// when valid is set: other controllers, and the DS4 before it switches over
+// to report 0x11, leave the rest of it alone.
+struct bt_hid_ext_state {
+	uint8_t valid;
+	uint8_t counter;     // Increments with every report, 6 bits
+	uint8_t extra;       // Bit 0 is the PS button, bit 1 touchpad click
+	uint8_t l2;          // Analog triggers, 0 - 255
+	uint8_t r2;
+	uint8_t battery;     // 0 - 10, or up to 11 when charging
+	uint8_t cable;       // USB cable plugged in
+	uint8_t temperature;
+	uint16_t timestamp;  // Controller clock, in units of 5.33 us
+	uint8_t calibrated;  // gyro and accel are calibrated, see below
+	int16_t gyro[3];     // Pitch, yaw, roll. BT_HID_GYRO_PER_DEG_S if calibrated
+	int16_t accel[3];    // x, y, z. BT_HID_ACCEL_PER_G if calibrated
+	struct bt_hid_touch touch[2];
+};
+
+// Rumble and lightbar. Only DS4s (and clones) have an output report we know
+// how to build, anything else ignores it.
+struct bt_hid_output {
+	uint8_t rumble_weak;   // Right motor, the small fast one
+	uint8_t rumble_strong; // Left motor
+	uint8_t red;           // Lightbar colour
+	uint8_t green;
+	uint8_t blue;
+	uint8_t flash_on;      // Lightbar flashing, in 10 ms units. Both 0 for
+	uint8_t flash_off;     // steady.
+};
+
+enum bt_hid_report_type {
+	BT_HID_REPORT_INPUT, // A report from the controller
+	BT_HID_REPORT_STALE, // No reports for BT_HID_STALE_TIMEOUT_MS, state is
+	                     // default_state until the next BT_HID_REPORT_INPUT
+};
+
+// A decoded report, as queued up for the app
+struct bt_hid_report {
+	uint32_t time_us; // time_us_32() when the report was decoded
+#if LATENCY_STATS
+	uint32_t rx_us;   // time_us_32() when the transport received it
+#endif
+	uint8_t idx;      // Which controller it came from
+	uint8_t type;     // enum bt_hid_report_type
+	struct bt_hid_state state;
+	struct bt_hid_sticks sticks;
+	struct bt_hid_ext_state ext;
+};
+
+struct bt_hid_ring_stats {
+	uint32_t written;    // Reports queued by the BT core
+	uint32_t read;       // Reports consumed by the app
+	uint32_t dropped;    // Reports discarded because the queue was full
+	uint32_t overrun;    // Reports overwritten before the app read them
+	uint32_t high_water; // Deepest the queue has been
+};
+
+// Neutral state, used whenever there's no controller connected
+extern const struct bt_hid_state default_state;
+
+// Get the latest state of controller idx (0 to BT_HID_MAX_CONTROLLERS - 1),
+// default_state if it's not connected. This never blocks the bluetooth core,
+// so it's fine to call as often as you like, from either core.
+void bt_hid_get_latest(unsigned int idx, struct bt_hid_state *dst);
+
+// The same for the conditioned sticks, all 0 if it's not connected
+void bt_hid_get_latest_sticks(unsigned int idx, struct bt_hid_sticks *dst);
+
+// Wait until a new report has been decoded, from any controller, then get
+// the latest state of controller idx
+void bt_hid_wait_latest(unsigned int idx, struct bt_hid_state *dst);
+
+// As above, but give up after timeout_us. dst is always filled in with the
+// latest state, the return value says whether any controller has sent
+// anything new.
+bool bt_hid_wait_latest_timeout_us(unsigned int idx, struct bt_hid_state *dst, uint32_t timeout_us);
+
+// Get the latest state without waiting, returns true if any controller has
+// sent anything since the last wait/poll.
+bool bt_hid_poll_latest(unsigned int idx, struct bt_hid_state *dst);
+
+// Take up to max queued reports, oldest first, from all the controllers
+// (check report->idx). Unlike bt_hid_get_latest() this sees every report, so
+// short button taps between calls aren't lost.
+// Must only be called from one core.
+unsigned bt_hid_read_reports(struct bt_hid_report *dst, unsigned max);
+
+// Zero-copy alternative to bt_hid_read_reports(): get a pointer to the
+// oldest queued report, in place, or NULL if there aren't any. It stays put
+// until bt_hid_release_report(), so only read what you need from it.
+// Must only be called from the same core as bt_hid_read_reports().
+const struct bt_hid_report *bt_hid_peek_report(void);
+
+// Done with the report from bt_hid_peek_report(). Returns false if it was
+// overwritten while it was being read (only possible with
+// REPORT_RING_OVERWRITE), in which case anything read from it is garbage.
+bool bt_hid_release_report(void);
+
+void bt_hid_get_ring_stats(struct bt_hid_ring_stats *stats);
+
+// Number of times bt_hid_get_latest() raced with an update and had to retry
+uint32_t bt_hid_get_latest_retries(void);
+
+// Change the stale input timeout from BT_HID_STALE_TIMEOUT_MS, 0 turns it
+// off. Can be called from either core.
+void bt_hid_set_stale_timeout_ms(uint32_t timeout_ms);
+
+// Set the output for controller idx. Must only be called from one core,
+// after bt_hid_wait_ready(), but as often as you like: it's sent from the BT
+// core with at most one report in flight per controller, so changes made
+// meanwhile are coalesced into the next one, and nothing is sent if it
+// hasn't changed since the last one the controller acked. It belongs to the
+// slot, so a controller which reconnects gets it too.
+void bt_hid_set_output(unsigned int idx, const struct bt_hid_output *output);
+
+// Connection lifecycle, so the app can react to it, and so the BT core
+// doesn't spend its time printing. idx is the controller, or
+// BT_HID_EVENT_NO_IDX if it didn't get a slot.
+enum bt_hid_event_kind {
+	BT_HID_EVENT_CONNECTING,     // arg: 1 if it connected to us, 0 if we're paging it
+	BT_HID_EVENT_DECLINED,       // Turned away, no free slot
+	BT_HID_EVENT_CONNECTED,      // arg: ms taken to connect
+	BT_HID_EVENT_CONNECT_FAILED, // status: HCI error, arg: ms
+	BT_HID_EVENT_DISCONNECTED,   // status: HCI reason
+	BT_HID_EVENT_PAIRED,         // BLE, status: SM error, arg: 1 if re-encrypted with an existing bond
+	BT_HID_EVENT_DESCRIPTOR,     // status: 0 if we have one, arg: length
+	BT_HID_EVENT_PROTOCOL,       // status: handshake result, arg: hid_protocol_mode_t
+	BT_HID_EVENT_GET_REPORT,     // status: handshake result, arg: length
+	BT_HID_EVENT_FIRST_REPORT,   // arg: ms after starting to connect, status: 1 if
+	                             // the descriptor came from the cache
+	BT_HID_EVENT_INTERVAL,       // BLE connection interval changed, arg: us
+	BT_HID_EVENT_BOOT,           // Startup finished with the first report, arg: ms since reset
+	BT_HID_EVENT_DEVICE_ID,      // arg: vendor ID << 16 | product ID
+	BT_HID_EVENT_PROFILE,        // name: profile now in use, arg: descriptor hash if it was
+	                             // picked from one, status: 1 if the descriptor wasn't usable
+	BT_HID_EVENT_LINK_POLICY,    // name: the new policy
+	BT_HID_EVENT_LINK_MODE,      // status: 0 active, 1 hold, 2 sniff, arg: sniff interval in us
+	BT_HID_EVENT_LINK_IDLE,      // No change in input for a while, sniff allowed
+	BT_HID_EVENT_RECONNECT,      // name: the phase which finished, arg: ms it took
+	BT_HID_EVENT_RECONNECT_WAIT, // arg: ms to wait for controllers to connect to us
+};
+
+#define BT_HID_EVENT_NO_IDX 0xff
+
+struct bt_hid_event {
+	uint32_t time_us;  // time_us_32() when it happened
+	uint32_t arg;      // Depends on kind
+	uint16_t cid;      // hid_host cid, or hids_client cid for BLE
+	uint8_t  kind;     // enum bt_hid_event_kind
+	uint8_t  idx;
+	uint8_t  status;   // 0 for success
+	uint8_t  ble;      // 1 if it's a BLE controller
+	uint8_t  addr[6];  // bd_addr_t, big endian
+	const char *name;  // Depends on kind, a string which is never freed, or NULL
+};
+
+// Take the oldest queued event, returns false if there aren't any. If the
+// app doesn't keep up, the newest events are dropped. Must only be called
+// from one core.
+bool bt_hid_read_event(struct bt_hid_event *dst);
+
+// Number of events dropped because the queue was full
+uint32_t bt_hid_get_events_dropped(void);
+
+// Startup, in order. Each is timestamped the first time it finishes, so
+// PAGE onwards are for whichever controller got there first.
+enum bt_hid_boot_phase {
+	BT_HID_BOOT_CYW43,        // cyw43 driver initialised
+	BT_HID_BOOT_READY,        // BTstack set up, bt_hid_wait_ready() returns
+	BT_HID_BOOT_FIRMWARE,     // BT firmware downloaded, HCI transport open
+	BT_HID_BOOT_HCI,          // HCI up and working
+	BT_HID_BOOT_PAGE,         // Started connecting to a controller, or it to us
+	BT_HID_BOOT_CONNECTED,    // HID channels open
+	BT_HID_BOOT_DESCRIPTOR,   // From SDP, the cache, or GATT
+	BT_HID_BOOT_FIRST_REPORT,
+	BT_HID_BOOT_NUM_PHASES,
+};
+
+// Copy out the startup timestamps, time_us_32() so from reset, 0 for phases
+// which haven't happened (yet). Complete once BT_HID_EVENT_BOOT has been read.
+void bt_hid_get_boot_times(uint32_t times[BT_HID_BOOT_NUM_PHASES]);
+
+// Set to 0 to leave out all the logging strings
+#ifndef BT_HID_EVENT_LOG
+#define BT_HID_EVENT_LOG 1
+#endif
+
+#if BT_HID_EVENT_LOG
+// Print an event to stdio, one line, or the startup breakdown for
+// BT_HID_EVENT_BOOT
+void bt_hid_event_print(const struct bt_hid_event *event);
+
+// Print the startup timestamps, and how long each phase took
+void bt_hid_boot_print(void);
+#else
+static inline void bt_hid_event_print(const struct bt_hid_event *event) { (void)event; }
+static inline void bt_hid_boot_print(void) { }
+#endif
+
+#endif // BT_HID_H
@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+#include "bt_hid.h"
+#include "bt_hid_event.h"
+
+#define EVENT_QUEUE_MASK (BT_HID_EVENT_QUEUE_DEPTH - 1)
+
+// Single producer (BT core), single consumer (app core). head is only
+// written by the producer, tail only by the consumer.
+static struct bt_hid_event events[BT_HID_EVENT_QUEUE_DEPTH];
+static volatile uint32_t events_head;
+static volatile uint32_t events_tail;
+static volatile uint32_t events_dropped;
+
+// Only written by the BT core. The app reads them after BT_HID_EVENT_BOOT,
+// which the queue's fences order after them.
+static uint32_t boot_times[BT_HID_BOOT_NUM_PHASES];
+
+static void event_push(enum bt_hid_event_kind kind, unsigned int idx, uint16_t cid,
+                       uint8_t status, uint32_t arg, const uint8_t *addr, const char *name, bool ble);
+
+static void boot_mark_at(enum bt_hid_boot_phase phase, uint32_t time_us)
+{
+	if (boot_times[phase]) {
+		return;
+	}
+	boot_times[phase] = time_us;
+
+	if (phase == BT_HID_BOOT_FIRST_REPORT) {
+		event_push(BT_HID_EVENT_BOOT, BT_HID_EVENT_NO_IDX, 0, 0, time_us / 1000, NULL, NULL, false);
+	}
+}
+
+void bt_hid_boot_mark(enum bt_hid_boot_phase phase)
+{
+	boot_mark_at(phase, time_us_32());
+}
+
+// The first of each of these finishes a startup phase
+static void boot_mark_event(enum bt_hid_event_kind kind, uint8_t status, uint32_t time_us)
+{
+	if (status) {
+		return;
+	}
+
+	switch (kind) {
+	case BT_HID_EVENT_CONNECTING:
+		boot_mark_at(BT_HID_BOOT_PAGE, time_us);
+		break;
+	case BT_HID_EVENT_CONNECTED:
+		boot_mark_at(BT_HID_BOOT_CONNECTED, time_us);
+		break;
+	case BT_HID_EVENT_DESCRIPTOR:
+		boot_mark_at(BT_HID_BOOT_DESCRIPTOR, time_us);
+		break;
+	case BT_HID_EVENT_FIRST_REPORT:
+		boot_mark_at(BT_HID_BOOT_FIRST_REPORT, time_us);
+		break;
+	default:
+		break;
+	}
+}
+
+static void event_push(enum bt_hid_event_kind kind, unsigned int idx, uint16_t cid,
+                       uint8_t status, uint32_t arg, const uint8_t *addr, const char *name, bool ble)
+{
+	uint32_t now = time_us_32();
+	uint32_t head = events_head;
+
+	if (head - events_tail >= BT_HID_EVENT_QUEUE_DEPTH) {
+		events_dropped = events_dropped + 1;
+		boot_mark_event(kind, status, now);
+		return;
+	}
+
+	struct bt_hid_event *event = &events[head & EVENT_QUEUE_MASK];
+	event->time_us = now;
+	event->arg = arg;
+	event->cid = cid;
+	event->kind = kind;
+	event->idx = idx;
+	event->status = status;
+	event->ble = ble;
+	event->name = name;
+	if (addr) {
+		memcpy(event->addr, addr, sizeof(event->addr));
+	} else {
+		memset(event->addr, 0, sizeof(event->addr));
+	}
+
+	// Contents before the new head
+	__mem_fence_release();
+	events_head = head + 1;
+
+	// After the event itself, so BT_HID_EVENT_BOOT comes after FIRST_REPORT
+	boot_mark_event(kind, status, now);
+}
+
+void bt_hid_event_push(enum bt_hid_event_kind kind, unsigned int idx, uint16_t cid,
+                       uint8_t status, uint32_t arg, const uint8_t *addr)
+{
+	event_push(kind, idx, cid, status, arg, addr, NULL, false);
+}
+
+void bt_hid_event_push_ble(enum bt_hid_event_kind kind, unsigned int idx, uint16_t cid,
+                           uint8_t status, uint32_t arg, const uint8_t *addr)
+{
+	event_push(kind, idx, cid, status, arg, addr, NULL, true);
+}
+
+void bt_hid_event_push_name(enum bt_hid_event_kind kind, unsigned int idx, uint8_t status, uint32_t arg,
+                            const char *name, bool ble)
+{
+	event_push(kind, idx, 0, status, arg, NULL, name, ble);
+}
+
+bool bt_hid_read_event(struct bt_hid_event *dst)
+{
+	uint32_t tail = events_tail;
+
+	if (tail == events_head) {
+		return false;
+	}
+
+	// Head before the contents
+	__mem_fence_acquire();
+	memcpy(dst, &events[tail & EVENT_QUEUE_MASK], sizeof(*dst));
+
+	// Done with the slot before handing it back
+	__mem_fence_release();
+	events_tail = tail + 1;
+
+	return true;
+}
+
+uint32_t bt_hid_get_events_dropped(void)
+{
+	return events_dropped;
+}
+
+void bt_hid_get_boot_times(uint32_t times[BT_HID_BOOT_NUM_PHASES])
+{
+	memcpy(times, boot_times, sizeof(boot_times));
+}
+
+#if BT_HID_EVENT_LOG
+static const char *protocol_name(uint32_t mode)
+{
+	switch (mode) {
+	case 0:
+		return "BOOT";
+	case 1:
+		return "REPORT";
+	default:
+		return "unknown";
+	}
+}
+
+static const char *const boot_phase_names[BT_HID_BOOT_NUM_PHASES] = {
+	[BT_HID_BOOT_CYW43] = "cyw43 init",
+	[BT_HID_BOOT_READY] = "BT core ready",
+	[BT_HID_BOOT_FIRMWARE] = "firmware download",
+	[BT_HID_BOOT_HCI] = "HCI up",
+	[BT_HID_BOOT_PAGE] = "page started",
+	[BT_HID_BOOT_CONNECTED] = "connected",
+	[BT_HID_BOOT_DESCRIPTOR] = "descriptor",
+	[BT_HID_BOOT_FIRST_REPORT] = "first report",
+};
+
+// Each phase from reset, and how long it took after the one before
+void bt_hid_boot_print(void)
+{
+	uint32_t times[BT_HID_BOOT_NUM_PHASES];
+	uint32_t prev = 0;
+
+	bt_hid_get_boot_times(times);
+	for (unsigned int i = 0; i < BT_HID_BOOT_NUM_PHASES; i++) {
+		if (!times[i]) {
+			printf("  %-18s -\n", boot_phase_names[i]);
+			continue;
+		}
+		printf("  %-18s %6" PRIu32 " ms  +%" PRIu32 " ms\n", boot_phase_names[i],
+		       times[i] / 1000, (times[i] - prev) / 1000);
+		prev = times[i];
+	}
+}
+
+void bt_hid_event_print(const struct bt_hid_event *event)
+{
+	// Not bd_addr_to_str(), its buffer belongs to the BT core
+	char addr[18];
+	snprintf(addr, sizeof(addr), "%02X:%02X:%02X:%02X:%02X:%02X",
+	         event->addr[0], event->addr[1], event->addr[2],
+	         event->addr[3], event->addr[4], event->addr[5]);
+
+	if (event->idx == BT_HID_EVENT_NO_IDX) {
+		printf("[-] ");
+	} else {
+		printf("[%u] ", event->idx);
+	}
+
+	switch (event->kind) {
+	case BT_HID_EVENT_CONNECTING:
+		printf("%s %s%s\n", event->arg ? "Accepting connection from" : "Connecting to", addr,
+		       event->ble ? " (BLE)" : "");
+		break;
+	case BT_HID_EVENT_DECLINED:
+		printf("Declining connection from %s, no free slots\n", addr);
+		break;
+	case BT_HID_EVENT_CONNECTED:
+		printf("Connected to %s in %" PRIu32 " ms%s\n", addr, event->arg, event->ble ? " (BLE)" : "");
+		break;
+	case BT_HID_EVENT_CONNECT_FAILED:
+		printf("Connection to %s failed after %" PRIu32 " ms: 0x%02x\n", addr, event->arg, event->status);
+		break;
+	case BT_HID_EVENT_DISCONNECTED:
+		printf("Disconnected from %s, reason 0x%02x\n", addr, event->status);
+		break;
+	case BT_HID_EVENT_PAIRED:
+		if (event->status) {
+			printf("%s failed: 0x%02x\n", event->arg ? "Re-encryption" : "Pairing", event->status);
+		} else {
+			printf("%s\n", event->arg ? "Re-encrypted" : "Paired");
+		}
+		break;
+	case BT_HID_EVENT_DESCRIPTOR:
+		if (event->status) {
+			printf("Couldn't get the HID descriptor: 0x%02x\n", event->status);
+		} else {
+			printf("HID descriptor, %" PRIu32 " bytes\n", event->arg);
+		}
+		break;
+	case BT_HID_EVENT_PROTOCOL:
+		if (event->status) {
+			printf("Protocol handshake error: 0x%02x\n", event->status);
+		} else {
+			printf("Negotiated protocol: %s\n", protocol_name(event->arg));
+		}
+		break;
+	case BT_HID_EVENT_GET_REPORT:
+		printf("GET_REPORT response, status: %u, len: %" PRIu32 "\n", event->status, event->arg);
+		break;
+	case BT_HID_EVENT_FIRST_REPORT:
+		printf("First report %" PRIu32 " ms after connecting, %s\n", event->arg,
+		       event->status ? "descriptor from the cache" : "not cached");
+		break;
+	case BT_HID_EVENT_INTERVAL:
+		printf("Connection interval %" PRIu32 ".%02" PRIu32 " ms\n", event->arg / 1000, event->arg % 1000 / 10);
+		break;
+	case BT_HID_EVENT_BOOT:
+		printf("First input %" PRIu32 " ms after reset\n", event->arg);
+		bt_hid_boot_print();
+		break;
+	case BT_HID_EVENT_DEVICE_ID:
+		printf("Device ID: %04" PRIx32 ":%04" PRIx32 "\n", event->arg >> 16, event->arg & 0xffff);
+		break;
+	case BT_HID_EVENT_PROFILE:
+		if (event->status) {
+			printf("No usable input report in descriptor, using %s\n", event->name);
+		} else if (event->arg) {
+			printf("Using profile: %s, descriptor hash 0x%08" PRIx32 "\n", event->name, event->arg);
+		} else {
+			printf("Using profile: %s\n", event->name);
+		}
+		break;
+	case BT_HID_EVENT_LINK_POLICY:
+		printf("Link policy: %s\n", event->name);
+		break;
+	case BT_HID_EVENT_LINK_MODE:
+		if (event->status == 2) {
+			printf("Link mode: sniff, %" PRIu32 " us\n", event->arg);
+		} else {
+			printf("Link mode: %s\n", event->status ? "hold" : "active");
+		}
+		break;
+	case BT_HID_EVENT_LINK_IDLE:
+		printf("Idle, allowing sniff\n");
+		break;
+	case BT_HID_EVENT_RECONNECT:
+		printf("Reconnect: %s took %" PRIu32 " ms\n", event->name, event->arg);
+		break;
+	case BT_HID_EVENT_RECONNECT_WAIT:
+		printf("Reconnect: waiting %" PRIu32 " ms for controllers to connect\n", event->arg);
+		break;
+	default:
+		printf("Unknown event %u\n", event->kind);
+		break;
+	}
+}
+#endif
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef BT_HID_EVENT_H
+#define BT_HID_EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bt_hid.h"
+
+// Queue of struct bt_hid_event for the app, like the report ring but much
+// quieter. Must be a power of two.
+#ifndef BT_HID_EVENT_QUEUE_DEPTH
+#define BT_HID_EVENT_QUEUE_DEPTH 32
+#endif
+
+#if (BT_HID_EVENT_QUEUE_DEPTH & (BT_HID_EVENT_QUEUE_DEPTH - 1)) != 0
+#error "BT_HID_EVENT_QUEUE_DEPTH must be a power of two"
+#endif
+
+// Queue an event, BT core only. addr can be NULL.
+void bt_hid_event_push(enum bt_hid_event_kind kind, unsigned int idx, uint16_t cid,
+                       uint8_t status, uint32_t arg, const uint8_t *addr);
+
+// The same, for a BLE controller
+void bt_hid_event_push_ble(enum bt_hid_event_kind kind, unsigned int idx, uint16_t cid,
+                           uint8_t status, uint32_t arg, const uint8_t *addr);
+
+// Queue an event which carries a name instead of a cid and address. name
+// must never be freed: a literal, or a profile's name.
+void bt_hid_event_push_name(enum bt_hid_event_kind kind, unsigned int idx, uint8_t status, uint32_t arg,
+                            const char *name, bool ble);
+
+// For the rarer things which don't need an event of their own (discovery,
+// the descriptor cache), printed straight from the BT core. Left out along
+// with the rest of the logging.
+#if BT_HID_EVENT_LOG
+#define BT_HID_LOG(...) printf(__VA_ARGS__)
+#else
+#define BT_HID_LOG(...) do { } while (0)
+#endif
+
+// Timestamp a startup phase, if it hasn't already been. The connection
+// phases are marked by the events above.
+void bt_hid_boot_mark(enum bt_hid_boot_phase phase);
+
+#endif // BT_HID_EVENT_H
@@ -0,0 +1,393 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/sem.h"
+#include "hardware/sync.h"
+
+#include "bt_hid.h"
+#include "bt_hid_report.h"
+#include "hid_decoder.h"
+#include "hid_profile.h"
+#include "latency.h"
+#include "report_ring.h"
+#include "stick.h"
+
+// The descriptor describes the report protocol. We only ever get one in
+// report mode, or from the cache when we connected in boot mode to skip SDP.
+// The table itself is compiled into each controller's slot.
+static const struct hid_profile descriptor_profile = {
+	.name = "from descriptor",
+	.protocol_mode = HID_PROTOCOL_MODE_REPORT,
+	.decoder = NULL,
+	.decode = hid_profile_decode_table,
+	.decode_ext = hid_profile_decode_ext_none,
+	.encode_output = hid_profile_encode_output_none,
+	.parse_calibration = hid_profile_parse_calibration_none,
+};
+
+// Everything about one controller. The profile is picked once per
+// connection: the default until we know better, then (best first) a Device
+// ID match, a descriptor hash match, or a decoder compiled from the
+// descriptor. decoder/decode/decode_ext are copies of the profile's, to save
+// a load on every report.
+struct bt_hid_slot {
+	const struct hid_profile *profile;
+	const struct hid_decoder *decoder;
+	hid_profile_decode_t decode;
+	hid_profile_decode_ext_t decode_ext;
+	bool profile_from_device_id;
+
+	// Applied to the extended state, when there is one
+	struct hid_imu_calibration calibration;
+	bool calibrated;
+
+	// Compiled from the HID descriptor, for controllers which don't have a
+	// profile of their own.
+	struct hid_decoder compiled;
+
+	// latest is written only by the BT core, and read from anywhere without
+	// taking the async_context lock. latest_seq is odd while a write is in
+	// progress, and readers retry if it changed underneath them.
+	struct bt_hid_state latest;
+	struct bt_hid_sticks latest_sticks;
+	volatile uint32_t latest_seq;
+
+	// Stale input watchdog. Armed by the first report after a reset, stale
+	// from the timeout until the next report.
+	uint32_t last_report_us;
+	bool armed;
+	bool stale;
+};
+
+static struct bt_hid_slot slots[BT_HID_MAX_CONTROLLERS];
+
+const struct bt_hid_state default_state = {
+	.buttons = 0,
+	.triggers = 0,
+	.lx = 0x80,
+	.ly = 0x80,
+	.rx = 0x80,
+	.ry = 0x80,
+	//.l2 = 0x80,
+	//.r2 = 0x80,
+	//.hat = 0x8,
+};
+
+static volatile uint32_t latest_retries;
+static volatile uint32_t stale_timeout_us = BT_HID_STALE_TIMEOUT_MS * 1000;
+
+// Doorbell for core 0, rung whenever any controller's latest changes. It only
+// holds a single permit, so a burst of reports while the app is busy wakes it
+// just once.
+static semaphore_t latest_sem;
+
+// Every decoded report from every controller, for the app to drain at its
+// own pace. One ring rather than one per controller keeps the reports in the
+// order they arrived in, and leaves a single queue for the app to check.
+static struct report_ring report_ring;
+
+// Centred, for no controller or a stale one
+static const struct bt_hid_sticks default_sticks = { 0 };
+
+static void bt_hid_set_latest(struct bt_hid_slot *slot, const struct bt_hid_state *state,
+                              const struct bt_hid_sticks *sticks)
+{
+	slot->latest_seq = slot->latest_seq + 1;
+	__mem_fence_release();
+	memcpy(&slot->latest, state, sizeof(slot->latest));
+	memcpy(&slot->latest_sticks, sticks, sizeof(slot->latest_sticks));
+	__mem_fence_release();
+	slot->latest_seq = slot->latest_seq + 1;
+
+	sem_release(&latest_sem);
+}
+
+bool hid_host_handle_interrupt_report(unsigned int idx, const uint8_t *packet, uint16_t packet_len){
+	//printf_hexdump(packet, packet_len);
+	/*
+	1-2 bytes don't change, I beleive are used for the report type.
+	3rd byte is left joystick, side to side
+		default value is 0x80
+	4th byte is left joystick, up and down
+		default value is 0x80
+	5th byte is right joystick, side to side
+		default value is 0x80
+	6th byte is right joystick, up and down
+		default value is 0x80
+	7th byte is the 4 face buttons and dpad. and also the left underneath buttons.
+	   default value is 0x08
+	8th byte is the triggers and bumper buttons. also, the left trigger also affects the 10th byte. but not the 9th... 
+	It's also the select and start buttons.
+	*/
+
+	/*
+	//apparently way too small, it wants a size of at least 37 but this is 10.
+	// Only interested in report_id 0x11
+	if (packet_len < sizeof(struct input_report_17) + 1) {
+		printf("Packet too small: %d\n", packet_len);
+		printf("Expected at least %zu\n", sizeof(struct input_report_17) + 1);
+		return;
+	}
+	*/
+
+	/*
+	//I don't understand this one- sas packet[0] is a1 and packet1] is 01. I guess packet 2 needs to be 11 instead of 01 for some reason?
+	if ((packet[0] != 0xa1) || (packet[1] != 0x11)) {
+		printf("Invalid packet: %02x %02x\n", packet[0], packet[1]);
+		return;
+	}
+	*/
+
+	// packet[0] is the HIDP header (0xa1), the report itself starts after it
+	if (packet_len < 1) {
+		return false;
+	}
+
+	return bt_hid_report_input(idx, &packet[1], packet_len - 1);
+}
+
+bool bt_hid_report_input(unsigned int idx, const uint8_t *report_data, uint16_t report_len)
+{
+	struct bt_hid_slot *slot = &slots[idx];
+	struct bt_hid_report report = {
+		.time_us = time_us_32(),
+		.idx = idx,
+	};
+	bool changed = false;
+	if (slot->decode(slot->decoder, report_data, report_len, &report.state)) {
+		// Only this core writes latest, so no need for the seqlock here
+		changed = memcmp(&report.state, &slot->latest, sizeof(report.state)) != 0;
+		slot->last_report_us = report.time_us;
+		slot->armed = true;
+		slot->stale = false;
+		stick_condition_state(&report.state, &report.sticks);
+		slot->decode_ext(report_data, report_len, &report.ext);
+		if (slot->calibrated && report.ext.valid) {
+			hid_profile_apply_calibration(&slot->calibration, &report.ext);
+		}
+		latency_mark_at(LATENCY_DECODE, report.time_us);
+#if LATENCY_STATS
+		report.rx_us = latency_rx_time();
+#endif
+		report_ring_write(&report_ring, &report);
+		bt_hid_set_latest(slot, &report.state, &report.sticks);
+	}
+
+	return changed;
+}
+
+uint32_t bt_hid_report_check_stale(void)
+{
+	uint32_t timeout_us = stale_timeout_us;
+	uint32_t now = time_us_32();
+	uint32_t mask = 0;
+
+	if (!timeout_us) {
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		struct bt_hid_slot *slot = &slots[i];
+		if (!slot->armed || slot->stale || (now - slot->last_report_us < timeout_us)) {
+			continue;
+		}
+
+		// Quiet is normal for these, a held button is still held
+		if (slot->profile->reports_on_change) {
+			continue;
+		}
+
+		// Tell the app, in order with the reports, then stop it acting on
+		// the old state
+		struct bt_hid_report report = {
+			.time_us = now,
+			.idx = i,
+			.type = BT_HID_REPORT_STALE,
+			.state = default_state,
+			.sticks = default_sticks,
+		};
+		report_ring_write(&report_ring, &report);
+		bt_hid_set_latest(slot, &default_state, &default_sticks);
+
+		slot->stale = true;
+		mask |= 1u << i;
+	}
+
+	return mask;
+}
+
+void bt_hid_set_stale_timeout_ms(uint32_t timeout_ms)
+{
+	stale_timeout_us = timeout_ms * 1000;
+}
+
+// Copy len bytes of slot's latest, from src, under the seqlock
+static void bt_hid_read_latest(const struct bt_hid_slot *slot, void *dst, const void *src, size_t len)
+{
+	for ( ;; ) {
+		uint32_t seq = slot->latest_seq;
+		__mem_fence_acquire();
+
+		if (!(seq & 1)) {
+			memcpy(dst, src, len);
+			__mem_fence_acquire();
+			if (slot->latest_seq == seq) {
+				return;
+			}
+		}
+
+		latest_retries = latest_retries + 1;
+		tight_loop_contents();
+	}
+}
+
+void bt_hid_get_latest(unsigned int idx, struct bt_hid_state *dst)
+{
+	bt_hid_read_latest(&slots[idx], dst, &slots[idx].latest, sizeof(*dst));
+}
+
+void bt_hid_get_latest_sticks(unsigned int idx, struct bt_hid_sticks *dst)
+{
+	bt_hid_read_latest(&slots[idx], dst, &slots[idx].latest_sticks, sizeof(*dst));
+}
+
+void bt_hid_wait_latest(unsigned int idx, struct bt_hid_state *dst)
+{
+	sem_acquire_blocking(&latest_sem);
+	bt_hid_get_latest(idx, dst);
+}
+
+bool bt_hid_wait_latest_timeout_us(unsigned int idx, struct bt_hid_state *dst, uint32_t timeout_us)
+{
+	bool updated = sem_acquire_timeout_us(&latest_sem, timeout_us);
+	bt_hid_get_latest(idx, dst);
+	return updated;
+}
+
+bool bt_hid_poll_latest(unsigned int idx, struct bt_hid_state *dst)
+{
+	bool updated = sem_try_acquire(&latest_sem);
+	bt_hid_get_latest(idx, dst);
+	return updated;
+}
+
+unsigned bt_hid_read_reports(struct bt_hid_report *dst, unsigned max)
+{
+	return report_ring_read(&report_ring, dst, max);
+}
+
+const struct bt_hid_report *bt_hid_peek_report(void)
+{
+	return report_ring_peek(&report_ring);
+}
+
+bool bt_hid_release_report(void)
+{
+	return report_ring_release(&report_ring);
+}
+
+void bt_hid_get_ring_stats(struct bt_hid_ring_stats *stats)
+{
+	report_ring_get_stats(&report_ring, stats);
+}
+
+uint32_t bt_hid_get_latest_retries(void)
+{
+	return latest_retries;
+}
+
+static void bt_hid_report_set_profile(struct bt_hid_slot *slot, const struct hid_profile *profile)
+{
+	slot->profile = profile;
+	slot->decoder = profile->decoder ? profile->decoder : &slot->compiled;
+	slot->decode = profile->decode;
+	slot->decode_ext = profile->decode_ext;
+}
+
+void bt_hid_report_init(void)
+{
+	sem_init(&latest_sem, 0, 1);
+	report_ring_init(&report_ring);
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		bt_hid_report_reset(i);
+	}
+}
+
+void bt_hid_report_reset(unsigned int idx)
+{
+	struct bt_hid_slot *slot = &slots[idx];
+
+	slot->profile_from_device_id = false;
+	slot->calibrated = false;
+	slot->armed = false;
+	slot->stale = false;
+	bt_hid_report_set_profile(slot, &hid_profile_default);
+
+	bt_hid_set_latest(slot, &default_state, &default_sticks);
+}
+
+const struct hid_profile *bt_hid_report_set_device_id(unsigned int idx, uint16_t vendor_id, uint16_t product_id)
+{
+	struct bt_hid_slot *slot = &slots[idx];
+
+	const struct hid_profile *profile = hid_profile_find_device_id(vendor_id, product_id);
+	if (!profile) {
+		return NULL;
+	}
+
+	slot->profile_from_device_id = true;
+	bt_hid_report_set_profile(slot, profile);
+	return profile;
+}
+
+const struct hid_profile *bt_hid_report_set_descriptor(unsigned int idx, const uint8_t *descriptor, uint16_t descriptor_len)
+{
+	struct bt_hid_slot *slot = &slots[idx];
+
+	// The Device ID is the better match, so don't override it
+	if (slot->profile_from_device_id) {
+		return slot->profile;
+	}
+
+	const struct hid_profile *profile = hid_profile_find_descriptor(hid_profile_hash(descriptor, descriptor_len));
+	if (!profile) {
+		if (!hid_decoder_compile(&slot->compiled, descriptor, descriptor_len)) {
+			return NULL;
+		}
+		profile = &descriptor_profile;
+	}
+
+	bt_hid_report_set_profile(slot, profile);
+	return profile;
+}
+
+bool bt_hid_report_parse_calibration(unsigned int idx, const uint8_t *report, uint16_t report_len,
+                                     struct hid_imu_calibration *dst)
+{
+	return slots[idx].profile->parse_calibration(report, report_len, dst);
+}
+
+void bt_hid_report_set_calibration(unsigned int idx, const struct hid_imu_calibration *calibration)
+{
+	struct bt_hid_slot *slot = &slots[idx];
+
+	slot->calibrated = calibration != NULL;
+	if (calibration) {
+		slot->calibration = *calibration;
+	}
+}
+
+const struct hid_profile *bt_hid_report_get_profile(unsigned int idx)
+{
+	return slots[idx].profile;
+}
+
+const struct hid_decoder *bt_hid_report_get_decoder(unsigned int idx)
+{
+	return slots[idx].decoder;
+}
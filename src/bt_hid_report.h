@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef BT_HID_REPORT_H
+#define BT_HID_REPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hid_profile.h"
+
+// The report-handling half of bt_hid: decoding, and handing reports over to
+// the app. It doesn't touch BTstack or cyw43, so it can be built on the host
+// too. Everything here runs on the BT core. Each controller has its own
+// decoding state, selected by idx (0 to BT_HID_MAX_CONTROLLERS - 1).
+
+// Call once, before any reports arrive
+void bt_hid_report_init(void);
+
+// Go back to the neutral state, and the default profile
+void bt_hid_report_reset(unsigned int idx);
+
+// Pick the profile matching the controller's SDP Device ID, and use it for
+// all following reports. Returns NULL, leaving the profile alone, if there
+// isn't one.
+const struct hid_profile *bt_hid_report_set_device_id(unsigned int idx, uint16_t vendor_id, uint16_t product_id);
+
+// Pick a profile from the HID descriptor: one with a matching descriptor
+// hash, or failing that a decoder compiled from the descriptor. Does nothing
+// if the profile already came from the Device ID. Returns the profile in
+// use, or NULL, leaving the profile alone, if the descriptor isn't usable.
+const struct hid_profile *bt_hid_report_set_descriptor(unsigned int idx, const uint8_t *descriptor, uint16_t descriptor_len);
+
+// Parse a calibration feature report (starting with the report ID) with the
+// current profile. Returns false if the profile doesn't have one, or it's
+// no good.
+bool bt_hid_report_parse_calibration(unsigned int idx, const uint8_t *report, uint16_t report_len,
+                                     struct hid_imu_calibration *dst);
+
+// Calibrate the gyro and accel of the following reports, or NULL to leave
+// them raw. bt_hid_report_reset() goes back to raw.
+void bt_hid_report_set_calibration(unsigned int idx, const struct hid_imu_calibration *calibration);
+
+// The profile currently decoding reports, and the table it's using (which
+// for profiles compiled from the descriptor isn't profile->decoder)
+const struct hid_profile *bt_hid_report_get_profile(unsigned int idx);
+const struct hid_decoder *bt_hid_report_get_decoder(unsigned int idx);
+
+// Check for controllers which have gone quiet for longer than the stale
+// timeout, and switch them to default_state. Call regularly. Returns a mask
+// of the controllers which have just gone stale.
+uint32_t bt_hid_report_check_stale(void);
+
+// Handle one report from controller idx's interrupt channel, starting with
+// the HIDP header byte. Returns true if the controller's state changed.
+bool hid_host_handle_interrupt_report(unsigned int idx, const uint8_t *packet, uint16_t packet_len);
+
+// The same, for a report without any transport header: it starts with the
+// report ID, if the descriptor uses them. This is how they come from BLE.
+bool bt_hid_report_input(unsigned int idx, const uint8_t *report_data, uint16_t report_len);
+
+#endif // BT_HID_REPORT_H
@@ -0,0 +1,535 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stdint.h>
+
+#include "pico/stdlib.h"
+
+#include "btstack_config.h"
+#include "btstack.h"
+
+#include "bt_hid.h"
+#include "bt_hid_event.h"
+#include "bt_hid_report.h"
+#include "bt_hog.h"
+#include "hid_profile.h"
+#include "latency.h"
+
+#define HOG_DESCRIPTOR_SIZE 512
+
+// Passive scan interval/window, in 0.625 ms units. Like page scan in
+// bt_hid.c: scan hard with nothing connected, and only a little once
+// something is, because the radio can't listen to it while it's scanning.
+#define LE_SCAN_FAST_INTERVAL 0x0060 // 60 ms
+#define LE_SCAN_SLOW_INTERVAL 0x0800 // 1.28 s
+#define LE_SCAN_WINDOW        0x0030 // 30 ms
+
+// How long to wait for a controller we saw advertising to connect
+#define LE_CONNECT_TIMEOUT_MS 5000
+
+// 10 ms units
+#define LE_SUPERVISION_TIMEOUT 200
+
+// GAP Appearance values (HID category) for the same kinds of controller as
+// hid_registry_is_gamepad() picks out of a Class of Device
+#define APPEARANCE_JOYSTICK 0x03c3
+#define APPEARANCE_GAMEPAD  0x03c4
+
+// Connection intervals to ask for, in 1.25 ms units, shortest first. We
+// connect asking for the shortest, but the controller can ask for longer,
+// or turn down an update. Each time it turns one down, try the next, until
+// we get to what it's already using.
+static const uint16_t interval_ladder[] = {
+	6,  // 7.5 ms, the minimum allowed
+	8,  // 10 ms
+	12, // 15 ms
+	16, // 20 ms
+	24, // 30 ms
+};
+
+// One BLE controller, in the slot with the same index
+struct bt_hog_conn {
+	hci_con_handle_t con_handle; // HCI_CON_HANDLE_INVALID if not connected
+	uint16_t hids_cid;
+	bd_addr_t addr;
+
+	uint32_t connect_start_us;
+	bool first_report_pending;
+
+	uint16_t interval;      // 1.25 ms units
+	uint8_t interval_step;  // Next entry in interval_ladder to try
+};
+
+static struct bt_hog_conn hog_conns[BT_HID_MAX_CONTROLLERS];
+
+static enum {
+	HOG_IDLE,
+	HOG_SCAN,
+	HOG_CONNECT,
+} hog_state;
+static bool scan_fast;
+
+static bd_addr_t connect_addr;
+static uint32_t connect_start_us;
+static btstack_timer_source_t connect_timer;
+
+static uint8_t hog_descriptor_storage[HOG_DESCRIPTOR_SIZE * BT_HID_MAX_CONTROLLERS];
+
+static btstack_packet_callback_registration_t hci_event_callback_registration;
+static btstack_packet_callback_registration_t sm_event_callback_registration;
+
+static inline unsigned int bt_hog_conn_idx(const struct bt_hog_conn *conn)
+{
+	return conn - hog_conns;
+}
+
+static struct bt_hog_conn *bt_hog_conn_find_handle(hci_con_handle_t con_handle)
+{
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		if (hog_conns[i].con_handle == con_handle) {
+			return &hog_conns[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct bt_hog_conn *bt_hog_conn_find_cid(uint16_t hids_cid)
+{
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		if ((hog_conns[i].con_handle != HCI_CON_HANDLE_INVALID) && (hog_conns[i].hids_cid == hids_cid)) {
+			return &hog_conns[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct bt_hog_conn *bt_hog_conn_find_addr(bd_addr_t addr)
+{
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		if ((hog_conns[i].con_handle != HCI_CON_HANDLE_INVALID) && !bd_addr_cmp(hog_conns[i].addr, addr)) {
+			return &hog_conns[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool bt_hog_is_bonded(bd_addr_t addr, bd_addr_type_t addr_type)
+{
+	for (int i = 0; i < le_device_db_max_count(); i++) {
+		int db_type = BD_ADDR_TYPE_UNKNOWN;
+		bd_addr_t db_addr;
+		sm_key_t irk;
+
+		le_device_db_info(i, &db_type, db_addr, irk);
+		if ((db_type == addr_type) && !bd_addr_cmp(db_addr, addr)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Whether an advertisement is from a controller we want to connect to:
+// directed at us, from one we've bonded with, or a gamepad or joystick in
+// pairing (discoverable) mode. Keyboards, mice and remotes advertise HID
+// too, so it has to say what it is with its Appearance.
+static bool bt_hog_wanted(const uint8_t *packet, bd_addr_t addr, bd_addr_type_t addr_type)
+{
+	uint8_t type = gap_event_advertising_report_get_advertising_event_type(packet);
+	if (type == 1) {
+		// ADV_DIRECT_IND, only sent to a central it's bonded with
+		return true;
+	} else if (type != 0) {
+		// Only ADV_IND is connectable
+		return false;
+	}
+
+	if (bt_hog_is_bonded(addr, addr_type)) {
+		return true;
+	}
+
+	uint8_t ad_len = gap_event_advertising_report_get_data_length(packet);
+	const uint8_t *ad_data = gap_event_advertising_report_get_data(packet);
+	if (!ad_data_contains_uuid16(ad_len, ad_data, ORG_BLUETOOTH_SERVICE_HUMAN_INTERFACE_DEVICE)) {
+		return false;
+	}
+
+	bool discoverable = false, gamepad = false;
+	ad_context_t context;
+	for (ad_iterator_init(&context, ad_len, ad_data); ad_iterator_has_more(&context); ad_iterator_next(&context)) {
+		uint8_t data_type = ad_iterator_get_data_type(&context);
+		uint8_t data_len = ad_iterator_get_data_len(&context);
+		const uint8_t *data = ad_iterator_get_data(&context);
+
+		if ((data_type == BLUETOOTH_DATA_TYPE_FLAGS) && (data_len >= 1)) {
+			// LE Limited or General Discoverable
+			discoverable = data[0] & 0x3;
+		} else if ((data_type == BLUETOOTH_DATA_TYPE_APPEARANCE) && (data_len >= 2)) {
+			uint16_t appearance = little_endian_read_16(data, 0);
+			gamepad = (appearance == APPEARANCE_GAMEPAD) || (appearance == APPEARANCE_JOYSTICK);
+		}
+	}
+
+	return discoverable && gamepad;
+}
+
+void bt_hog_update_scan(void)
+{
+	// Picks up again once the connection is done, one way or the other
+	if (hog_state == HOG_CONNECT) {
+		return;
+	}
+
+	if (!bt_hid_slots_free()) {
+		if (hog_state == HOG_SCAN) {
+			gap_stop_scan();
+			hog_state = HOG_IDLE;
+		}
+		return;
+	}
+
+	bool fast = !bt_hid_slots_used();
+	if ((hog_state == HOG_SCAN) && (fast == scan_fast)) {
+		return;
+	}
+
+	if (hog_state == HOG_SCAN) {
+		gap_stop_scan();
+	}
+
+	scan_fast = fast;
+	gap_set_scan_parameters(0, fast ? LE_SCAN_FAST_INTERVAL : LE_SCAN_SLOW_INTERVAL, LE_SCAN_WINDOW);
+	gap_start_scan();
+	hog_state = HOG_SCAN;
+}
+
+static void connect_timeout_handler(btstack_timer_source_t *ts)
+{
+	UNUSED(ts);
+
+	bt_hid_event_push_ble(BT_HID_EVENT_CONNECT_FAILED, BT_HID_EVENT_NO_IDX, 0, ERROR_CODE_CONNECTION_TIMEOUT,
+	                      (time_us_32() - connect_start_us) / 1000, connect_addr);
+	gap_connect_cancel();
+	hog_state = HOG_IDLE;
+	bt_hog_update_scan();
+}
+
+static void bt_hog_connect(bd_addr_t addr, bd_addr_type_t addr_type)
+{
+	bt_hid_event_push_ble(BT_HID_EVENT_CONNECTING, BT_HID_EVENT_NO_IDX, 0, 0, 0, addr);
+
+	gap_stop_scan();
+	hog_state = HOG_CONNECT;
+	bd_addr_copy(connect_addr, addr);
+	connect_start_us = time_us_32();
+
+	btstack_run_loop_set_timer_handler(&connect_timer, &connect_timeout_handler);
+	btstack_run_loop_set_timer(&connect_timer, LE_CONNECT_TIMEOUT_MS);
+	btstack_run_loop_add_timer(&connect_timer);
+
+	gap_connect(addr, addr_type);
+}
+
+// Ask for the next shorter interval, if there is one
+static void bt_hog_update_interval(struct bt_hog_conn *conn)
+{
+	if (conn->interval_step >= count_of(interval_ladder)) {
+		return;
+	}
+
+	uint16_t interval = interval_ladder[conn->interval_step++];
+	if (interval >= conn->interval) {
+		conn->interval_step = count_of(interval_ladder);
+		return;
+	}
+
+	gap_update_connection_parameters(conn->con_handle, interval, interval, 0, LE_SUPERVISION_TIMEOUT);
+}
+
+static void bt_hog_connected(const uint8_t *packet)
+{
+	hci_con_handle_t con_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
+	uint8_t status = hci_subevent_le_connection_complete_get_status(packet);
+	bd_addr_t addr;
+
+	// Only ours, i.e. not after gap_connect_cancel()
+	if (hog_state != HOG_CONNECT) {
+		return;
+	}
+	btstack_run_loop_remove_timer(&connect_timer);
+	hog_state = HOG_IDLE;
+
+	hci_subevent_le_connection_complete_get_peer_address(packet, addr);
+	if (status != ERROR_CODE_SUCCESS) {
+		bt_hid_event_push_ble(BT_HID_EVENT_CONNECT_FAILED, BT_HID_EVENT_NO_IDX, 0, status,
+		                      (time_us_32() - connect_start_us) / 1000, addr);
+		bt_hog_update_scan();
+		return;
+	}
+
+	int idx = bt_hid_slot_claim();
+	if (idx < 0) {
+		bt_hid_event_push_ble(BT_HID_EVENT_DECLINED, BT_HID_EVENT_NO_IDX, 0, 0, 0, addr);
+		gap_disconnect(con_handle);
+		bt_hog_update_scan();
+		return;
+	}
+
+	struct bt_hog_conn *conn = &hog_conns[idx];
+	conn->con_handle = con_handle;
+	conn->hids_cid = 0;
+	bd_addr_copy(conn->addr, addr);
+	conn->connect_start_us = connect_start_us;
+	conn->first_report_pending = false;
+	conn->interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
+	conn->interval_step = 0;
+
+	bt_hid_event_push_ble(BT_HID_EVENT_CONNECTED, idx, 0, 0, (time_us_32() - conn->connect_start_us) / 1000, addr);
+	bt_hid_event_push_ble(BT_HID_EVENT_INTERVAL, idx, 0, 0, conn->interval * 1250, addr);
+
+	// Pairs if it's new, or just turns on encryption if it's bonded.
+	// Either way, the HID service comes after.
+	sm_request_pairing(con_handle);
+
+	bt_hog_update_scan();
+}
+
+static void bt_hog_disconnected(hci_con_handle_t con_handle, uint8_t reason)
+{
+	struct bt_hog_conn *conn = bt_hog_conn_find_handle(con_handle);
+	if (!conn) {
+		return;
+	}
+
+	bt_hid_event_push_ble(BT_HID_EVENT_DISCONNECTED, bt_hog_conn_idx(conn), conn->hids_cid, reason, 0, conn->addr);
+	conn->con_handle = HCI_CON_HANDLE_INVALID;
+	conn->hids_cid = 0;
+
+	// This updates the scan too
+	bt_hid_slot_release(bt_hog_conn_idx(conn));
+}
+
+static void bt_hog_interval_changed(const uint8_t *packet)
+{
+	struct bt_hog_conn *conn = bt_hog_conn_find_handle(hci_subevent_le_connection_update_complete_get_connection_handle(packet));
+	if (!conn) {
+		return;
+	}
+
+	if (hci_subevent_le_connection_update_complete_get_status(packet) != ERROR_CODE_SUCCESS) {
+		// Turned down, so try a bit longer
+		bt_hog_update_interval(conn);
+		return;
+	}
+
+	conn->interval = hci_subevent_le_connection_update_complete_get_conn_interval(packet);
+	bt_hid_event_push_ble(BT_HID_EVENT_INTERVAL, bt_hog_conn_idx(conn), conn->hids_cid, 0,
+	                      conn->interval * 1250, conn->addr);
+}
+
+static void hids_client_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
+{
+	UNUSED(packet_type);
+	UNUSED(channel);
+	UNUSED(size);
+
+	struct bt_hog_conn *conn;
+	uint8_t status;
+
+	if (hci_event_packet_get_type(packet) != HCI_EVENT_GATTSERVICE_META) {
+		return;
+	}
+
+	switch (hci_event_gattservice_meta_get_subevent_code(packet)) {
+	case GATTSERVICE_SUBEVENT_HID_SERVICE_CONNECTED:
+		conn = bt_hog_conn_find_cid(gattservice_subevent_hid_service_connected_get_hids_cid(packet));
+		if (!conn) {
+			break;
+		}
+
+		status = gattservice_subevent_hid_service_connected_get_status(packet);
+		if (status != ERROR_CODE_SUCCESS) {
+			bt_hid_event_push_ble(BT_HID_EVENT_DESCRIPTOR, bt_hog_conn_idx(conn), conn->hids_cid, status, 0, conn->addr);
+			gap_disconnect(conn->con_handle);
+			break;
+		}
+
+		// Only the first HID service, controllers don't have more
+		{
+			const uint8_t *desc = hids_client_descriptor_storage_get_descriptor_data(conn->hids_cid, 0);
+			uint16_t dlen = hids_client_descriptor_storage_get_descriptor_len(conn->hids_cid, 0);
+			bt_hid_event_push_ble(BT_HID_EVENT_DESCRIPTOR, bt_hog_conn_idx(conn), conn->hids_cid, 0, dlen, conn->addr);
+
+			unsigned int idx = bt_hog_conn_idx(conn);
+			const struct hid_profile *profile = bt_hid_report_set_descriptor(idx, desc, dlen);
+			if (profile) {
+				bt_hid_event_push_name(BT_HID_EVENT_PROFILE, idx, 0, hid_profile_hash(desc, dlen), profile->name, true);
+			} else {
+				bt_hid_event_push_name(BT_HID_EVENT_PROFILE, idx, 1, 0, bt_hid_report_get_profile(idx)->name, true);
+			}
+		}
+
+		conn->first_report_pending = true;
+		bt_hog_update_interval(conn);
+		break;
+	case GATTSERVICE_SUBEVENT_HID_REPORT:
+		{
+			uint32_t now = latency_mark(LATENCY_DISPATCH);
+			conn = bt_hog_conn_find_cid(gattservice_subevent_hid_report_get_hids_cid(packet));
+			if (!conn) {
+				break;
+			}
+
+			unsigned int idx = bt_hog_conn_idx(conn);
+			latency_report_interval(idx, LATENCY_LINK_ACTIVE, now);
+			if (conn->first_report_pending) {
+				conn->first_report_pending = false;
+				bt_hid_event_push_ble(BT_HID_EVENT_FIRST_REPORT, idx, conn->hids_cid, 0,
+				                      (time_us_32() - conn->connect_start_us) / 1000, conn->addr);
+			}
+
+			// hids_client always puts the report ID in front, even if the
+			// descriptor doesn't use them
+			const uint8_t *report = gattservice_subevent_hid_report_get_report(packet);
+			uint16_t report_len = gattservice_subevent_hid_report_get_report_len(packet);
+			if (!gattservice_subevent_hid_report_get_report_id(packet)) {
+				report++;
+				report_len--;
+			}
+
+			bt_hid_report_input(idx, report, report_len);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+// Pairing or re-encryption has finished, on to the HID service
+static void bt_hog_paired(hci_con_handle_t con_handle, uint8_t status, bool reencrypted)
+{
+	struct bt_hog_conn *conn = bt_hog_conn_find_handle(con_handle);
+	if (!conn) {
+		return;
+	}
+
+	bt_hid_event_push_ble(BT_HID_EVENT_PAIRED, bt_hog_conn_idx(conn), 0, status, reencrypted, conn->addr);
+	if (status != ERROR_CODE_SUCCESS) {
+		gap_disconnect(con_handle);
+		return;
+	}
+
+	// Report mode, so that we get the full reports, as notifications
+	status = hids_client_connect(con_handle, &hids_client_handler, HID_PROTOCOL_MODE_REPORT, &conn->hids_cid);
+	if (status != ERROR_CODE_SUCCESS) {
+		bt_hid_event_push_ble(BT_HID_EVENT_DESCRIPTOR, bt_hog_conn_idx(conn), 0, status, 0, conn->addr);
+		gap_disconnect(con_handle);
+	}
+}
+
+static void sm_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
+{
+	UNUSED(channel);
+	UNUSED(size);
+
+	if (packet_type != HCI_EVENT_PACKET) {
+		return;
+	}
+
+	switch (hci_event_packet_get_type(packet)) {
+	case SM_EVENT_JUST_WORKS_REQUEST:
+		sm_just_works_confirm(sm_event_just_works_request_get_handle(packet));
+		break;
+	case SM_EVENT_NUMERIC_COMPARISON_REQUEST:
+		sm_numeric_comparison_confirm(sm_event_numeric_comparison_request_get_handle(packet));
+		break;
+	case SM_EVENT_PAIRING_COMPLETE:
+		bt_hog_paired(sm_event_pairing_complete_get_handle(packet),
+		              sm_event_pairing_complete_get_status(packet), false);
+		break;
+	case SM_EVENT_REENCRYPTION_COMPLETE:
+		bt_hog_paired(sm_event_reencryption_complete_get_handle(packet),
+		              sm_event_reencryption_complete_get_status(packet), true);
+		break;
+	default:
+		break;
+	}
+}
+
+static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
+{
+	UNUSED(channel);
+	UNUSED(size);
+
+	if (packet_type != HCI_EVENT_PACKET) {
+		return;
+	}
+
+	switch (hci_event_packet_get_type(packet)) {
+	case GAP_EVENT_ADVERTISING_REPORT:
+		{
+			if (hog_state != HOG_SCAN) {
+				break;
+			}
+
+			bd_addr_t addr;
+			gap_event_advertising_report_get_address(packet, addr);
+			bd_addr_type_t addr_type = gap_event_advertising_report_get_address_type(packet);
+			if (bt_hog_conn_find_addr(addr) || !bt_hog_wanted(packet, addr, addr_type)) {
+				break;
+			}
+
+			bt_hog_connect(addr, addr_type);
+		}
+		break;
+	case HCI_EVENT_LE_META:
+		switch (hci_event_le_meta_get_subevent_code(packet)) {
+		case HCI_SUBEVENT_LE_CONNECTION_COMPLETE:
+			bt_hog_connected(packet);
+			break;
+		case HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE:
+			bt_hog_interval_changed(packet);
+			break;
+		default:
+			break;
+		}
+		break;
+	case HCI_EVENT_DISCONNECTION_COMPLETE:
+		if (hci_event_disconnection_complete_get_status(packet) == ERROR_CODE_SUCCESS) {
+			bt_hog_disconnected(hci_event_disconnection_complete_get_connection_handle(packet),
+			                    hci_event_disconnection_complete_get_reason(packet));
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void bt_hog_init(void)
+{
+	for (unsigned int i = 0; i < BT_HID_MAX_CONTROLLERS; i++) {
+		hog_conns[i].con_handle = HCI_CON_HANDLE_INVALID;
+	}
+
+	// Controllers have no way to show or enter a passkey
+	sm_init();
+	sm_set_io_capabilities(IO_CAPABILITY_NO_INPUT_NO_OUTPUT);
+	sm_set_authentication_requirements(SM_AUTHREQ_SECURE_CONNECTION | SM_AUTHREQ_BONDING);
+
+	gatt_client_init();
+	hids_client_init(hog_descriptor_storage, sizeof(hog_descriptor_storage));
+
+	// Ask for the shortest interval straight away, the controller can
+	// always ask for longer
+	gap_set_connection_parameters(LE_SCAN_FAST_INTERVAL, LE_SCAN_WINDOW, interval_ladder[0], interval_ladder[0],
+	                              0, LE_SUPERVISION_TIMEOUT, 0, 0);
+
+	hci_event_callback_registration.callback = &packet_handler;
+	hci_add_event_handler(&hci_event_callback_registration);
+
+	sm_event_callback_registration.callback = &sm_packet_handler;
+	sm_add_event_handler(&sm_event_callback_registration);
+}
@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef BT_HOG_H
+#define BT_HOG_H
+
+#include <stdbool.h>
+
+// The BLE half of bt_hid: HID over GATT (HOGP), for controllers which don't
+// do classic HID. BLE controllers share the controller slots with classic
+// ones, and their reports go through the same decoding, so the app can't
+// tell them apart. Everything here runs on the BT core.
+
+// Set up the security manager, GATT client and HIDS client. Call before
+// powering on.
+void bt_hog_init(void);
+
+// Start or stop looking for BLE controllers, depending on whether there's a
+// free slot. Call whenever a controller connects or disconnects.
+void bt_hog_update_scan(void);
+
+// From bt_hid.c: take a free slot for a BLE controller, or -1 if they're
+// all in use, and give it back when it disconnects
+int bt_hid_slot_claim(void);
+void bt_hid_slot_release(unsigned int idx);
+unsigned int bt_hid_slots_free(void);
+unsigned int bt_hid_slots_used(void);
+
+#endif // BT_HOG_H
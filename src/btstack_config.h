@@ -20,12 +20,16 @@
 #define MAX_NR_BNEP_CHANNELS 1
 #define MAX_NR_BNEP_SERVICES 1
 #define MAX_NR_BTSTACK_LINK_KEY_DB_MEMORY_ENTRIES  2
-#define MAX_NR_GATT_CLIENTS 1
-#define MAX_NR_HCI_CONNECTIONS 2
-#define MAX_NR_HID_HOST_CONNECTIONS 1
-#define MAX_NR_HIDS_CLIENTS 1
+// BLE controllers (bt_hog.c) each need a GATT client and a HIDS client
+#define MAX_NR_GATT_CLIENTS 4
+// Up to 4 controllers (BT_HID_MAX_CONTROLLERS), plus one spare so another
+// can still connect to us, and be turned away, while we're full
+#define MAX_NR_HCI_CONNECTIONS 5
+#define MAX_NR_HID_HOST_CONNECTIONS 4
+#define MAX_NR_HIDS_CLIENTS 4
 #define MAX_NR_HFP_CONNECTIONS 1
-#define MAX_NR_L2CAP_CHANNELS  4
+// Control and interrupt for each controller, plus SDP in each direction
+#define MAX_NR_L2CAP_CHANNELS  10
 #define MAX_NR_L2CAP_SERVICES  3
 #define MAX_NR_RFCOMM_CHANNELS 1
 #define MAX_NR_RFCOMM_MULTIPLEXERS 1
@@ -39,10 +43,15 @@
 #define MAX_NR_CONTROLLER_ACL_BUFFERS 3
 #define MAX_NR_CONTROLLER_SCO_PACKETS 3
 
-// Enable and configure HCI Controller to Host Flow Control to avoid cyw43 shared bus overrun
+// Enable and configure HCI Controller to Host Flow Control to avoid cyw43 shared bus overrun.
+// Input reports are under 100 bytes, so rather than 3 x 1024 the same space
+// is split into more, smaller packets. With 4 controllers at 800 Hz, 3 would
+// stall every link whenever we took more than ~1 ms to handle a packet;
+// 12 gives each controller 3 in flight. Anything longer (SDP) is fragmented
+// by the controller and reassembled by L2CAP.
 #define ENABLE_HCI_CONTROLLER_TO_HOST_FLOW_CONTROL
-#define HCI_HOST_ACL_PACKET_LEN 1024
-#define HCI_HOST_ACL_PACKET_NUM 3
+#define HCI_HOST_ACL_PACKET_LEN 256
+#define HCI_HOST_ACL_PACKET_NUM 12
 #define HCI_HOST_SCO_PACKET_LEN 120
 #define HCI_HOST_SCO_PACKET_NUM 3
 
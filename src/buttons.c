@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+
+#include "buttons.h"
+
+//ChatGPT gave me this, printing out the hex as bits to visualize it easier :)
+void print_bits(uint8_t val) {
+    for (int i = 7; i >= 0; i--) {
+        printf("%d", (val >> i) & 1);
+        if (i % 4 == 0) printf(" "); // optional: space every 4 bits
+    }
+    //printf("\n");
+}
+
+// Bit-sliced compare of the three counter planes against a constant, giving a
+// bit for every button whose counter equals n.
+#define COUNT_EQUALS(_c, _n) ( \
+	(((_n) & 1) ? (_c)[0] : ~(_c)[0]) & \
+	(((_n) & 2) ? (_c)[1] : ~(_c)[1]) & \
+	(((_n) & 4) ? (_c)[2] : ~(_c)[2]))
+
+uint16_t buttonsDebounce(uint16_t raw, struct buttonStatus *buttonsStatus)
+{
+	uint16_t *count = buttonsStatus->count;
+	uint16_t held = buttonsStatus->held;
+
+	// Count up every button that disagrees with its debounced state, and
+	// reset the rest. This is a 3-bit adder, one bit from each button per
+	// plane.
+	uint16_t diff = raw ^ held;
+	uint16_t carry0 = count[0] & diff;
+	uint16_t carry1 = count[1] & carry0;
+	count[0] = (count[0] ^ diff) & diff;
+	count[1] = (count[1] ^ carry0) & diff;
+	count[2] = (count[2] ^ carry1) & diff;
+
+	// Flip the ones which have disagreed for long enough
+	uint16_t changed = (~held & COUNT_EQUALS(count, DEBOUNCE_PRESS_SAMPLES)) |
+	                   (held & COUNT_EQUALS(count, DEBOUNCE_RELEASE_SAMPLES));
+
+	buttonsStatus->held = held ^ changed;
+	count[0] &= ~changed;
+	count[1] &= ~changed;
+	count[2] &= ~changed;
+
+	return changed;
+}
+
+static const char *const button_names[BUTTON_COUNT] = {
+	[BUTTON_SQUARE]   = "Square",
+	[BUTTON_EX]       = "Ex",
+	[BUTTON_CIRCLE]   = "Circle",
+	[BUTTON_TRIANGLE] = "Triangle",
+	[BUTTON_L1]       = "left bumper",
+	[BUTTON_R1]       = "right bumper",
+	[BUTTON_L2]       = "left trigger",
+	[BUTTON_R2]       = "right trigger",
+	[BUTTON_SHARE]    = "share button",
+	[BUTTON_OPTIONS]  = "options button",
+	[BUTTON_LJOY]     = "left joystick",
+	[BUTTON_RJOY]     = "right joystick",
+	[BUTTON_UP]       = "Up",
+	[BUTTON_RIGHT]    = "Right",
+	[BUTTON_DOWN]     = "Down",
+	[BUTTON_LEFT]     = "Left",
+};
+
+static void print_pressed(enum button_id button)
+{
+	printf("%s pressed\n", button_names[button]);
+}
+
+static void print_released(enum button_id button)
+{
+	printf("%s released\n", button_names[button]);
+}
+
+//Code for what each button does goes in these functions, or register your
+//own with buttonRegister(). By default they just print what happened.
+static button_callback_t pressed_callbacks[BUTTON_COUNT] = {
+	[0 ... BUTTON_COUNT - 1] = print_pressed,
+};
+
+static button_callback_t released_callbacks[BUTTON_COUNT] = {
+	[0 ... BUTTON_COUNT - 1] = print_released,
+};
+
+void buttonRegister(enum button_id button, button_callback_t on_pressed, button_callback_t on_released)
+{
+	pressed_callbacks[button] = on_pressed;
+	released_callbacks[button] = on_released;
+}
+
+//Dpad input uses a "Hat switch" encoding, this turns it into one bit for each
+//direction, so diagonals are just two buttons held at once.
+/*
+   0
+ 7   1
+6  8  2
+ 5   3
+   4
+*/
+#define DPAD(_dir) BUTTON_BIT(BUTTON_ ## _dir)
+static const uint16_t hat_to_dpad[16] = {
+	[0] = DPAD(UP),
+	[1] = DPAD(UP) | DPAD(RIGHT),
+	[2] = DPAD(RIGHT),
+	[3] = DPAD(DOWN) | DPAD(RIGHT),
+	[4] = DPAD(DOWN),
+	[5] = DPAD(DOWN) | DPAD(LEFT),
+	[6] = DPAD(LEFT),
+	[7] = DPAD(UP) | DPAD(LEFT),
+	// 8 is centered, 9-15 shouldn't happen
+};
+
+uint16_t buttonsPack(struct bt_hid_state state)
+{
+	return (state.buttons >> 4) | (state.triggers << 4) | hat_to_dpad[state.buttons & 0xf];
+}
+
+// Call the callback for each set bit, lowest first
+static void buttonDispatch(uint16_t mask, button_callback_t *callbacks)
+{
+	while (mask) {
+		enum button_id button = __builtin_ctz(mask);
+		mask &= mask - 1;
+
+		if (callbacks[button]) {
+			callbacks[button](button);
+		}
+	}
+}
+
+// Whether the sticks have moved since they were last printed, and it's been
+// long enough. If so, they count as printed now.
+static bool sticksPrintDue(const struct bt_hid_sticks *sticks, struct buttonStatus *buttonsStatus)
+{
+	const struct bt_hid_sticks *printed = &buttonsStatus->printed;
+	if (sticks->lx == printed->lx && sticks->ly == printed->ly &&
+	    sticks->rx == printed->rx && sticks->ry == printed->ry) {
+		return false;
+	}
+
+	uint32_t now = time_us_32();
+	if (now - buttonsStatus->printed_us < STICK_PRINT_US) {
+		return false;
+	}
+
+	buttonsStatus->printed = *sticks;
+	buttonsStatus->printed_us = now;
+	return true;
+}
+
+uint16_t ButtonHandler(struct bt_hid_state state, const struct bt_hid_sticks *sticks, struct buttonStatus *buttonsStatus)
+{
+	/*The sticks come already centred, with the deadzone taken out (see
+	stick.h): -32767 to 32767, up and right are positive. Anything outside
+	the deadzone isn't 0, whichever direction it's pushed in.*/
+	int ly = sticks->ly;
+	int lx = sticks->lx;
+	int ry = sticks->ry;
+	int rx = sticks->rx;
+
+	/*
+	//First, print out the controller input:
+	printf("Face buttons: %02x, l: %d,%d, r: %d,%d, Trigger buttons: %02x",
+		state.buttons, lx, ly, rx, ry, state.triggers);
+	printf("\t Face Bits: ");
+	print_bits(state.buttons);
+	printf("\t Trigger Bits: ");
+	print_bits(state.triggers);
+	printf("\n");		
+	*/
+
+	//JOYSTICKS
+
+	//Only print them when they move, and not for every report
+	bool printSticks = sticksPrintDue(sticks, buttonsStatus);
+
+	if(ly) //LEFT JOYSTICK VERTICAL
+	{
+		//Code for if left joystick is moved vertically.
+		if (printSticks) {
+			printf("left joystick moved vertically: %d\n", ly);
+		}
+	}
+	if(lx) //LEFT JOYSTICK HORIZONTAL
+	{
+		//Code for if left joystick is moved horizontally.
+		if (printSticks) {
+			printf("left joystick moved horizontally: %d\n", lx);
+		}
+	}
+
+	if(ry) //RIGHT JOYSTICK VERTICAL
+	{
+		//Code for if right joystick is moved vertically.
+		if (printSticks) {
+			printf("right joystick moved vertically: %d\n", ry);
+		}
+	}
+	if(rx) //RIGHT JOYSTICK HORIZONTAL
+	{
+		//Code for if right joystick is moved horizontally.
+		if (printSticks) {
+			printf("right joystick moved horiontally: %d\n", rx);
+		}
+	}
+
+	//BUTTONS
+
+	uint16_t changed = buttonsDebounce(buttonsPack(state), buttonsStatus);
+	uint16_t held = buttonsStatus->held;
+
+	buttonDispatch(changed & held, pressed_callbacks);
+	buttonDispatch(changed & ~held, released_callbacks);
+
+	return changed;
+}
@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef BUTTONS_H
+#define BUTTONS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bt_hid.h"
+
+// How many samples in a row a button has to read pressed before it counts as
+// pressed, and released before it counts as released. Each can be 1 to 7.
+// The defaults match the old one-button-at-a-time debouncer: presses count
+// straight away, releases after 6 samples. The one difference is its quirk of
+// ignoring a press on the very next sample after a release, which is gone.
+// The old one lives on in host/replay.c, to check this against.
+//
+// A sample is a report, so the release window is 6 reports: 7.5 ms from a
+// DS4 at 800 Hz. The old loop only sampled every 20 ms, which made it about
+// 120 ms, so a flicker that used to be hidden can now show up as a release
+// and press again. Raise DEBOUNCE_RELEASE_SAMPLES if a controller needs it.
+// A controller which goes quiet is still sampled every 20 ms (BUTTON_TICK_US
+// in main.c), so its releases take up to 120 ms, as before.
+#ifndef DEBOUNCE_PRESS_SAMPLES
+#define DEBOUNCE_PRESS_SAMPLES 1
+#endif
+#ifndef DEBOUNCE_RELEASE_SAMPLES
+#define DEBOUNCE_RELEASE_SAMPLES 6
+#endif
+
+// The sticks are only printed when they've moved since they were last
+// printed, and at most this often per controller. Reports come in at up to
+// 800 Hz, which is far more than the serial port can keep up with.
+#ifndef STICK_PRINT_US
+#define STICK_PRINT_US 100000
+#endif
+
+#if (DEBOUNCE_PRESS_SAMPLES < 1) || (DEBOUNCE_PRESS_SAMPLES > 7) || \
+    (DEBOUNCE_RELEASE_SAMPLES < 1) || (DEBOUNCE_RELEASE_SAMPLES > 7)
+#error "Debounce windows must be between 1 and 7 samples"
+#endif
+
+// Each button gets one bit in a 16-bit word, in this order
+enum button_id {
+	BUTTON_SQUARE,
+	BUTTON_EX,
+	BUTTON_CIRCLE,
+	BUTTON_TRIANGLE,
+	BUTTON_L1,
+	BUTTON_R1,
+	BUTTON_L2,
+	BUTTON_R2,
+	BUTTON_SHARE,
+	BUTTON_OPTIONS,
+	BUTTON_LJOY,
+	BUTTON_RJOY,
+	BUTTON_UP,
+	BUTTON_RIGHT,
+	BUTTON_DOWN,
+	BUTTON_LEFT,
+	BUTTON_COUNT,
+};
+
+#define BUTTON_BIT(_id) ((uint16_t)1 << (_id))
+
+//Some of the triggers will rapidly switch between 1 and 0 when pressed,
+//So making these to keep track of how long they've been released for.
+//To make sure they're really off.
+//
+//All the buttons are debounced at once with "vertical" counters: count[n]
+//holds bit n of every button's counter.
+struct buttonStatus {
+	uint16_t count[3];
+	uint16_t held; // Debounced state, one BUTTON_BIT() per button
+	struct bt_hid_sticks printed; // The sticks as they were last printed
+	uint32_t printed_us;
+};
+
+typedef void (*button_callback_t)(enum button_id button);
+
+void print_bits(uint8_t val);
+
+// Debounce a word of raw BUTTON_BIT()s, updating buttonsStatus->held.
+// Returns the bits which changed.
+uint16_t buttonsDebounce(uint16_t raw, struct buttonStatus *buttonsStatus);
+
+// Pack the buttons from a report into a word of BUTTON_BIT()s
+uint16_t buttonsPack(struct bt_hid_state state);
+
+// Set what to do when a button is pressed or released. Either can be NULL.
+void buttonRegister(enum button_id button, button_callback_t on_pressed, button_callback_t on_released);
+
+//Handles checking for each button press. Returns the buttons which changed,
+//as buttonsDebounce() does, for combo_update().
+uint16_t ButtonHandler(struct bt_hid_state state, const struct bt_hid_sticks *sticks, struct buttonStatus *buttonsStatus);
+
+#endif // BUTTONS_H
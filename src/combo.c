@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "buttons.h"
+#include "combo.h"
+
+#define COMBO_BIT(_id) ((uint32_t)1 << (_id))
+
+// The transition table: each combo's steps, in order. Short lists are
+// padded with zeroed steps, which mark the end.
+#define COMBO_STEPS(arg, name, kind, a, b, c, ms, desc) \
+	[COMBO_ ## name] = { COMBO_STEPS_ ## kind(a, b, c, ms) },
+static const struct combo_step combo_steps[COMBO_COUNT][COMBO_MAX_STEPS] = {
+	COMBO_TABLE(COMBO_STEPS, 0)
+};
+
+// Every button each combo uses. Pressing anything else part way through
+// spoils it.
+#define COMBO_BUTTONS(arg, name, kind, a, b, c, ms, desc) \
+	[COMBO_ ## name] = (a) | (b) | (c),
+static const uint16_t combo_buttons[COMBO_COUNT] = {
+	COMBO_TABLE(COMBO_BUTTONS, 0)
+};
+
+// For each button, the combos which start with it, so the idle ones don't
+// need looking at until one of their buttons is pressed
+#define COMBO_START_BIT(button, name, kind, a, b, c, ms, desc) \
+	| (((a) & BUTTON_BIT(button)) ? COMBO_BIT(COMBO_ ## name) : 0)
+#define COMBO_STARTS(button) [button] = 0 COMBO_TABLE(COMBO_START_BIT, button)
+static const uint32_t combo_starts[BUTTON_COUNT] = {
+	COMBO_STARTS(BUTTON_SQUARE),
+	COMBO_STARTS(BUTTON_EX),
+	COMBO_STARTS(BUTTON_CIRCLE),
+	COMBO_STARTS(BUTTON_TRIANGLE),
+	COMBO_STARTS(BUTTON_L1),
+	COMBO_STARTS(BUTTON_R1),
+	COMBO_STARTS(BUTTON_L2),
+	COMBO_STARTS(BUTTON_R2),
+	COMBO_STARTS(BUTTON_SHARE),
+	COMBO_STARTS(BUTTON_OPTIONS),
+	COMBO_STARTS(BUTTON_LJOY),
+	COMBO_STARTS(BUTTON_RJOY),
+	COMBO_STARTS(BUTTON_UP),
+	COMBO_STARTS(BUTTON_RIGHT),
+	COMBO_STARTS(BUTTON_DOWN),
+	COMBO_STARTS(BUTTON_LEFT),
+};
+
+#define COMBO_NAME(arg, name, kind, a, b, c, ms, desc) [COMBO_ ## name] = desc,
+static const char *const combo_names[COMBO_COUNT] = {
+	COMBO_TABLE(COMBO_NAME, 0)
+};
+
+static void print_fired(enum combo_id combo)
+{
+	printf("%s\n", combo_names[combo]);
+}
+
+static combo_callback_t fired_callbacks[COMBO_COUNT] = {
+	[0 ... COMBO_COUNT - 1] = print_fired,
+};
+
+void combo_register(enum combo_id combo, combo_callback_t on_fired)
+{
+	fired_callbacks[combo] = on_fired;
+}
+
+const char *combo_name(enum combo_id combo)
+{
+	return combo_names[combo];
+}
+
+// Whether a combo part way through has to start again
+static bool combo_spoiled(const struct combo_step *step, uint16_t others, uint16_t pressed,
+                          uint16_t released, uint32_t elapsed_us)
+{
+	if (step->edge == COMBO_HELD) {
+		return released & step->mask;
+	}
+
+	return (step->ms && (elapsed_us > step->ms * 1000u)) || (pressed & others);
+}
+
+static bool combo_step_done(const struct combo_step *step, uint16_t pressed, uint16_t released,
+                            uint16_t held, uint32_t elapsed_us)
+{
+	switch (step->edge) {
+	case COMBO_DOWN:
+		return ((held & step->mask) == step->mask) && (pressed & step->mask);
+	case COMBO_UP:
+		return released & step->mask;
+	case COMBO_HELD:
+		return elapsed_us >= step->ms * 1000u;
+	default:
+		return false;
+	}
+}
+
+// Move one combo along, returns true if it fired
+static bool combo_advance(struct combo_status *status, enum combo_id combo, uint16_t pressed,
+                          uint16_t released, uint16_t held, uint32_t now_us)
+{
+	const struct combo_step *steps = combo_steps[combo];
+	unsigned int step = status->step[combo];
+	uint32_t elapsed_us = now_us - status->since_us[combo];
+	bool fired = false;
+
+	// Whatever spoiled it might be the start of the next go
+	if (step && combo_spoiled(&steps[step], ~combo_buttons[combo], pressed, released, elapsed_us)) {
+		step = 0;
+	}
+
+	if (combo_step_done(&steps[step], pressed, released, held, elapsed_us)) {
+		step++;
+		if ((step == COMBO_MAX_STEPS) || !steps[step].mask) {
+			fired = true;
+			step = 0;
+		}
+		status->since_us[combo] = now_us;
+	}
+
+	status->step[combo] = step;
+	if (step) {
+		status->active |= COMBO_BIT(combo);
+	} else {
+		status->active &= ~COMBO_BIT(combo);
+	}
+
+	return fired;
+}
+
+uint32_t combo_update(struct combo_status *status, uint16_t changed, uint16_t held, uint32_t now_us)
+{
+	uint16_t pressed = changed & held;
+	uint16_t released = changed & ~held;
+	uint32_t candidates = status->active;
+	uint32_t fired = 0;
+
+	for (uint16_t mask = pressed; mask; mask &= mask - 1) {
+		candidates |= combo_starts[__builtin_ctz(mask)];
+	}
+
+	while (candidates) {
+		enum combo_id combo = __builtin_ctz(candidates);
+		candidates &= candidates - 1;
+
+		if (combo_advance(status, combo, pressed, released, held, now_us)) {
+			fired |= COMBO_BIT(combo);
+			if (fired_callbacks[combo]) {
+				fired_callbacks[combo](combo);
+			}
+		}
+	}
+
+	return fired;
+}
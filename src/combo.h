@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef COMBO_H
+#define COMBO_H
+
+#include <stdint.h>
+
+#include "buttons.h"
+
+// Chords, sequences and hold/tap/double-tap gestures, declared in
+// COMBO_TABLE below instead of being picked out of the buttons by hand.
+//
+// Each entry is turned into a short list of steps by the compiler, and a
+// combo is a little state machine which walks along them as the debounced
+// button edges come in. Idle combos cost nothing: only the ones part way
+// through, or which start with a button that was just pressed, are looked
+// at. Combos fire on top of the buttons' own callbacks, they don't swallow
+// them.
+
+// What a step waits for
+enum combo_edge {
+	COMBO_DOWN, // All of mask held, one of them just pressed
+	COMBO_UP,   // Any of mask released
+	COMBO_HELD, // All of mask still held after ms
+};
+
+struct combo_step {
+	uint16_t mask;
+	uint8_t edge; // enum combo_edge
+	// For COMBO_DOWN and COMBO_UP, the most time allowed since the step
+	// before, 0 for no limit. For COMBO_HELD, how long to hold.
+	uint16_t ms;
+};
+
+// The kinds of entry. The arguments are always (a, b, c, ms), unused ones 0.
+//   COMBO_CHORD:      all of a held together
+//   COMBO_SEQUENCE:   a, then b, then c (if not 0), each pressed within ms
+//                     of the one before
+//   COMBO_HOLD:       a held for ms
+//   COMBO_TAP:        a pressed and released within ms
+//   COMBO_DOUBLE_TAP: a tapped, then pressed again, each within ms
+#define COMBO_STEPS_COMBO_CHORD(a, b, c, ms) \
+	{ (a), COMBO_DOWN, 0 }
+#define COMBO_STEPS_COMBO_SEQUENCE(a, b, c, ms) \
+	{ (a), COMBO_DOWN, 0 }, { (b), COMBO_DOWN, (ms) }, { (c), COMBO_DOWN, (ms) }
+#define COMBO_STEPS_COMBO_HOLD(a, b, c, ms) \
+	{ (a), COMBO_DOWN, 0 }, { (a), COMBO_HELD, (ms) }
+#define COMBO_STEPS_COMBO_TAP(a, b, c, ms) \
+	{ (a), COMBO_DOWN, 0 }, { (a), COMBO_UP, (ms) }
+#define COMBO_STEPS_COMBO_DOUBLE_TAP(a, b, c, ms) \
+	{ (a), COMBO_DOWN, 0 }, { (a), COMBO_UP, (ms) }, { (a), COMBO_DOWN, (ms) }
+
+#define COMBO_MAX_STEPS 3
+
+#define BTN(_id) BUTTON_BIT(BUTTON_ ## _id)
+
+// The combos: X(arg, name, kind, a, b, c, ms, description). Add your own
+// here, then give them something to do with combo_register().
+#define COMBO_TABLE(X, arg) \
+	X(arg, SHARE_OPTIONS, COMBO_CHORD,      BTN(SHARE) | BTN(OPTIONS), 0, 0, 0, "share+options") \
+	X(arg, BUMPERS_HOLD,  COMBO_HOLD,       BTN(L1) | BTN(R1), 0, 0, 1000, "both bumpers held") \
+	X(arg, TRIANGLE_2TAP, COMBO_DOUBLE_TAP, BTN(TRIANGLE), 0, 0, 300, "triangle double-tap") \
+	X(arg, CIRCLE_TAP,    COMBO_TAP,        BTN(CIRCLE), 0, 0, 200, "circle tap") \
+	X(arg, UP_UP_DOWN,    COMBO_SEQUENCE,   BTN(UP), BTN(UP), BTN(DOWN), 500, "up, up, down")
+
+#define COMBO_ENUM(arg, name, kind, a, b, c, ms, desc) COMBO_ ## name,
+enum combo_id {
+	COMBO_TABLE(COMBO_ENUM, 0)
+	COMBO_COUNT,
+};
+#undef COMBO_ENUM
+
+#if COMBO_COUNT > 32
+#error "At most 32 combos, they're tracked in a 32-bit mask"
+#endif
+
+// Per controller, start zeroed
+struct combo_status {
+	uint32_t active; // Combos part way through, one bit each
+	uint8_t step[COMBO_COUNT];
+	uint32_t since_us[COMBO_COUNT]; // When the last step happened
+};
+
+typedef void (*combo_callback_t)(enum combo_id combo);
+
+// Advance the combos with a debounced sample: changed and held as from
+// buttonsDebounce(), now_us the time of the sample. Call it for every
+// sample, even ones where nothing changed, so holds and timeouts happen.
+// Returns the combos which fired, one bit each.
+uint32_t combo_update(struct combo_status *status, uint16_t changed, uint16_t held, uint32_t now_us);
+
+// Set what to do when a combo fires, NULL for nothing
+void combo_register(enum combo_id combo, combo_callback_t on_fired);
+
+const char *combo_name(enum combo_id combo);
+
+#endif // COMBO_H
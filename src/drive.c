@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stdint.h>
+
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/pwm.h"
+#include "pico/stdlib.h"
+
+#include "bt_hid.h"
+#include "drive.h"
+
+#if DRIVE_PIN_BASE >= 0
+
+// These magic values are just taken from M0o+, not calibrated for
+// the Tiny chassis. Below PWM_MIN the motors don't turn at all.
+#define PWM_MIN 80
+#define PWM_MAX (PWM_MIN + 127)
+
+#define DRIVE_PWM_WRAP 255
+#define DRIVE_PWM_HZ   20000 // Out of earshot
+
+#define DRIVE_PERIOD_US (1000000 / DRIVE_RATE_HZ)
+
+#define LEFT_PIN  DRIVE_PIN_BASE
+#define RIGHT_PIN (DRIVE_PIN_BASE + 2)
+
+// Filled in by drive_init(), so the tick is just lookups and adds. Maps a
+// motor speed (0 to 127) to a PWM level, jumping straight past the range
+// where the motor stalls.
+static uint16_t duty_table[128];
+
+static repeating_timer_t drive_timer;
+static uint32_t next_us;
+static struct drive_stats stats;
+
+static void drive_build_tables(void)
+{
+	duty_table[0] = 0;
+	for (int i = 1; i < 128; i++) {
+		duty_table[i] = PWM_MIN + i * (PWM_MAX - PWM_MIN) / 127;
+	}
+}
+
+static int drive_clamp(int v)
+{
+	return v > 127 ? 127 : (v < -127 ? -127 : v);
+}
+
+// Forward on one channel, reverse on the other, like a DRV8833
+static void drive_set_motor(uint pin, int speed)
+{
+	uint slice = pwm_gpio_to_slice_num(pin);
+
+	if (speed >= 0) {
+		pwm_set_chan_level(slice, PWM_CHAN_A, duty_table[speed]);
+		pwm_set_chan_level(slice, PWM_CHAN_B, 0);
+	} else {
+		pwm_set_chan_level(slice, PWM_CHAN_A, 0);
+		pwm_set_chan_level(slice, PWM_CHAN_B, duty_table[-speed]);
+	}
+}
+
+static bool drive_tick(repeating_timer_t *rt)
+{
+	(void)rt;
+
+	uint32_t start = time_us_32();
+#if DRIVE_PROBE_PIN >= 0
+	gpio_put(DRIVE_PROBE_PIN, 1);
+#endif
+
+	// Already conditioned, so just scale from Q15. A stale or disconnected
+	// controller reads as centred, which stops.
+	struct bt_hid_sticks sticks;
+	bt_hid_get_latest_sticks(DRIVE_CONTROLLER, &sticks);
+
+	int throttle = sticks.ly >> 8;
+	int turn = sticks.lx >> 8;
+	drive_set_motor(LEFT_PIN, drive_clamp(throttle + turn));
+	drive_set_motor(RIGHT_PIN, drive_clamp(throttle - turn));
+
+	uint32_t late = start - next_us;
+	if (((int32_t)late > 0) && (late > stats.max_late_us)) {
+		stats.max_late_us = late;
+	}
+	next_us += DRIVE_PERIOD_US;
+
+	uint32_t took = time_us_32() - start;
+	if (took > stats.max_tick_us) {
+		stats.max_tick_us = took;
+	}
+	stats.ticks++;
+
+#if DRIVE_PROBE_PIN >= 0
+	gpio_put(DRIVE_PROBE_PIN, 0);
+#endif
+	return true;
+}
+
+static void drive_init_slice(uint pin)
+{
+	pwm_config config = pwm_get_default_config();
+	pwm_config_set_wrap(&config, DRIVE_PWM_WRAP);
+	pwm_config_set_clkdiv(&config, (float)clock_get_hz(clk_sys) / (DRIVE_PWM_HZ * (DRIVE_PWM_WRAP + 1)));
+
+	gpio_set_function(pin, GPIO_FUNC_PWM);
+	gpio_set_function(pin + 1, GPIO_FUNC_PWM);
+	pwm_init(pwm_gpio_to_slice_num(pin), &config, false);
+	pwm_set_both_levels(pwm_gpio_to_slice_num(pin), 0, 0);
+	pwm_set_enabled(pwm_gpio_to_slice_num(pin), true);
+}
+
+void drive_init(void)
+{
+	drive_build_tables();
+
+	drive_init_slice(LEFT_PIN);
+	drive_init_slice(RIGHT_PIN);
+
+#if DRIVE_PROBE_PIN >= 0
+	gpio_init(DRIVE_PROBE_PIN);
+	gpio_set_dir(DRIVE_PROBE_PIN, GPIO_OUT);
+#endif
+
+	// Negative, so it's the time between starts, not from the end of one
+	// tick to the start of the next
+	next_us = time_us_32() + DRIVE_PERIOD_US;
+	add_repeating_timer_us(-DRIVE_PERIOD_US, drive_tick, NULL, &drive_timer);
+}
+
+void drive_get_stats(struct drive_stats *dst)
+{
+	// Only ever goes up, a torn read is off by one tick at worst
+	*dst = stats;
+}
+
+#endif
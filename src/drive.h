@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef DRIVE_H
+#define DRIVE_H
+
+#include <stdint.h>
+
+// Differential drive from the left stick: up/down is throttle, left/right
+// turns. It runs from a repeating timer at a fixed rate, rather than from
+// the main loop, so the motors are updated on time however the reports
+// arrive. Each tick takes the freshest sticks with
+// bt_hid_get_latest_sticks(), which never waits for the BT core, so the
+// deadzone and response curve are the ones from stick.h.
+
+// GPIOs for the two motors, DRIVE_PIN_BASE and DRIVE_PIN_BASE + 1 for the
+// left one (forward, reverse), then the same for the right. That's two PWM
+// slices, so it must be even. -1 for no motors.
+#ifndef DRIVE_PIN_BASE
+#define DRIVE_PIN_BASE -1
+#endif
+
+#if (DRIVE_PIN_BASE >= 0) && (DRIVE_PIN_BASE & 1)
+#error "DRIVE_PIN_BASE must be even, so each motor gets one PWM slice"
+#endif
+
+// How often to update the motors
+#ifndef DRIVE_RATE_HZ
+#define DRIVE_RATE_HZ 1000
+#endif
+
+// Goes high for the duration of each tick, to check the rate and the jitter
+// with a scope. -1 for none.
+#ifndef DRIVE_PROBE_PIN
+#define DRIVE_PROBE_PIN -1
+#endif
+
+// Which controller drives
+#ifndef DRIVE_CONTROLLER
+#define DRIVE_CONTROLLER 0
+#endif
+
+struct drive_stats {
+	uint32_t ticks;
+	uint32_t max_late_us; // Longest a tick started after it was due
+	uint32_t max_tick_us; // Longest a tick took
+};
+
+#if DRIVE_PIN_BASE >= 0
+
+// Set up the PWM and start the timer, on the calling core. Call after
+// bt_hid_wait_ready().
+void drive_init(void);
+
+void drive_get_stats(struct drive_stats *stats);
+
+#else
+
+static inline void drive_init(void) { }
+static inline void drive_get_stats(struct drive_stats *stats) { *stats = (struct drive_stats){ 0 }; }
+
+#endif
+
+#endif // DRIVE_H
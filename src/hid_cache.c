@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pico/btstack_flash_bank.h"
+
+#include "btstack_config.h"
+#include "btstack_tlv.h"
+#include "btstack_util.h"
+
+#include "hid_cache.h"
+#include "hid_profile.h"
+#include "hid_registry.h"
+
+// One TLV entry per controller. The tag only has room for part of the
+// address, so the whole thing is stored again to catch collisions, along
+// with a hash to catch anything else.
+#define HID_CACHE_TAG(_addr) (((uint32_t)'H' << 24) | ((_addr)[3] << 16) | ((_addr)[4] << 8) | (_addr)[5])
+#define HID_CACHE_CALIBRATION_TAG(_addr) (((uint32_t)'I' << 24) | ((_addr)[3] << 16) | ((_addr)[4] << 8) | (_addr)[5])
+
+struct hid_cache_entry {
+	bd_addr_t addr;
+	uint16_t len;
+	uint32_t hash;
+	uint8_t descriptor[HID_CACHE_MAX_DESCRIPTOR_LEN];
+};
+
+#define HID_CACHE_HEADER_LEN offsetof(struct hid_cache_entry, descriptor)
+
+// Small, and always the same size
+struct hid_cache_calibration_entry {
+	bd_addr_t addr;
+	struct hid_imu_calibration calibration;
+	uint32_t hash;
+};
+
+// Too big for the BT core's stack
+static struct hid_cache_entry entry;
+
+// The TLV bank is shared with BTstack's link keys and LE bonds, and when it
+// fills up, new pairings can't be saved. So the cache only gets what's left
+// after as many of those as BTstack will keep (and the registry), and
+// anything which doesn't fit just isn't cached.
+#define TLV_ENTRY_SIZE(_len) (8 + (_len))
+#define TLV_BANK_SIZE        (PICO_FLASH_BANK_TOTAL_SIZE / 2)
+#define TLV_LINK_KEY_SIZE    28 // link_key_nvm_t, private to btstack_link_key_db_tlv.c
+#define TLV_LE_DEVICE_SIZE   96 // le_device_db_entry_t, private to le_device_db_tlv.c, with room to spare
+#define TLV_RESERVED         (NVM_NUM_LINK_KEYS * TLV_ENTRY_SIZE(TLV_LINK_KEY_SIZE) + \
+                              NVM_NUM_DEVICE_DB_ENTRIES * TLV_ENTRY_SIZE(TLV_LE_DEVICE_SIZE) + \
+                              TLV_ENTRY_SIZE(sizeof(uint32_t) + HID_REGISTRY_MAX_DEVICES * sizeof(struct hid_registry_device)))
+
+_Static_assert(TLV_RESERVED < TLV_BANK_SIZE, "No room in the TLV bank for the cache");
+
+static bool hid_cache_tlv(const btstack_tlv_t **tlv, void **context)
+{
+	btstack_tlv_get_instance(tlv, context);
+	return *tlv != NULL;
+}
+
+// Whether another len bytes of cache fit alongside what's already cached.
+// Only controllers in the registry have cache entries, the rest are
+// forgotten when they're dropped from it. Anything being replaced is counted
+// twice, because the old copy is still there until the new one is written.
+static bool hid_cache_has_room(const btstack_tlv_t *tlv, void *context, uint32_t len)
+{
+	uint32_t used = TLV_RESERVED + TLV_ENTRY_SIZE(len);
+
+	for (unsigned int i = 0; i < hid_registry_count(); i++) {
+		const uint8_t *addr = hid_registry_get(i)->addr;
+		int desc_len = tlv->get_tag(context, HID_CACHE_TAG(addr), NULL, 0);
+		int cal_len = tlv->get_tag(context, HID_CACHE_CALIBRATION_TAG(addr), NULL, 0);
+
+		used += desc_len ? TLV_ENTRY_SIZE(desc_len) : 0;
+		used += cal_len ? TLV_ENTRY_SIZE(cal_len) : 0;
+	}
+
+	return used <= TLV_BANK_SIZE;
+}
+
+static bool hid_cache_load(const bd_addr_t addr)
+{
+	const btstack_tlv_t *tlv;
+	void *context;
+
+	if (!hid_cache_tlv(&tlv, &context)) {
+		return false;
+	}
+
+	int len = tlv->get_tag(context, HID_CACHE_TAG(addr), (uint8_t *)&entry, sizeof(entry));
+	if ((len < (int)HID_CACHE_HEADER_LEN) || (bd_addr_cmp(entry.addr, addr) != 0) ||
+	    (entry.len != len - HID_CACHE_HEADER_LEN) ||
+	    (entry.hash != hid_profile_hash(entry.descriptor, entry.len))) {
+		return false;
+	}
+
+	return true;
+}
+
+uint16_t hid_cache_get(const bd_addr_t addr, uint8_t *dst, uint16_t max)
+{
+	if (!hid_cache_load(addr) || (entry.len > max)) {
+		return 0;
+	}
+
+	memcpy(dst, entry.descriptor, entry.len);
+	return entry.len;
+}
+
+bool hid_cache_put(const bd_addr_t addr, const uint8_t *descriptor, uint16_t descriptor_len)
+{
+	const btstack_tlv_t *tlv;
+	void *context;
+
+	if ((descriptor_len == 0) || (descriptor_len > HID_CACHE_MAX_DESCRIPTOR_LEN) ||
+	    !hid_cache_tlv(&tlv, &context)) {
+		return false;
+	}
+
+	uint32_t hash = hid_profile_hash(descriptor, descriptor_len);
+	if (hid_cache_load(addr) && (entry.len == descriptor_len) && (entry.hash == hash)) {
+		return false;
+	}
+
+	if (!hid_cache_has_room(tlv, context, HID_CACHE_HEADER_LEN + descriptor_len)) {
+		return false;
+	}
+
+	bd_addr_copy(entry.addr, addr);
+	entry.len = descriptor_len;
+	entry.hash = hash;
+	memcpy(entry.descriptor, descriptor, descriptor_len);
+
+	return tlv->store_tag(context, HID_CACHE_TAG(addr), (const uint8_t *)&entry,
+	                      HID_CACHE_HEADER_LEN + descriptor_len) == 0;
+}
+
+static bool hid_cache_load_calibration(const bd_addr_t addr, struct hid_cache_calibration_entry *dst)
+{
+	const btstack_tlv_t *tlv;
+	void *context;
+
+	if (!hid_cache_tlv(&tlv, &context)) {
+		return false;
+	}
+
+	int len = tlv->get_tag(context, HID_CACHE_CALIBRATION_TAG(addr), (uint8_t *)dst, sizeof(*dst));
+	return (len == sizeof(*dst)) && (bd_addr_cmp(dst->addr, addr) == 0) &&
+	       (dst->hash == hid_profile_hash((const uint8_t *)&dst->calibration, sizeof(dst->calibration)));
+}
+
+bool hid_cache_get_calibration(const bd_addr_t addr, struct hid_imu_calibration *dst)
+{
+	struct hid_cache_calibration_entry cal_entry;
+
+	if (!hid_cache_load_calibration(addr, &cal_entry)) {
+		return false;
+	}
+
+	*dst = cal_entry.calibration;
+	return true;
+}
+
+bool hid_cache_put_calibration(const bd_addr_t addr, const struct hid_imu_calibration *calibration)
+{
+	struct hid_cache_calibration_entry cal_entry;
+	const btstack_tlv_t *tlv;
+	void *context;
+
+	if (!hid_cache_tlv(&tlv, &context)) {
+		return false;
+	}
+
+	if (hid_cache_load_calibration(addr, &cal_entry) &&
+	    (memcmp(&cal_entry.calibration, calibration, sizeof(*calibration)) == 0)) {
+		return false;
+	}
+
+	if (!hid_cache_has_room(tlv, context, sizeof(cal_entry))) {
+		return false;
+	}
+
+	memset(&cal_entry, 0, sizeof(cal_entry));
+	bd_addr_copy(cal_entry.addr, addr);
+	cal_entry.calibration = *calibration;
+	cal_entry.hash = hid_profile_hash((const uint8_t *)&cal_entry.calibration, sizeof(cal_entry.calibration));
+
+	return tlv->store_tag(context, HID_CACHE_CALIBRATION_TAG(addr), (const uint8_t *)&cal_entry,
+	                      sizeof(cal_entry)) == 0;
+}
+
+void hid_cache_forget(const bd_addr_t addr)
+{
+	struct hid_cache_calibration_entry cal_entry;
+	const btstack_tlv_t *tlv;
+	void *context;
+
+	if (!hid_cache_tlv(&tlv, &context)) {
+		return;
+	}
+
+	// The tags only have half the address, so check they're really addr's,
+	// even if they're corrupt otherwise
+	int len = tlv->get_tag(context, HID_CACHE_TAG(addr), (uint8_t *)&entry, HID_CACHE_HEADER_LEN);
+	if ((len == (int)HID_CACHE_HEADER_LEN) && (bd_addr_cmp(entry.addr, addr) == 0)) {
+		tlv->delete_tag(context, HID_CACHE_TAG(addr));
+	}
+
+	len = tlv->get_tag(context, HID_CACHE_CALIBRATION_TAG(addr), (uint8_t *)&cal_entry, sizeof(cal_entry));
+	if ((len == sizeof(cal_entry)) && (bd_addr_cmp(cal_entry.addr, addr) == 0)) {
+		tlv->delete_tag(context, HID_CACHE_CALIBRATION_TAG(addr));
+	}
+}
@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef HID_CACHE_H
+#define HID_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bluetooth.h"
+
+#include "hid_profile.h"
+
+// HID descriptors of controllers we've seen before, kept in the BTstack TLV
+// (i.e. flash), so that reconnecting doesn't have to wait for an SDP query.
+// Their IMU calibration too, so it applies from the very first report.
+// Only call these on the BT core, after the stack is up.
+
+// Biggest descriptor we'll cache, the same as hid_host's storage
+#define HID_CACHE_MAX_DESCRIPTOR_LEN 512
+
+// Copy the cached descriptor for addr into dst. Returns its length, or 0 if
+// there isn't one (or it's corrupt).
+uint16_t hid_cache_get(const bd_addr_t addr, uint8_t *dst, uint16_t max);
+
+// Cache the descriptor for addr. Only writes to flash if it's changed, and
+// there's room for it without crowding out the link keys. Returns true if it
+// was written.
+bool hid_cache_put(const bd_addr_t addr, const uint8_t *descriptor, uint16_t descriptor_len);
+
+// The same for the IMU calibration. get returns false if there isn't one.
+bool hid_cache_get_calibration(const bd_addr_t addr, struct hid_imu_calibration *dst);
+bool hid_cache_put_calibration(const bd_addr_t addr, const struct hid_imu_calibration *calibration);
+
+// Delete everything cached for addr, for when it's dropped from the registry
+void hid_cache_forget(const bd_addr_t addr);
+
+#endif // HID_CACHE_H
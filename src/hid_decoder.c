@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btstack_hid_parser.h"
+
+#include "bt_hid.h"
+#include "hid_decoder.h"
+
+#define USAGE_PAGE_GENERIC_DESKTOP 0x01
+#define USAGE_PAGE_BUTTON          0x09
+
+#define USAGE_X         0x30
+#define USAGE_Y         0x31
+#define USAGE_Z         0x32
+#define USAGE_RZ        0x35
+#define USAGE_HAT       0x39
+
+// Work out where a usage lives in struct bt_hid_state. The packing matches
+// the DS4 report 0x01: hat in the bottom nibble of "buttons" with the four
+// face buttons above it, and the next eight buttons in "triggers".
+static bool hid_decoder_map_usage(uint16_t usage_page, uint16_t usage,
+                                  uint8_t *dst, uint8_t *dst_shift, bool *axis)
+{
+	*dst_shift = 0;
+	*axis = false;
+
+	switch (usage_page) {
+	case USAGE_PAGE_GENERIC_DESKTOP:
+		*axis = true;
+		switch (usage) {
+		case USAGE_X:
+			*dst = offsetof(struct bt_hid_state, lx);
+			return true;
+		case USAGE_Y:
+			*dst = offsetof(struct bt_hid_state, ly);
+			return true;
+		case USAGE_Z:
+			*dst = offsetof(struct bt_hid_state, rx);
+			return true;
+		case USAGE_RZ:
+			*dst = offsetof(struct bt_hid_state, ry);
+			return true;
+		case USAGE_HAT:
+			*axis = false;
+			*dst = offsetof(struct bt_hid_state, buttons);
+			return true;
+		}
+		break;
+	case USAGE_PAGE_BUTTON:
+		if ((usage >= 1) && (usage <= 4)) {
+			*dst = offsetof(struct bt_hid_state, buttons);
+			*dst_shift = usage + 3;
+			return true;
+		} else if ((usage >= 5) && (usage <= 12)) {
+			*dst = offsetof(struct bt_hid_state, triggers);
+			*dst_shift = usage - 5;
+			return true;
+		}
+		break;
+	}
+
+	return false;
+}
+
+static void hid_decoder_add_field(struct hid_decoder *dec, const struct hid_decoder_field *field)
+{
+	uint8_t *base = (uint8_t *)&dec->base;
+	uint8_t len = field->byte + field->wide + 1;
+
+	if (len > dec->report_len) {
+		dec->report_len = len;
+	}
+	base[field->dst] &= ~(field->mask << field->dst_shift);
+
+	// Try to fold it in to the previous field, so runs of buttons become a
+	// single load/mask/or.
+	if (dec->num_fields) {
+		struct hid_decoder_field *prev = &dec->fields[dec->num_fields - 1];
+		uint16_t prev_end = prev->byte * 8 + prev->shift + prev->width;
+		uint8_t width = prev->width + field->width;
+
+		if ((prev->dst == field->dst) && !prev->flip && !field->flip &&
+		    (prev_end == (field->byte * 8 + field->shift)) &&
+		    (prev->dst_shift + prev->width == field->dst_shift) &&
+		    (width <= 8) && (prev->shift + width <= 16)) {
+			prev->width = width;
+			prev->mask = (1 << width) - 1;
+			prev->wide = prev->shift + width > 8;
+			return;
+		}
+	}
+
+	dec->fields[dec->num_fields++] = *field;
+}
+
+// Walk every field of the report with btstack_hid_parser, building the
+// table in dec
+static void hid_decoder_walk(struct hid_decoder *dec, const uint8_t *descriptor, uint16_t descriptor_len,
+                             uint8_t report_id, const uint8_t *report, uint16_t report_len)
+{
+	uint8_t claimed[sizeof(struct bt_hid_state)] = { 0 };
+	btstack_hid_parser_t parser;
+
+	memset(dec, 0, sizeof(*dec));
+	dec->report_id = report_id;
+	dec->base = default_state;
+
+	btstack_hid_parser_init(&parser, descriptor, descriptor_len, HID_REPORT_TYPE_INPUT, report, report_len);
+	while (btstack_hid_parser_has_more(&parser)) {
+		uint16_t bit = parser.report_pos_in_bit;
+		uint8_t width = parser.global_report_size;
+		bool is_variable = (parser.descriptor_item.item_value & 2) != 0;
+		bool is_signed = parser.global_logical_minimum < 0;
+		uint16_t usage_page, usage;
+		uint8_t dst, dst_shift;
+		int32_t value;
+		bool axis;
+
+		btstack_hid_parser_get_field(&parser, &usage_page, &usage, &value);
+
+		if ((width == 0) || (bit + width > HID_DECODER_MAX_REPORT_LEN * 8)) {
+			break;
+		}
+
+		if (!is_variable || !hid_decoder_map_usage(usage_page, usage, &dst, &dst_shift, &axis)) {
+			continue;
+		}
+
+		// Axes keep their most-significant 8 bits, scaled up if narrower
+		if (width > 8) {
+			bit += width - 8;
+			width = 8;
+		} else if (!axis && (dst_shift + width > 8)) {
+			continue;
+		}
+
+		struct hid_decoder_field field = {
+			.byte = bit / 8,
+			.shift = bit % 8,
+			.wide = (bit % 8) + width > 8,
+			.mask = (1 << width) - 1,
+			.flip = (axis && is_signed) ? 1 << (width - 1) : 0,
+			.dst = dst,
+			.dst_shift = axis ? 8 - width : dst_shift,
+			.width = width,
+		};
+
+		uint8_t bits = field.mask << field.dst_shift;
+		if (claimed[dst] & bits) {
+			continue;
+		}
+		claimed[dst] |= bits;
+
+		if (dec->num_fields == HID_DECODER_MAX_FIELDS) {
+			break;
+		}
+
+		hid_decoder_add_field(dec, &field);
+	}
+}
+
+static void hid_decoder_compile_id(struct hid_decoder *dec, const uint8_t *descriptor,
+                                   uint16_t descriptor_len, uint8_t report_id)
+{
+	// We only care about the field positions, so parse a dummy report
+	uint8_t report[HID_DECODER_MAX_REPORT_LEN] = { report_id };
+
+	hid_decoder_walk(dec, descriptor, descriptor_len, report_id, report, sizeof(report));
+}
+
+bool hid_decoder_compile(struct hid_decoder *dec, const uint8_t *descriptor, uint16_t descriptor_len)
+{
+	const uint8_t *pos = descriptor;
+	uint16_t remaining = descriptor_len;
+
+	if (!btstack_hid_report_id_declared(descriptor_len, descriptor)) {
+		hid_decoder_compile_id(dec, descriptor, descriptor_len, 0);
+		return dec->num_fields != 0;
+	}
+
+	// Try each report ID in turn, and take the first one we can use
+	while (remaining) {
+		hid_descriptor_item_t item;
+
+		btstack_hid_parse_descriptor_item(&item, pos, remaining);
+		if ((item.item_size == 0) || (item.item_size > remaining)) {
+			break;
+		}
+
+		if ((item.item_type == Global) && (item.item_tag == ReportID) && (item.item_value > 0) && (item.item_value <= 0xff)) {
+			hid_decoder_compile_id(dec, descriptor, descriptor_len, item.item_value);
+			if (dec->num_fields) {
+				return true;
+			}
+		}
+
+		pos += item.item_size;
+		remaining -= item.item_size;
+	}
+
+	return false;
+}
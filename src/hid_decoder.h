@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef HID_DECODER_H
+#define HID_DECODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bt_hid.h"
+
+// Enough for the biggest DS4 report (0x11, 78 bytes)
+#define HID_DECODER_MAX_REPORT_LEN 80
+#define HID_DECODER_MAX_FIELDS     16
+
+// One field of a compiled report. Every field lands in a single byte of
+// struct bt_hid_state, and is at most 8 bits wide, so it never spans more
+// than two bytes of the report.
+struct hid_decoder_field {
+	uint8_t byte;      // First report byte holding the field
+	uint8_t wide;      // 1 if the field spills into byte + 1
+	uint8_t shift;     // Bit position of the field inside the 16-bit load
+	uint8_t mask;
+	uint8_t flip;      // XOR applied to re-centre signed axes on 0x80
+	uint8_t dst;       // offsetof() the destination in struct bt_hid_state
+	uint8_t dst_shift;
+	uint8_t width;     // Only used while compiling
+};
+
+// A flat, descriptor-derived table which decodes one input report ID
+// straight into struct bt_hid_state.
+struct hid_decoder {
+	uint8_t report_id;   // 0 when the descriptor doesn't declare IDs
+	uint8_t report_len;  // Minimum report length, including the ID byte
+	uint8_t num_fields;
+	struct hid_decoder_field fields[HID_DECODER_MAX_FIELDS];
+	// Starting point for each decode: default_state, with every bit that a
+	// field writes cleared.
+	struct bt_hid_state base;
+};
+
+// Hard-coded layout used when there's no descriptor to compile (e.g. boot
+// protocol mode). This is the DS4 report 0x01 layout, it lives with the
+// rest of the fixed layouts in hid_profile.c.
+extern const struct hid_decoder hid_decoder_legacy;
+
+// Walk the descriptor with btstack_hid_parser and build a decoder for the
+// first input report which carries any of the gamepad usages we know about.
+// Returns false if nothing usable was found.
+bool hid_decoder_compile(struct hid_decoder *dec, const uint8_t *descriptor, uint16_t descriptor_len);
+
+// Decode a report (starting with the report ID byte, if any) into dst.
+// Returns false, leaving dst untouched, if the report doesn't match.
+static inline bool hid_decoder_decode(const struct hid_decoder *dec, const uint8_t *report,
+                                      uint16_t report_len, struct bt_hid_state *dst)
+{
+	if ((report_len < dec->report_len) || (dec->report_id && (report[0] != dec->report_id))) {
+		return false;
+	}
+
+	struct bt_hid_state state = dec->base;
+	uint8_t *out = (uint8_t *)&state;
+
+	const struct hid_decoder_field *f = dec->fields;
+	const struct hid_decoder_field *end = f + dec->num_fields;
+	for ( ; f < end; f++) {
+		// When the field isn't wide, this just loads the same byte twice,
+		// and the mask throws the top half away.
+		uint16_t v = report[f->byte] | (report[f->byte + f->wide] << 8);
+		out[f->dst] |= (((v >> f->shift) & f->mask) ^ f->flip) << f->dst_shift;
+	}
+
+	*dst = state;
+	return true;
+}
+
+#endif // HID_DECODER_H
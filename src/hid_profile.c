@@ -0,0 +1,455 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btstack_util.h"
+
+#include "bt_hid.h"
+#include "hid_decoder.h"
+#include "hid_profile.h"
+
+#define VID_SONY      0x054c
+#define VID_NINTENDO  0x057e
+
+#define FIELD(_byte, _dst) { \
+	.byte = (_byte), .mask = 0xff, .dst = offsetof(struct bt_hid_state, _dst), .width = 8, \
+}
+
+#define BITS(_byte, _shift, _width, _dst, _dst_shift) { \
+	.byte = (_byte), .shift = (_shift), .mask = (1 << (_width)) - 1, \
+	.dst = offsetof(struct bt_hid_state, _dst), .dst_shift = (_dst_shift), .width = (_width), \
+}
+
+/*
+1st byte is the report ID (0x01)
+2nd byte is left joystick, side to side
+	default value is 0x80
+3rd byte is left joystick, up and down
+	default value is 0x80
+4th byte is right joystick, side to side
+	default value is 0x80
+5th byte is right joystick, up and down
+	default value is 0x80
+6th byte is the 4 face buttons and dpad.
+   default value is 0x08
+7th byte is the triggers and bumper buttons. It's also the select and start buttons.
+
+The PS5 controller's report 0x01 starts the same way.
+*/
+const struct hid_decoder hid_decoder_legacy = {
+	.report_id = 0,
+	.report_len = 7,
+	.num_fields = 6,
+	.fields = {
+		FIELD(1, lx),
+		FIELD(2, ly),
+		FIELD(3, rx),
+		FIELD(4, ry),
+		FIELD(5, buttons),
+		FIELD(6, triggers),
+	},
+};
+
+/*
+DS4 full report 0x11, sent once the controller has been asked for feature
+report 0x05. The same as the USB report 0x01, but two bytes further along:
+2nd-3rd bytes are flags we don't care about
+4th-7th bytes are the sticks, 8th-9th the buttons as in report 0x01
+10th byte is PS (bit 0), touchpad click (bit 1) and a report counter above
+11th-12th bytes are analog L2 and R2
+13th-14th bytes are a timestamp, 15th is the temperature
+16th-21st bytes are the gyro, 22nd-27th the accelerometer, int16 x, y, z each
+33rd byte is the battery level (bits 0-3) and cable (bit 4)
+38th-45th bytes are the first touchpad packet, with two touch points
+The rest is more touchpad packets and the CRC, which BTstack already checked.
+*/
+#define DS4_FULL_REPORT_ID  0x11
+#define DS4_FULL_REPORT_LEN 45
+
+static const struct hid_decoder hid_decoder_ds4_full = {
+	.report_id = DS4_FULL_REPORT_ID,
+	.report_len = DS4_FULL_REPORT_LEN,
+	.num_fields = 6,
+	.fields = {
+		FIELD(3, lx),
+		FIELD(4, ly),
+		FIELD(5, rx),
+		FIELD(6, ry),
+		FIELD(7, buttons),
+		FIELD(8, triggers),
+	},
+};
+
+/*
+Switch Pro controller, "simple" report 0x3f
+2nd byte is B, A, Y, X, L, R, ZL, ZR from bit 0
+3rd byte is -, +, left stick, right stick, home, capture from bit 0
+4th byte is the hat, same encoding as the DS4 (0x08 is centred)
+5th-12th bytes are the sticks, 16 bits little-endian each: lx, ly, rx, ry
+
+The face buttons are mapped by position, not by name, so B (bottom) is
+cross and so on.
+*/
+static const struct hid_decoder hid_decoder_switch_pro = {
+	.report_id = 0x3f,
+	.report_len = 12,
+	.num_fields = 11,
+	.fields = {
+		BITS(1, 0, 1, buttons, 5),  // B -> cross
+		BITS(1, 1, 1, buttons, 6),  // A -> circle
+		BITS(1, 2, 1, buttons, 4),  // Y -> square
+		BITS(1, 3, 1, buttons, 7),  // X -> triangle
+		BITS(1, 4, 4, triggers, 0), // L, R, ZL, ZR -> L1, R1, L2, R2
+		BITS(2, 0, 4, triggers, 4), // -, +, sticks -> share, options, L3, R3
+		BITS(3, 0, 4, buttons, 0),
+		FIELD(5, lx),
+		FIELD(7, ly),
+		FIELD(9, rx),
+		FIELD(11, ry),
+	},
+};
+
+HID_PROFILE_DECODER(hid_profile_decode_ds4_basic, hid_decoder_legacy)
+HID_PROFILE_DECODER(hid_profile_decode_ds4_full, hid_decoder_ds4_full)
+HID_PROFILE_DECODER(hid_profile_decode_switch_pro, hid_decoder_switch_pro)
+
+// The DS4 starts off sending report 0x01, and switches to 0x11 part way
+// through the connection, so this one has to handle both.
+static bool hid_profile_decode_ds4(const struct hid_decoder *decoder, const uint8_t *report, uint16_t report_len,
+                                   struct bt_hid_state *dst)
+{
+	if ((report_len > 0) && (report[0] == DS4_FULL_REPORT_ID)) {
+		return hid_profile_decode_ds4_full(decoder, report, report_len, dst);
+	}
+
+	return hid_profile_decode_ds4_basic(decoder, report, report_len, dst);
+}
+
+bool hid_profile_decode_table(const struct hid_decoder *decoder, const uint8_t *report, uint16_t report_len,
+                              struct bt_hid_state *dst)
+{
+	return hid_decoder_decode(decoder, report, report_len, dst);
+}
+
+static void hid_profile_decode_touch(const uint8_t *src, struct bt_hid_touch *dst)
+{
+	dst->active = !(src[0] & 0x80);
+	dst->id = src[0] & 0x7f;
+	dst->x = src[1] | ((src[2] & 0xf) << 8);
+	dst->y = (src[2] >> 4) | (src[3] << 4);
+}
+
+static void hid_profile_decode_ext_ds4(const uint8_t *report, uint16_t report_len, struct bt_hid_ext_state *dst)
+{
+	if ((report_len < DS4_FULL_REPORT_LEN) || (report[0] != DS4_FULL_REPORT_ID)) {
+		dst->valid = 0;
+		return;
+	}
+
+	dst->valid = 1;
+	dst->extra = report[9] & 0x3;
+	dst->counter = report[9] >> 2;
+	dst->l2 = report[10];
+	dst->r2 = report[11];
+	dst->timestamp = little_endian_read_16(report, 12);
+	dst->temperature = report[14];
+	for (int i = 0; i < 3; i++) {
+		dst->gyro[i] = (int16_t)little_endian_read_16(report, 15 + i * 2);
+		dst->accel[i] = (int16_t)little_endian_read_16(report, 21 + i * 2);
+	}
+	dst->battery = report[32] & 0xf;
+	dst->cable = (report[32] >> 4) & 1;
+	hid_profile_decode_touch(&report[37], &dst->touch[0]);
+	hid_profile_decode_touch(&report[41], &dst->touch[1]);
+}
+
+void hid_profile_decode_ext_none(const uint8_t *report, uint16_t report_len, struct bt_hid_ext_state *dst)
+{
+	(void)report;
+	(void)report_len;
+
+	dst->valid = 0;
+}
+
+/*
+DS4 Bluetooth output report 0x11:
+1st byte is the report ID (0x11)
+2nd byte: 0x80 (HID) | 0x40 (CRC32), low bits are the report interval, 0 for
+	as fast as it likes
+4th byte says which of the rest to apply: rumble, lightbar, lightbar flash
+7th-8th bytes are the weak and strong rumble
+9th-11th bytes are the lightbar colour
+12th-13th bytes are the flash on and off times
+Then zeros, and the last 4 bytes are a CRC32 of the HIDP header followed by
+everything before it. The controller ignores the report if it's wrong.
+*/
+#define DS4_OUTPUT_REPORT_ID   0x11
+#define DS4_OUTPUT_REPORT_LEN  78
+#define DS4_OUTPUT_HID         0x80
+#define DS4_OUTPUT_CRC32       0x40
+#define DS4_OUTPUT_RUMBLE      0x01
+#define DS4_OUTPUT_LIGHTBAR    0x02
+#define DS4_OUTPUT_FLASH       0x04
+#define DS4_OUTPUT_HIDP_HEADER 0xa2 // DATA | OUTPUT
+
+_Static_assert(DS4_OUTPUT_REPORT_LEN <= HID_PROFILE_MAX_OUTPUT_LEN, "DS4 output report doesn't fit");
+
+// CRC-32 (zlib's), a nibble at a time to keep the table small. It's only
+// run when the output changes.
+static uint32_t hid_profile_crc32(uint32_t crc, const uint8_t *data, uint16_t len)
+{
+	static const uint32_t table[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+	};
+
+	for (uint16_t i = 0; i < len; i++) {
+		crc ^= data[i];
+		crc = (crc >> 4) ^ table[crc & 0xf];
+		crc = (crc >> 4) ^ table[crc & 0xf];
+	}
+
+	return crc;
+}
+
+static uint16_t hid_profile_encode_output_ds4(const struct bt_hid_output *output, uint8_t *dst)
+{
+	const uint8_t header = DS4_OUTPUT_HIDP_HEADER;
+
+	memset(dst, 0, DS4_OUTPUT_REPORT_LEN);
+	dst[0] = DS4_OUTPUT_REPORT_ID;
+	dst[1] = DS4_OUTPUT_HID | DS4_OUTPUT_CRC32;
+	dst[3] = DS4_OUTPUT_RUMBLE | DS4_OUTPUT_LIGHTBAR | DS4_OUTPUT_FLASH;
+	dst[6] = output->rumble_weak;
+	dst[7] = output->rumble_strong;
+	dst[8] = output->red;
+	dst[9] = output->green;
+	dst[10] = output->blue;
+	dst[11] = output->flash_on;
+	dst[12] = output->flash_off;
+
+	uint32_t crc = hid_profile_crc32(0xffffffff, &header, 1);
+	crc = ~hid_profile_crc32(crc, dst, DS4_OUTPUT_REPORT_LEN - 4);
+	little_endian_store_32(dst, DS4_OUTPUT_REPORT_LEN - 4, crc);
+
+	return DS4_OUTPUT_REPORT_LEN;
+}
+
+uint16_t hid_profile_encode_output_none(const struct bt_hid_output *output, uint8_t *dst)
+{
+	(void)output;
+	(void)dst;
+
+	return 0;
+}
+
+/*
+DS4 Bluetooth feature report 0x05, the IMU calibration. All little-endian
+int16s, starting from the 2nd byte:
+	gyro bias: pitch, yaw, roll
+	gyro readings at +/- the reference speed: pitch+, yaw+, roll+, then
+		pitch-, yaw-, roll- (over USB they're interleaved instead)
+	the reference speed, in deg/s: +, -
+	accelerometer readings at +/- 1 g: x+, x-, y+, y-, z+, z-
+The last 4 bytes are a CRC32 of the HIDP header followed by everything
+before it, like the output report.
+*/
+#define DS4_CALIBRATION_REPORT_ID   0x05
+#define DS4_CALIBRATION_REPORT_LEN  41
+#define DS4_CALIBRATION_HIDP_HEADER 0xa3 // DATA | FEATURE
+
+// Mostly what the raw readings already are, but in known units
+#define DS4_GYRO_PER_DEG_S BT_HID_GYRO_PER_DEG_S
+#define DS4_ACCEL_PER_G    BT_HID_ACCEL_PER_G
+
+// The biggest shift which keeps numer / denom under 2^15, for as much
+// precision as fits. Only run once per calibration report.
+static bool hid_profile_calibrate_axis(struct hid_imu_calibration *dst, int axis,
+                                       int32_t bias, int32_t numer, int32_t denom)
+{
+	if ((numer <= 0) || (denom <= 0) || (bias < INT16_MIN) || (bias > INT16_MAX)) {
+		return false;
+	}
+
+	int shift = 24;
+	int64_t mult;
+	while (((mult = ((int64_t)numer << shift) / denom) > INT16_MAX) && shift) {
+		shift--;
+	}
+	if (!mult || (mult > INT16_MAX)) {
+		return false;
+	}
+
+	dst->bias[axis] = bias;
+	dst->mult[axis] = mult;
+	dst->shift[axis] = shift;
+	return true;
+}
+
+// The nth int16 after the report ID
+static int32_t ds4_calibration_read(const uint8_t *report, int n)
+{
+	return (int16_t)little_endian_read_16(report, 1 + n * 2);
+}
+
+static bool hid_profile_parse_calibration_ds4(const uint8_t *report, uint16_t report_len,
+                                              struct hid_imu_calibration *dst)
+{
+	const uint8_t header = DS4_CALIBRATION_HIDP_HEADER;
+
+	if ((report_len < DS4_CALIBRATION_REPORT_LEN) || (report[0] != DS4_CALIBRATION_REPORT_ID)) {
+		return false;
+	}
+
+	uint32_t crc = hid_profile_crc32(0xffffffff, &header, 1);
+	crc = ~hid_profile_crc32(crc, report, DS4_CALIBRATION_REPORT_LEN - 4);
+	if (crc != little_endian_read_32(report, DS4_CALIBRATION_REPORT_LEN - 4)) {
+		return false;
+	}
+
+	int32_t speed_2x = ds4_calibration_read(report, 9) + ds4_calibration_read(report, 10);
+	bool ok = true;
+
+	for (int i = 0; i < 3; i++) {
+		int32_t bias = ds4_calibration_read(report, i);
+		int32_t plus = ds4_calibration_read(report, 3 + i);
+		int32_t minus = ds4_calibration_read(report, 6 + i);
+		ok = ok && hid_profile_calibrate_axis(dst, i, bias, speed_2x * DS4_GYRO_PER_DEG_S, plus - minus);
+	}
+
+	for (int i = 0; i < 3; i++) {
+		int32_t plus = ds4_calibration_read(report, 11 + i * 2);
+		int32_t minus = ds4_calibration_read(report, 12 + i * 2);
+		int32_t range_2g = plus - minus;
+		ok = ok && hid_profile_calibrate_axis(dst, 3 + i, plus - range_2g / 2, 2 * DS4_ACCEL_PER_G, range_2g);
+	}
+
+	return ok;
+}
+
+bool hid_profile_parse_calibration_none(const uint8_t *report, uint16_t report_len, struct hid_imu_calibration *dst)
+{
+	(void)report;
+	(void)report_len;
+	(void)dst;
+
+	return false;
+}
+
+static inline int16_t hid_profile_calibrate(const struct hid_imu_calibration *cal, int axis, int16_t raw)
+{
+	int32_t v = ((int32_t)(raw - cal->bias[axis]) * cal->mult[axis]) >> cal->shift[axis];
+
+	return v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : v);
+}
+
+void hid_profile_apply_calibration(const struct hid_imu_calibration *cal, struct bt_hid_ext_state *dst)
+{
+	for (int i = 0; i < 3; i++) {
+		dst->gyro[i] = hid_profile_calibrate(cal, i, dst->gyro[i]);
+		dst->accel[i] = hid_profile_calibrate(cal, 3 + i, dst->accel[i]);
+	}
+	dst->calibrated = 1;
+}
+
+const struct hid_profile hid_profile_default = {
+	.name = "DS4 (default)",
+	.protocol_mode = HID_PROTOCOL_MODE_BOOT,
+	.decoder = &hid_decoder_legacy,
+	.decode = hid_profile_decode_ds4,
+	.decode_ext = hid_profile_decode_ext_ds4,
+	.encode_output = hid_profile_encode_output_ds4,
+	.parse_calibration = hid_profile_parse_calibration_ds4,
+};
+
+static const struct hid_profile hid_profiles[] = {
+	{
+		.name = "DS4",
+		.vendor_id = VID_SONY,
+		.product_id = 0x05c4,
+		.protocol_mode = HID_PROTOCOL_MODE_BOOT,
+		.decoder = &hid_decoder_legacy,
+		.decode = hid_profile_decode_ds4,
+		.decode_ext = hid_profile_decode_ext_ds4,
+		.encode_output = hid_profile_encode_output_ds4,
+		.parse_calibration = hid_profile_parse_calibration_ds4,
+	},
+	{
+		.name = "DS4 v2",
+		.vendor_id = VID_SONY,
+		.product_id = 0x09cc,
+		.protocol_mode = HID_PROTOCOL_MODE_BOOT,
+		.decoder = &hid_decoder_legacy,
+		.decode = hid_profile_decode_ds4,
+		.decode_ext = hid_profile_decode_ext_ds4,
+		.encode_output = hid_profile_encode_output_ds4,
+		.parse_calibration = hid_profile_parse_calibration_ds4,
+	},
+	{
+		.name = "DualSense",
+		.vendor_id = VID_SONY,
+		.product_id = 0x0ce6,
+		.protocol_mode = HID_PROTOCOL_MODE_BOOT,
+		.decoder = &hid_decoder_legacy,
+		.decode = hid_profile_decode_ds4,
+		.decode_ext = hid_profile_decode_ext_none,
+		.encode_output = hid_profile_encode_output_none,
+		.parse_calibration = hid_profile_parse_calibration_none,
+	},
+	{
+		.name = "Switch Pro",
+		.vendor_id = VID_NINTENDO,
+		.product_id = 0x2009,
+		.protocol_mode = HID_PROTOCOL_MODE_REPORT,
+		.decoder = &hid_decoder_switch_pro,
+		.decode = hid_profile_decode_switch_pro,
+		.decode_ext = hid_profile_decode_ext_none,
+		.encode_output = hid_profile_encode_output_none,
+		.parse_calibration = hid_profile_parse_calibration_none,
+		// Report 0x3f is only sent when the input changes
+		.reports_on_change = true,
+	},
+	// Clones which don't have a proper Device ID record go here, matched by
+	// the descriptor hash printed when they connect.
+};
+
+#define NUM_PROFILES (sizeof(hid_profiles) / sizeof(hid_profiles[0]))
+
+const struct hid_profile *hid_profile_find_device_id(uint16_t vendor_id, uint16_t product_id)
+{
+	for (unsigned int i = 0; i < NUM_PROFILES; i++) {
+		const struct hid_profile *p = &hid_profiles[i];
+		if (p->vendor_id && (p->vendor_id == vendor_id) && (p->product_id == product_id)) {
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+const struct hid_profile *hid_profile_find_descriptor(uint32_t descriptor_hash)
+{
+	for (unsigned int i = 0; i < NUM_PROFILES; i++) {
+		const struct hid_profile *p = &hid_profiles[i];
+		if (p->descriptor_hash && (p->descriptor_hash == descriptor_hash)) {
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+uint32_t hid_profile_hash(const uint8_t *descriptor, uint16_t descriptor_len)
+{
+	uint32_t hash = 0x811c9dc5;
+
+	for (uint16_t i = 0; i < descriptor_len; i++) {
+		hash ^= descriptor[i];
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef HID_PROFILE_H
+#define HID_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "btstack_hid.h"
+
+#include "bt_hid.h"
+#include "hid_decoder.h"
+
+// decoder is the table in use for this controller: the profile's own, or one
+// compiled from the descriptor. Decoders with a fixed table ignore it.
+typedef bool (*hid_profile_decode_t)(const struct hid_decoder *decoder, const uint8_t *report, uint16_t report_len,
+                                     struct bt_hid_state *dst);
+typedef void (*hid_profile_decode_ext_t)(const uint8_t *report, uint16_t report_len, struct bt_hid_ext_state *dst);
+
+// Big enough for any output report, including the report ID
+#define HID_PROFILE_MAX_OUTPUT_LEN 78
+
+// Builds the output report into dst (HID_PROFILE_MAX_OUTPUT_LEN bytes),
+// starting with the report ID. Returns its length, 0 if there isn't one.
+typedef uint16_t (*hid_profile_encode_output_t)(const struct bt_hid_output *output, uint8_t *dst);
+
+// Gyro and accelerometer calibration, gyro[0-2] then accel[0-2]. Each axis
+// is a bias and a fixed-point multiplier, worked out once from the
+// controller's calibration report:
+//   out = ((raw - bias) * mult) >> shift
+// mult is kept below 2^15, so that never overflows 32 bits.
+struct hid_imu_calibration {
+	int16_t bias[6];
+	int16_t mult[6];
+	uint8_t shift[6];
+};
+
+// Parses the feature report asked for with GET_REPORT once the descriptor
+// is known, starting with the report ID. Returns false if it isn't a
+// calibration report this profile understands, or doesn't make sense.
+typedef bool (*hid_profile_parse_calibration_t)(const uint8_t *report, uint16_t report_len,
+                                                struct hid_imu_calibration *dst);
+
+// Everything we need to know to talk to one kind of controller. Once a
+// profile has been picked, each report is an indirect call to its decode
+// functions, with no further checks on which controller it is.
+struct hid_profile {
+	const char *name;
+
+	// Matched against the SDP Device ID record. 0 means "don't match".
+	uint16_t vendor_id;
+	uint16_t product_id;
+
+	// Matched against hid_profile_hash() of the HID descriptor, for
+	// controllers which don't have a useful Device ID. 0 means "don't match".
+	uint32_t descriptor_hash;
+
+	// The protocol the controller should be switched to once it's
+	// identified.
+	hid_protocol_mode_t protocol_mode;
+
+	// The table decode() was built from, for reference and for checking.
+	// NULL if the table is compiled separately for each controller.
+	const struct hid_decoder *decoder;
+	hid_profile_decode_t decode;
+
+	// Called after decode() succeeds, to fill in the extended state. Never
+	// NULL, use hid_profile_decode_ext_none() if there's nothing to decode.
+	hid_profile_decode_ext_t decode_ext;
+
+	// Rumble and lightbar. Never NULL, use hid_profile_encode_output_none()
+	// if the controller doesn't have them.
+	hid_profile_encode_output_t encode_output;
+
+	// IMU calibration. Never NULL, use hid_profile_parse_calibration_none()
+	// if the controller doesn't have one.
+	hid_profile_parse_calibration_t parse_calibration;
+
+	// The controller only sends a report when something changes, so going
+	// quiet doesn't mean it's stopped responding. The stale input watchdog
+	// leaves these alone, a lost link still shows up as a disconnect.
+	bool reports_on_change;
+};
+
+// Used until something better is known. The DS4 report 0x01 layout, which
+// is also what all the DS4 clones send.
+extern const struct hid_profile hid_profile_default;
+
+// Decode with whichever table is passed in, for decoders compiled at runtime
+bool hid_profile_decode_table(const struct hid_decoder *decoder, const uint8_t *report, uint16_t report_len,
+                              struct bt_hid_state *dst);
+
+// Just clears dst->valid
+void hid_profile_decode_ext_none(const uint8_t *report, uint16_t report_len, struct bt_hid_ext_state *dst);
+
+// Returns 0, there's no output report
+uint16_t hid_profile_encode_output_none(const struct bt_hid_output *output, uint8_t *dst);
+
+// Returns false, there's no calibration
+bool hid_profile_parse_calibration_none(const uint8_t *report, uint16_t report_len, struct hid_imu_calibration *dst);
+
+// Calibrate dst's gyro and accel in place, and set dst->calibrated
+void hid_profile_apply_calibration(const struct hid_imu_calibration *cal, struct bt_hid_ext_state *dst);
+
+// Find the profile for a Device ID, or NULL if there isn't one
+const struct hid_profile *hid_profile_find_device_id(uint16_t vendor_id, uint16_t product_id);
+
+// Find the profile for a HID descriptor by its hash, or NULL
+const struct hid_profile *hid_profile_find_descriptor(uint32_t descriptor_hash);
+
+// 32-bit FNV-1a hash of a HID descriptor. Printed on connection, so that new
+// controllers can be added to the table.
+uint32_t hid_profile_hash(const uint8_t *descriptor, uint16_t descriptor_len);
+
+// Build a decode function with a fixed table. With the table known at
+// compile time, the compiler can unroll the field loop and fold all the
+// shifts and masks into immediates.
+#define HID_PROFILE_DECODER(_name, _decoder)                                                       \
+	static bool _name(const struct hid_decoder *decoder, const uint8_t *report, uint16_t report_len, \
+	                  struct bt_hid_state *dst)                                                \
+	{                                                                                          \
+		(void)decoder;                                                                     \
+		return hid_decoder_decode(&(_decoder), report, report_len, dst);                   \
+	}
+
+#endif // HID_PROFILE_H
@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "btstack_tlv.h"
+#include "btstack_util.h"
+
+#include "hid_cache.h"
+#include "hid_registry.h"
+
+#define HID_REGISTRY_TAG (((uint32_t)'H' << 24) | ((uint32_t)'R' << 16) | ((uint32_t)'E' << 8) | 'G')
+
+// Class of Device: major class "peripheral", minor class gamepad or joystick
+#define COD_MAJOR_MASK       0x1f00
+#define COD_MAJOR_PERIPHERAL 0x0500
+#define COD_MINOR_MASK       0x003c
+#define COD_MINOR_JOYSTICK   0x0004
+#define COD_MINOR_GAMEPAD    0x0008
+
+// Kept sorted by last_seen, most recent first
+static struct {
+	uint32_t count;
+	struct hid_registry_device devices[HID_REGISTRY_MAX_DEVICES];
+} registry;
+
+static uint32_t registry_clock;
+
+static void hid_registry_save(void)
+{
+	const btstack_tlv_t *tlv;
+	void *context;
+
+	btstack_tlv_get_instance(&tlv, &context);
+	if (!tlv) {
+		return;
+	}
+
+	tlv->store_tag(context, HID_REGISTRY_TAG, (const uint8_t *)&registry,
+	               sizeof(registry.count) + registry.count * sizeof(registry.devices[0]));
+}
+
+static int hid_registry_find(const bd_addr_t addr)
+{
+	for (unsigned int i = 0; i < registry.count; i++) {
+		if (bd_addr_cmp(registry.devices[i].addr, addr) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void hid_registry_init(void)
+{
+	const btstack_tlv_t *tlv;
+	void *context;
+
+	memset(&registry, 0, sizeof(registry));
+	registry_clock = 0;
+
+	btstack_tlv_get_instance(&tlv, &context);
+	if (!tlv) {
+		return;
+	}
+
+	int len = tlv->get_tag(context, HID_REGISTRY_TAG, (uint8_t *)&registry, sizeof(registry));
+	if ((len < (int)sizeof(registry.count)) || (registry.count > HID_REGISTRY_MAX_DEVICES) ||
+	    (len != (int)(sizeof(registry.count) + registry.count * sizeof(registry.devices[0])))) {
+		registry.count = 0;
+		return;
+	}
+
+	// The list is sorted, so the first one is the newest
+	if (registry.count) {
+		registry_clock = registry.devices[0].last_seen;
+	}
+}
+
+unsigned int hid_registry_count(void)
+{
+	return registry.count;
+}
+
+const struct hid_registry_device *hid_registry_get(unsigned int idx)
+{
+	return idx < registry.count ? &registry.devices[idx] : NULL;
+}
+
+void hid_registry_seen(const bd_addr_t addr, uint32_t class_of_device)
+{
+	struct hid_registry_device device = { 0 };
+
+	int idx = hid_registry_find(addr);
+	if (idx >= 0) {
+		device = registry.devices[idx];
+	} else {
+		// Not known, so make room (possibly dropping the oldest, and its
+		// cache entries with it)
+		bd_addr_copy(device.addr, addr);
+		if (registry.count < HID_REGISTRY_MAX_DEVICES) {
+			idx = registry.count++;
+		} else {
+			idx = HID_REGISTRY_MAX_DEVICES - 1;
+			hid_cache_forget(registry.devices[idx].addr);
+		}
+	}
+
+	if (class_of_device) {
+		device.class_of_device = class_of_device;
+	}
+
+	// Reconnecting to the most recent one again changes nothing that
+	// matters, so don't wear out the flash for it
+	if ((idx == 0) && device.last_seen && !memcmp(&device, &registry.devices[0], sizeof(device))) {
+		return;
+	}
+
+	device.last_seen = ++registry_clock;
+
+	// Shuffle everything newer down one, and put it at the front
+	memmove(&registry.devices[1], &registry.devices[0], idx * sizeof(registry.devices[0]));
+	registry.devices[0] = device;
+
+	hid_registry_save();
+}
+
+void hid_registry_add(const bd_addr_t addr)
+{
+	if ((hid_registry_find(addr) >= 0) || (registry.count == HID_REGISTRY_MAX_DEVICES)) {
+		return;
+	}
+
+	// Never seen, so it goes at the end
+	struct hid_registry_device *device = &registry.devices[registry.count++];
+	memset(device, 0, sizeof(*device));
+	bd_addr_copy(device->addr, addr);
+}
+
+bool hid_registry_is_gamepad(uint32_t class_of_device)
+{
+	uint32_t minor = class_of_device & COD_MINOR_MASK;
+
+	return ((class_of_device & COD_MAJOR_MASK) == COD_MAJOR_PERIPHERAL) &&
+	       ((minor == COD_MINOR_GAMEPAD) || (minor == COD_MINOR_JOYSTICK));
+}
+
+bool hid_registry_is_hid(uint32_t class_of_device)
+{
+	return (class_of_device & COD_MAJOR_MASK) == COD_MAJOR_PERIPHERAL;
+}
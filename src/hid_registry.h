@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef HID_REGISTRY_H
+#define HID_REGISTRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bluetooth.h"
+
+// The controllers we know about, kept in the BTstack TLV so they survive a
+// reboot. Link keys aren't stored here, BTstack's link key DB already has
+// those. Only call these on the BT core, after the stack is up.
+
+#define HID_REGISTRY_MAX_DEVICES 8
+
+struct hid_registry_device {
+	bd_addr_t addr;
+	uint32_t class_of_device; // 0 if we've never seen it in an inquiry
+	// There's no real-time clock, so this is a counter which goes up every
+	// time any controller connects. Bigger is more recent, 0 is never.
+	uint32_t last_seen;
+};
+
+// Load the registry from flash
+void hid_registry_init(void);
+
+unsigned int hid_registry_count(void);
+
+// Most recently seen first
+const struct hid_registry_device *hid_registry_get(unsigned int idx);
+
+// Note that addr just connected, adding it if it's new and dropping the
+// least recently seen device (and whatever hid_cache has for it) if there's
+// no room. cod can be 0 if unknown.
+// Only written to flash if that changes the order or the Class of Device.
+void hid_registry_seen(const bd_addr_t addr, uint32_t class_of_device);
+
+// Add addr as never seen, if it isn't already known. Not written to flash
+// until something is seen.
+void hid_registry_add(const bd_addr_t addr);
+
+// Whether a Class of Device is a gamepad or joystick
+bool hid_registry_is_gamepad(uint32_t class_of_device);
+
+// Whether a Class of Device is any kind of HID peripheral, which includes
+// controllers that don't say they're gamepads
+bool hid_registry_is_hid(uint32_t class_of_device);
+
+#endif // HID_REGISTRY_H
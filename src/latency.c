@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include "latency.h"
+
+#if LATENCY_STATS
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+
+#include "btstack.h"
+#include "hci_dump.h"
+
+struct latency_hist {
+	uint32_t count;
+	uint32_t max;
+	uint32_t buckets[LATENCY_HIST_BUCKETS];
+};
+
+static const char *const stage_names[LATENCY_NUM_STAGES] = {
+	[LATENCY_RX_TO_DISPATCH]     = "rx -> dispatch",
+	[LATENCY_DISPATCH_TO_DECODE] = "dispatch -> decode",
+	[LATENCY_DECODE_TO_CONSUME]  = "decode -> consume",
+	[LATENCY_RX_TO_CONSUME]      = "rx -> consume",
+};
+
+static const char *const link_mode_names[LATENCY_NUM_LINK_MODES] = {
+	[LATENCY_LINK_ACTIVE] = "interval (active)",
+	[LATENCY_LINK_HOLD]   = "interval (hold)",
+	[LATENCY_LINK_SNIFF]  = "interval (sniff)",
+};
+
+// Each histogram only has one writer: the first two are updated on the BT
+// core, the last two on the app core.
+static struct latency_hist hists[LATENCY_NUM_STAGES];
+
+// Time between reports from the same controller, by link mode. Only touched
+// on the BT core.
+static struct latency_hist interval_hists[LATENCY_NUM_LINK_MODES];
+static uint32_t last_report_us[BT_HID_MAX_CONTROLLERS];
+static bool last_report_valid[BT_HID_MAX_CONTROLLERS];
+
+// Only touched on the BT core
+static uint32_t points[LATENCY_NUM_POINTS];
+
+static void latency_hist_add(struct latency_hist *hist, uint32_t us)
+{
+	unsigned int bucket = us ? 32 - __builtin_clz(us) : 0;
+	if (bucket >= LATENCY_HIST_BUCKETS) {
+		bucket = LATENCY_HIST_BUCKETS - 1;
+	}
+
+	hist->buckets[bucket]++;
+	hist->count++;
+	if (us > hist->max) {
+		hist->max = us;
+	}
+}
+
+// Upper bound of the bucket holding the given percentile
+static uint32_t latency_hist_percentile(const struct latency_hist *hist, uint32_t percent)
+{
+	uint32_t target = (hist->count * percent + 99) / 100;
+	uint32_t seen = 0;
+
+	for (int i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target) {
+			return i ? (1u << i) - 1 : 0;
+		}
+	}
+
+	return hist->max;
+}
+
+void latency_mark_at(enum latency_point point, uint32_t time_us)
+{
+	points[point] = time_us;
+
+	// The previous point is still from this same report, because everything
+	// from transport to decode happens in one pass through the run loop.
+	if (point != LATENCY_RX) {
+		latency_hist_add(&hists[point - 1], time_us - points[point - 1]);
+	}
+}
+
+uint32_t latency_mark(enum latency_point point)
+{
+	uint32_t now = time_us_32();
+	latency_mark_at(point, now);
+	return now;
+}
+
+uint32_t latency_rx_time(void)
+{
+	return points[LATENCY_RX];
+}
+
+void latency_consumed(const struct bt_hid_report *report)
+{
+	uint32_t now = time_us_32();
+
+	latency_hist_add(&hists[LATENCY_DECODE_TO_CONSUME], now - report->time_us);
+	latency_hist_add(&hists[LATENCY_RX_TO_CONSUME], now - report->rx_us);
+}
+
+void latency_report_interval(unsigned int idx, uint8_t link_mode, uint32_t time_us)
+{
+	if (link_mode >= LATENCY_NUM_LINK_MODES) {
+		return;
+	}
+
+	if (last_report_valid[idx]) {
+		latency_hist_add(&interval_hists[link_mode], time_us - last_report_us[idx]);
+	}
+
+	last_report_us[idx] = time_us;
+	last_report_valid[idx] = true;
+}
+
+void latency_interval_reset(unsigned int idx)
+{
+	last_report_valid[idx] = false;
+}
+
+static void latency_hist_print(const char *name, const struct latency_hist *src)
+{
+	// Copy it, so the numbers at least add up if it's being updated
+	struct latency_hist hist = *src;
+
+	printf("%s: count %" PRIu32 ", p50 <= %" PRIu32 " us, p99 <= %" PRIu32 " us, max %" PRIu32 " us\n", name,
+	       hist.count, latency_hist_percentile(&hist, 50),
+	       latency_hist_percentile(&hist, 99), hist.max);
+
+	for (int b = 0; b < LATENCY_HIST_BUCKETS; b++) {
+		if (hist.buckets[b]) {
+			printf("  < %7" PRIu32 " us: %" PRIu32 "\n", (uint32_t)1 << b, hist.buckets[b]);
+		}
+	}
+}
+
+void latency_dump(void)
+{
+	for (int i = 0; i < LATENCY_NUM_STAGES; i++) {
+		latency_hist_print(stage_names[i], &hists[i]);
+	}
+
+	for (int i = 0; i < LATENCY_NUM_LINK_MODES; i++) {
+		if (interval_hists[i].count) {
+			latency_hist_print(link_mode_names[i], &interval_hists[i]);
+		}
+	}
+}
+
+// We hook in to BTstack's HCI dump, because it sees every packet as soon
+// as the cyw43 transport hands it over, before any processing.
+static void latency_log_packet(uint8_t packet_type, uint8_t in, uint8_t *packet, uint16_t len)
+{
+	(void)packet;
+	(void)len;
+
+	if (in && (packet_type == HCI_ACL_DATA_PACKET)) {
+		latency_mark(LATENCY_RX);
+	}
+}
+
+static void latency_log_message(int log_level, const char *format, va_list argptr)
+{
+	(void)log_level;
+	(void)format;
+	(void)argptr;
+}
+
+static const hci_dump_t latency_dump_impl = {
+	.log_packet = latency_log_packet,
+	.log_message = latency_log_message,
+};
+
+void latency_init(void)
+{
+	hci_dump_init(&latency_dump_impl);
+
+	// We don't want the log messages, so don't pay for them
+	hci_dump_enable_log_level(HCI_DUMP_LOG_LEVEL_DEBUG, 0);
+	hci_dump_enable_log_level(HCI_DUMP_LOG_LEVEL_INFO, 0);
+	hci_dump_enable_log_level(HCI_DUMP_LOG_LEVEL_ERROR, 0);
+}
+
+#endif // LATENCY_STATS
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+#include "bt_hid.h"
+
+// Set to 1 to collect input latency histograms. When 0, all of this
+// compiles away to nothing.
+#ifndef LATENCY_STATS
+#define LATENCY_STATS 0
+#endif
+
+// Points in the report path, in the order a report passes through them
+enum latency_point {
+	LATENCY_RX,        // ACL packet handed to the host stack by the transport
+	LATENCY_DISPATCH,  // HID_SUBEVENT_REPORT reaches our packet_handler
+	LATENCY_DECODE,    // Report decoded and queued for the app
+	LATENCY_NUM_POINTS,
+};
+
+// Each histogram measures the time between two points
+enum latency_stage {
+	LATENCY_RX_TO_DISPATCH,
+	LATENCY_DISPATCH_TO_DECODE,
+	LATENCY_DECODE_TO_CONSUME,
+	LATENCY_RX_TO_CONSUME,
+	LATENCY_NUM_STAGES,
+};
+
+// Link modes, as reported in HCI_EVENT_MODE_CHANGE. The time between
+// reports is tracked separately for each.
+enum latency_link_mode {
+	LATENCY_LINK_ACTIVE,
+	LATENCY_LINK_HOLD,
+	LATENCY_LINK_SNIFF,
+	LATENCY_NUM_LINK_MODES,
+};
+
+// Bucket n counts samples in [2^(n-1), 2^n) us, bucket 0 is exactly 0 us.
+// The last one also takes anything bigger.
+#define LATENCY_HIST_BUCKETS 20
+
+#if LATENCY_STATS
+
+// Start collecting. Must be called on the BT core, after cyw43_arch_init().
+void latency_init(void);
+
+// Note the time a report passes a point on the BT core. Returns the time.
+uint32_t latency_mark(enum latency_point point);
+
+// Same, but with a time the caller already has
+void latency_mark_at(enum latency_point point, uint32_t time_us);
+
+// Time the report passed LATENCY_RX
+uint32_t latency_rx_time(void);
+
+// Note the app has consumed a report. Call from the app core.
+void latency_consumed(const struct bt_hid_report *report);
+
+// Note a report arrived from controller idx at time_us, while its link was
+// in link_mode, to track the time between reports. Call on the BT core.
+void latency_report_interval(unsigned int idx, uint8_t link_mode, uint32_t time_us);
+
+// Controller idx (re)connected, forget its last report time
+void latency_interval_reset(unsigned int idx);
+
+// Print all the histograms to stdio
+void latency_dump(void);
+
+#else
+
+static inline void latency_init(void) { }
+static inline uint32_t latency_mark(enum latency_point point) { (void)point; return 0; }
+static inline void latency_mark_at(enum latency_point point, uint32_t time_us) { (void)point; (void)time_us; }
+static inline void latency_consumed(const struct bt_hid_report *report) { (void)report; }
+static inline void latency_report_interval(unsigned int idx, uint8_t link_mode, uint32_t time_us) { (void)idx; (void)link_mode; (void)time_us; }
+static inline void latency_interval_reset(unsigned int idx) { (void)idx; }
+static inline void latency_dump(void) { }
+
+#endif // LATENCY_STATS
+
+#endif // LATENCY_H
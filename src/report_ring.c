@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <string.h>
+
+#include "hardware/sync.h"
+
+#include "report_ring.h"
+
+#define REPORT_RING_MASK (REPORT_RING_DEPTH - 1)
+
+void report_ring_init(struct report_ring *ring)
+{
+	memset(ring, 0, sizeof(*ring));
+}
+
+bool report_ring_write(struct report_ring *ring, const struct bt_hid_report *report)
+{
+	uint32_t head = ring->head;
+	uint32_t used = head - ring->tail;
+
+	if (used >= REPORT_RING_DEPTH) {
+#if !REPORT_RING_OVERWRITE
+		ring->dropped = ring->dropped + 1;
+		return false;
+#endif
+		used = REPORT_RING_DEPTH - 1;
+	}
+
+	if (used + 1 > ring->high_water) {
+		ring->high_water = used + 1;
+	}
+
+	struct report_ring_slot *slot = &ring->slots[head & REPORT_RING_MASK];
+	slot->seq = 0;
+	__mem_fence_release();
+	memcpy(&slot->report, report, sizeof(slot->report));
+	__mem_fence_release();
+	slot->seq = head + 1;
+	__mem_fence_release();
+	ring->head = head + 1;
+
+	return true;
+}
+
+unsigned report_ring_read(struct report_ring *ring, struct bt_hid_report *dst, unsigned max)
+{
+	uint32_t tail = ring->tail;
+	unsigned n = 0;
+
+	while (n < max) {
+		uint32_t head = ring->head;
+		__mem_fence_acquire();
+
+		if (tail == head) {
+			break;
+		}
+
+		// Only possible with REPORT_RING_OVERWRITE, skip what we've lost
+		if (head - tail > REPORT_RING_DEPTH) {
+			ring->overrun = ring->overrun + (head - tail - REPORT_RING_DEPTH);
+			tail = head - REPORT_RING_DEPTH;
+		}
+
+		const struct report_ring_slot *slot = &ring->slots[tail & REPORT_RING_MASK];
+		uint32_t seq = slot->seq;
+		__mem_fence_acquire();
+		memcpy(&dst[n], &slot->report, sizeof(dst[n]));
+		__mem_fence_acquire();
+
+		if ((seq == tail + 1) && (slot->seq == seq)) {
+			n++;
+		} else {
+			// The producer lapped us while we were copying
+			ring->overrun = ring->overrun + 1;
+		}
+		tail++;
+	}
+
+	__mem_fence_release();
+	ring->tail = tail;
+
+	return n;
+}
+
+const struct bt_hid_report *report_ring_peek(struct report_ring *ring)
+{
+	uint32_t tail = ring->tail;
+
+	for ( ;; ) {
+		uint32_t head = ring->head;
+		__mem_fence_acquire();
+
+		if (tail == head) {
+			break;
+		}
+
+		if (head - tail > REPORT_RING_DEPTH) {
+			ring->overrun = ring->overrun + (head - tail - REPORT_RING_DEPTH);
+			tail = head - REPORT_RING_DEPTH;
+		}
+
+		const struct report_ring_slot *slot = &ring->slots[tail & REPORT_RING_MASK];
+		uint32_t seq = slot->seq;
+		__mem_fence_acquire();
+
+		if (seq == tail + 1) {
+			__mem_fence_release();
+			ring->tail = tail;
+			return &slot->report;
+		}
+
+		// Lapped, and being rewritten right now
+		ring->overrun = ring->overrun + 1;
+		tail++;
+	}
+
+	__mem_fence_release();
+	ring->tail = tail;
+
+	return NULL;
+}
+
+bool report_ring_release(struct report_ring *ring)
+{
+	uint32_t tail = ring->tail;
+	const struct report_ring_slot *slot = &ring->slots[tail & REPORT_RING_MASK];
+
+	// Make sure everything read from the slot happened before this check
+	__mem_fence_acquire();
+	bool ok = slot->seq == tail + 1;
+	if (!ok) {
+		ring->overrun = ring->overrun + 1;
+	}
+
+	__mem_fence_release();
+	ring->tail = tail + 1;
+
+	return ok;
+}
+
+void report_ring_get_stats(const struct report_ring *ring, struct bt_hid_ring_stats *stats)
+{
+	*stats = (struct bt_hid_ring_stats){
+		.written = ring->head,
+		.read = ring->tail,
+		.dropped = ring->dropped,
+		.overrun = ring->overrun,
+		.high_water = ring->high_water,
+	};
+}
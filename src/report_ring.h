@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef REPORT_RING_H
+#define REPORT_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bt_hid.h"
+
+// Number of reports buffered between the BT core and the app, shared by all
+// the controllers. Must be a power of two. 64 is about 20 ms of four
+// controllers at 800 Hz.
+#ifndef REPORT_RING_DEPTH
+#define REPORT_RING_DEPTH 64
+#endif
+
+// What to do when the app falls behind and the ring fills up:
+//  0: Drop the incoming report, keeping the oldest ones (default)
+//  1: Overwrite the oldest report, so the app always sees the most recent
+//     REPORT_RING_DEPTH reports
+#ifndef REPORT_RING_OVERWRITE
+#define REPORT_RING_OVERWRITE 0
+#endif
+
+#if (REPORT_RING_DEPTH & (REPORT_RING_DEPTH - 1)) != 0
+#error "REPORT_RING_DEPTH must be a power of two"
+#endif
+
+struct report_ring_slot {
+	// Index + 1 of the report in this slot, written after the contents so
+	// the reader can tell if it was overwritten while copying it out.
+	volatile uint32_t seq;
+	struct bt_hid_report report;
+};
+
+// Lock-free single-producer (BT core), single-consumer (app core) ring.
+// head and the producer-side counters are only written by the producer,
+// tail and overrun only by the consumer.
+struct report_ring {
+	volatile uint32_t head;
+	volatile uint32_t tail;
+
+	volatile uint32_t dropped;
+	volatile uint32_t overrun;
+	volatile uint32_t high_water;
+
+	struct report_ring_slot slots[REPORT_RING_DEPTH];
+};
+
+void report_ring_init(struct report_ring *ring);
+
+// Producer side. Returns false if the report had to be dropped.
+bool report_ring_write(struct report_ring *ring, const struct bt_hid_report *report);
+
+// Consumer side. Copy out up to max reports, oldest first, returning how
+// many were copied.
+unsigned report_ring_read(struct report_ring *ring, struct bt_hid_report *dst, unsigned max);
+
+// Consumer side, zero-copy. Peek at the oldest report without taking it,
+// returning NULL if the ring is empty. The slot isn't handed back to the
+// producer until report_ring_release(), which returns false if it was
+// overwritten in the meantime anyway.
+const struct bt_hid_report *report_ring_peek(struct report_ring *ring);
+bool report_ring_release(struct report_ring *ring);
+
+void report_ring_get_stats(const struct report_ring *ring, struct bt_hid_ring_stats *stats);
+
+#endif // REPORT_RING_H
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#include <stdint.h>
+
+#include "bt_hid.h"
+#include "stick.h"
+
+#define Q15_ONE 32767
+
+// The table holds, for each radius n, the output length divided by n, so
+// multiplying a component by it scales the vector to the output length.
+// Q15 output and 15 fractional bits for the gain: a component is at most n,
+// so the product always fits in 32 bits.
+#define STICK_GAIN_SHIFT 15
+
+// Position between the deadzone and the outer edge, Q15
+#define STICK_T(n) \
+	((n) <= STICK_DEADZONE ? 0 : \
+	 (n) >= STICK_OUTER ? Q15_ONE : \
+	 ((n) - STICK_DEADZONE) * Q15_ONE / (STICK_OUTER - STICK_DEADZONE))
+
+#define STICK_CUBE(t) ((int32_t)(((int64_t)(t) * (t) * (t)) >> 30))
+
+#define STICK_CURVE(t) ((t) + (int32_t)(((int64_t)STICK_EXPO * (STICK_CUBE(t) - (t))) >> 15))
+
+#define STICK_OUT(n) \
+	(STICK_T(n) ? STICK_ANTI_DEADZONE + \
+	 (int32_t)((int64_t)STICK_CURVE(STICK_T(n)) * (Q15_ONE - STICK_ANTI_DEADZONE) / Q15_ONE) : 0)
+
+#define STICK_GAIN(n) ((n) ? (int32_t)(((int64_t)STICK_OUT(n) << STICK_GAIN_SHIFT) / (n)) : 0)
+
+#define G4(n)  STICK_GAIN(n), STICK_GAIN((n) + 1), STICK_GAIN((n) + 2), STICK_GAIN((n) + 3)
+#define G16(n) G4(n), G4((n) + 4), G4((n) + 8), G4((n) + 12)
+
+// Indexed by radius. Only up to 180 (the corners) is reachable, the rest is
+// there to keep it a round 256.
+static const int32_t stick_gain[256] = {
+	G16(0),   G16(16),  G16(32),  G16(48),  G16(64),  G16(80),  G16(96),  G16(112),
+	G16(128), G16(144), G16(160), G16(176), G16(192), G16(208), G16(224), G16(240),
+};
+
+// floor(sqrt(v)), for v < 2^16
+static inline uint32_t stick_isqrt(uint32_t v)
+{
+	uint32_t root = 0;
+
+	for (uint32_t bit = 1u << 14; bit; bit >>= 2) {
+		if (v >= root + bit) {
+			v -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+	}
+
+	return root;
+}
+
+static inline int32_t stick_centre(uint8_t raw)
+{
+	int32_t v = (int32_t)raw - 0x80;
+
+	// -128 to 127, make it symmetrical
+	return v < -127 ? -127 : v;
+}
+
+static inline int16_t stick_scale(int32_t v, int32_t gain)
+{
+	int32_t out = ((v < 0 ? -v : v) * gain) >> STICK_GAIN_SHIFT;
+
+	// Only the rounding in the square root can take it over
+	if (out > Q15_ONE) {
+		out = Q15_ONE;
+	}
+
+	return v < 0 ? -out : out;
+}
+
+void stick_condition(uint8_t raw_x, uint8_t raw_y, int16_t *x, int16_t *y)
+{
+	int32_t cx = stick_centre(raw_x);
+	int32_t cy = -stick_centre(raw_y);
+	int32_t gain = stick_gain[stick_isqrt(cx * cx + cy * cy)];
+
+	*x = stick_scale(cx, gain);
+	*y = stick_scale(cy, gain);
+}
+
+void stick_condition_state(const struct bt_hid_state *state, struct bt_hid_sticks *dst)
+{
+	stick_condition(state->lx, state->ly, &dst->lx, &dst->ly);
+	stick_condition(state->rx, state->ry, &dst->rx, &dst->ry);
+}
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2023 Brian Starkey <stark3y@gmail.com>
+
+#ifndef STICK_H
+#define STICK_H
+
+#include <stdint.h>
+
+#include "bt_hid.h"
+
+// Stick conditioning, run once per report on the BT core, so the app gets
+// struct bt_hid_sticks ready to use. Each stick is treated as a vector:
+// the deadzone is a circle, not a square, so diagonals behave the same as
+// straight lines. Then the response curve is applied to the length, which
+// keeps the direction.
+//
+// All of it is folded into one table, built by the compiler, which is
+// indexed by the (integer) radius. Per stick that's an integer square root,
+// a lookup and two multiplies, with no floating point.
+
+// Radius in raw stick counts (the stick goes from -127 to 127) which reads
+// as centred
+#ifndef STICK_DEADZONE
+#define STICK_DEADZONE 10
+#endif
+
+// Radius beyond which it's full deflection. Most sticks don't quite reach
+// the edges, especially on the diagonals.
+#ifndef STICK_OUTER
+#define STICK_OUTER 120
+#endif
+
+// Output (Q15) just outside the deadzone, for things which don't move at
+// all below some minimum
+#ifndef STICK_ANTI_DEADZONE
+#define STICK_ANTI_DEADZONE 0
+#endif
+
+// Response curve, a Q15 blend between linear (0) and cubic (32767). Cubic
+// gives finer control near the middle.
+#ifndef STICK_EXPO
+#define STICK_EXPO 16384
+#endif
+
+#if (STICK_DEADZONE < 0) || (STICK_OUTER <= STICK_DEADZONE) || (STICK_OUTER > 127)
+#error "Need 0 <= STICK_DEADZONE < STICK_OUTER <= 127"
+#endif
+
+#if (STICK_ANTI_DEADZONE < 0) || (STICK_ANTI_DEADZONE > 32767) || (STICK_EXPO < 0) || (STICK_EXPO > 32767)
+#error "STICK_ANTI_DEADZONE and STICK_EXPO are Q15, 0 to 32767"
+#endif
+
+// Condition one stick. raw_x and raw_y are as in the report, 0x80 centred,
+// with y increasing downwards.
+void stick_condition(uint8_t raw_x, uint8_t raw_y, int16_t *x, int16_t *y);
+
+// Both sticks from a decoded state
+void stick_condition_state(const struct bt_hid_state *state, struct bt_hid_sticks *dst);
+
+#endif // STICK_H